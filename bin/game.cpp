@@ -1,20 +1,41 @@
-#include "json.hpp"
 #include "raylib.h"
 #include "raymath.h"
 #include "rlgl.h"
 #include <algorithm>
+#include <array>
 #include <asm-generic/errno.h>
+#include <atomic>
+#include <cctype>
+#include <chrono>
 #include <cmath>
+#include <condition_variable>
+#include <cstddef>
 #include <cstdio>
+#include <cstring>
+#include <deque>
+#include <fcntl.h>
 #include <filesystem>
 #include <fstream>
+#include <functional>
 #include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
 #include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
 #include <unordered_map>
 #include <unordered_set>
 #include <vector>
 
-using json = nlohmann::json;
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 namespace fs = std::filesystem;
 
 #define HASHMAP_GET_OR_NULL(map, key) \
@@ -24,12 +45,52 @@ namespace fs = std::filesystem;
 // #define LEVEL "level_1"
 #define LEVELS_DIR "./resources/tiled/"
 #define LEVEL "level_0"
+#define SPRITE_SHEETS_DIR "./resources/sprite_sheets/"
+#define ATLAS_FILE_PATH "./resources/atlas.png"
 
 #define SCREEN_WIDTH 1920
 #define SCREEN_HEIGHT 1080
+
+// simulation runs at a fixed rate, independent of rendering. A long frame
+// runs at most MAX_N_TICKS_PER_FRAME ticks, the rest of time is dropped
+#define TICK_RATE 60
+#define TICK_DT (1.0f / TICK_RATE)
+#define MAX_N_TICKS_PER_FRAME 5
+#define HEADLESS_DEFAULT_N_TICKS (60 * TICK_RATE)
+#define MAX_N_LIGHTS 256
+
+// each shadow casting light owns a slot of the shadow atlas, slot is a shadow
+// mask of the whole view. Only the closest lights inside the view get a slot
 #define SHADOW_MAP_WIDTH 512
 #define SHADOW_MAP_HEIGHT 512
-#define MAX_N_LIGHTS 32
+#define SHADOW_ATLAS_N_COLS 4
+#define SHADOW_ATLAS_N_ROWS 2
+#define MAX_N_SHADOW_LIGHTS (SHADOW_ATLAS_N_COLS * SHADOW_ATLAS_N_ROWS)
+
+// low-res scene target has this many pixels per world unit of the camera
+// view, the target is upscaled to the window in a single pass
+#define DEFAULT_LOW_RES_SCALE 1
+
+// texture slots of the tile and sprite shaders
+#define SCENE_TEXTURE_SLOT 0
+#define SCENE_SHADOW_ATLAS_SLOT 1
+
+// static shadows are built for the view rect snapped outwards to this grid, so
+// they are rebuilt only when the view crosses a grid line or the light moves
+// further than the max shift
+#define SHADOW_RECT_SNAP 64
+#define SHADOW_CACHE_MAX_LIGHT_SHIFT 0.5
+
+// view is split into tiles, each tile is lit only by the lights which reach it
+#define N_LIGHT_TILES_X 16
+#define N_LIGHT_TILES_Y 9
+
+#define CAMERA_BLOCK_BINDING 0
+#define LIGHTS_BLOCK_BINDING 1
+#define LIGHT_TILES_BLOCK_BINDING 2
+
+// light is culled when its contribution at the view edge is below this
+#define LIGHT_MIN_INTENSITY 0.01
 
 #define VIEW_LINE_Y_OFFSET -16
 
@@ -51,47 +112,833 @@ namespace fs = std::filesystem;
 #define CREATURE_VIEW_DISTANCE 200
 #define CREATURE_MAX_VIEW_ANGLE 20
 
+// creatures closer than this to the player test the line of sight every
+// tick, the farther ones reuse it for a few ticks. Mobs beyond the wake
+// distance are dormant: no animation, no behaviour and no integration
+#define PERCEPTION_NEAR_DISTANCE 100
+#define PERCEPTION_FAR_N_TICKS 8
+#define WAKE_DISTANCE 400
+
 #define PLATFORM_SPEED 50
 
+// steps of the ccd bodies longer than this are swept against the static
+// colliders instead of tunneling through them. Swept contacts keep the
+// skin of overlap, so the mtv resolve still sees them
+#define CCD_MIN_STEP 4.0
+#define CONTACT_SKIN 0.01
+
+#define BROADPHASE_CELL_N_TILES 4
+
 // -----------------------------------------------------------------------
 // utils
-json load_json(std::string file_path) {
-    std::ifstream file(file_path);
-    if (!file.is_open()) {
-        throw std::runtime_error("Failed to open file: " + file_path);
-    }
+// fnv-1a, the previous hash continues it over more data
+uint64_t get_fnv_hash(
+    const void *data, size_t size, uint64_t hash = 14695981039346656037ull
+) {
+    const uint8_t *bytes = (const uint8_t *)data;
+    for (size_t i = 0; i < size; ++i) hash = (hash ^ bytes[i]) * 1099511628211ull;
+    return hash;
+}
 
-    auto data = json::parse(file);
-    file.close();
-    return data;
+// modification time of the file in nanoseconds, -1 if there is no such file
+int64_t get_file_mtime(const std::string &file_path) {
+    struct stat file_stat;
+    if (stat(file_path.c_str(), &file_stat) == -1) return -1;
+    return (int64_t)file_stat.st_mtim.tv_sec * 1000000000 + file_stat.st_mtim.tv_nsec;
 }
 
-std::string load_shader_src(const std::string &file_name) {
-    const std::string version_src = "#version 460 core";
-    std::ifstream common_file("resources/shaders/common.glsl");
-    std::ifstream shader_file("resources/shaders/" + file_name);
+// pcg32. The simulation draws only from the game's own generator, so a run
+// is reproduced by its seed and its input
+class Rng {
+  private:
+    uint64_t state = 0;
 
-    std::stringstream common_stream, shader_stream;
-    common_stream << common_file.rdbuf();
-    shader_stream << shader_file.rdbuf();
+  public:
+    Rng() = default;
+    Rng(uint64_t seed)
+        : state(seed + 0x853c49e6748fea9bull) {
+        this->next();
+    }
 
-    std::string common_src = common_stream.str();
-    std::string shader_src = shader_stream.str();
+    uint32_t next() {
+        uint64_t state = this->state;
+        this->state = state * 6364136223846793005ull + 1442695040888963407ull;
+        uint32_t xorshifted = ((state >> 18) ^ state) >> 27;
+        uint32_t rot = state >> 59;
+        return (xorshifted >> rot) | (xorshifted << ((32 - rot) & 31));
+    }
 
-    std::string full_src = version_src + "\n" + common_src + "\n" + shader_src;
+    // in [0, n)
+    int next_int(int n) {
+        return this->next() % n;
+    }
 
-    return full_src;
-}
+    uint64_t get_state() {
+        return this->state;
+    }
+};
+
+// -----------------------------------------------------------------------
+// baked resources
+// Json is only the authoring format, tools/bake_resources.py bakes levels
+// and sprite sheets into binary files which are mapped into memory and used
+// in place. All tables are referenced by their byte offsets from the file
+// start, strings are offsets into the null-terminated strings table.
+// Layouts below must match the baker
+#define BAKED_VERSION 1
+#define BAKED_LEVEL_MAGIC "NDLV"
+#define BAKED_SPRITE_SHEET_MAGIC "NDSS"
+#define BAKED_ATLAS_MAGIC "NDAT"
+
+typedef struct BakedLevelHeader {
+    char magic[4];
+    uint32_t version;
+    uint32_t tile_width;
+    uint32_t tile_height;
+    uint32_t n_tile_sheets;
+    uint32_t n_chunks;
+    uint32_t n_objects;
+    uint32_t n_tile_ids;
+    uint32_t tile_sheets_offset;
+    uint32_t chunks_offset;
+    uint32_t objects_offset;
+    uint32_t tile_ids_offset;
+    uint32_t strings_offset;
+    uint32_t strings_size;
+} BakedLevelHeader;
+
+typedef struct BakedTileSheet {
+    uint32_t first_tile_id;
+    uint32_t tile_width;
+    uint32_t tile_height;
+    uint32_t n_tiles;
+    uint32_t n_cols;
+    uint32_t image_offset;  // relative to the level dir
+} BakedTileSheet;
+
+// chunk position and size are in tiles, its tile ids are width * height
+// entries of the tile ids table starting from the first_tile_id_idx
+typedef struct BakedChunk {
+    int32_t x;
+    int32_t y;
+    uint32_t width;
+    uint32_t height;
+    uint32_t first_tile_id_idx;
+} BakedChunk;
+
+typedef struct BakedObject {
+    uint32_t id;
+    float x;
+    float y;
+    float width;
+    float height;
+    uint32_t type_offset;
+    uint32_t tag_offset;
+    int32_t destination_idx;  // index in the objects table, -1 if none
+} BakedObject;
+
+typedef struct BakedSpriteSheetHeader {
+    char magic[4];
+    uint32_t version;
+    uint32_t n_animations;
+    uint32_t n_frames;
+    uint32_t animations_offset;
+    uint32_t frames_offset;
+    uint32_t strings_offset;
+    uint32_t strings_size;
+} BakedSpriteSheetHeader;
+
+typedef struct BakedAtlasHeader {
+    char magic[4];
+    uint32_t version;
+    uint32_t width;
+    uint32_t height;
+    uint32_t n_images;
+    uint32_t images_offset;
+    uint32_t strings_offset;
+    uint32_t strings_size;
+} BakedAtlasHeader;
+
+// gpu-ready texture: premultiplied RGBA8 rows without mipmaps, split into
+// bands which are decoded and uploaded one by one
+#define BAKED_TEXTURE_MAGIC "NDTX"
+#define BAKED_TEXTURE_RAW 0
+#define BAKED_TEXTURE_DEFLATE 1
+
+typedef struct BakedTextureHeader {
+    char magic[4];
+    uint32_t version;
+    uint32_t width;
+    uint32_t height;
+    uint32_t format;
+    uint32_t band_height;  // the last band may be shorter
+    uint32_t n_bands;
+    uint32_t bands_offset;
+    uint32_t data_offset;
+    uint32_t strings_offset;
+    uint32_t strings_size;
+} BakedTextureHeader;
+
+typedef struct BakedTextureBand {
+    uint32_t offset;  // in the data table
+    uint32_t size;
+} BakedTextureBand;
+
+// source image rect in the atlas, in pixels
+typedef struct BakedAtlasImage {
+    uint32_t path_offset;  // normalized, relative to the game dir
+    uint32_t x;
+    uint32_t y;
+    uint32_t width;
+    uint32_t height;
+} BakedAtlasImage;
+
+// read-only mapping of the whole file, movable but not copyable
+class MappedFile {
+  private:
+    std::string file_path;
+    const char *data = nullptr;
+    size_t size = 0;
+    int64_t mtime = -1;
+
+    void unmap() {
+        if (this->data) munmap((void *)this->data, this->size);
+        this->data = nullptr;
+        this->size = 0;
+    }
+
+  public:
+    MappedFile() = default;
+
+    MappedFile(const std::string &file_path)
+        : file_path(file_path) {
+        int fd = open(file_path.c_str(), O_RDONLY);
+        if (fd == -1) {
+            throw std::runtime_error(
+                "Failed to open file: " + file_path
+                + " (run tools/bake_resources.py to bake it)"
+            );
+        }
+
+        struct stat file_stat;
+        if (fstat(fd, &file_stat) == -1 || file_stat.st_size == 0) {
+            close(fd);
+            throw std::runtime_error("Failed to map file: " + file_path);
+        }
+
+        this->size = file_stat.st_size;
+        // mtime of the mapped inode, not of whatever the path names later
+        this->mtime = (int64_t)file_stat.st_mtim.tv_sec * 1000000000
+                      + file_stat.st_mtim.tv_nsec;
+        void *data = mmap(nullptr, this->size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (data == MAP_FAILED) {
+            this->size = 0;
+            throw std::runtime_error("Failed to map file: " + file_path);
+        }
+        this->data = (const char *)data;
+    }
+
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    MappedFile(MappedFile &&other)
+        : file_path(std::move(other.file_path))
+        , data(other.data)
+        , size(other.size)
+        , mtime(other.mtime) {
+        other.data = nullptr;
+        other.size = 0;
+    }
+
+    MappedFile &operator=(MappedFile &&other) {
+        if (this == &other) return *this;
+
+        this->unmap();
+        this->file_path = std::move(other.file_path);
+        this->data = other.data;
+        this->size = other.size;
+        this->mtime = other.mtime;
+        other.data = nullptr;
+        other.size = 0;
+        return *this;
+    }
+
+    ~MappedFile() {
+        this->unmap();
+    }
+
+    // header is checked once when the file is loaded, tables are checked
+    // to lie inside the file when they are taken, so the baked data can be
+    // used without any checks afterwards
+    template <typename Header> const Header *get_header(const char *magic) {
+        const Header *header = this->get_table<Header>(0, 1);
+        if (std::memcmp(header->magic, magic, 4) != 0) {
+            throw std::runtime_error("Not a baked file: " + this->file_path);
+        }
+        if (header->version != BAKED_VERSION) {
+            throw std::runtime_error(
+                "Outdated baked file: " + this->file_path
+                + " (run tools/bake_resources.py to rebake it)"
+            );
+        }
+        return header;
+    }
+
+    template <typename T> const T *get_table(uint32_t offset, uint32_t n_items) {
+        this->check(
+            offset % alignof(T) == 0 && offset <= this->size
+            && n_items <= (this->size - offset) / sizeof(T)
+        );
+        return (const T *)(this->data + offset);
+    }
+
+    // strings table must end with the null, so any offset inside it is
+    // a valid string
+    const char *get_strings(uint32_t offset, uint32_t size) {
+        const char *strings = this->get_table<char>(offset, size);
+        this->check(size > 0 && strings[size - 1] == '\0');
+        return strings;
+    }
+
+    void check(bool is_valid) {
+        if (!is_valid) {
+            throw std::runtime_error("Corrupted baked file: " + this->file_path);
+        }
+    }
+
+    // the baker renames a rebaked file over the old one (see _write_file in
+    // tools/bake_resources.py), so the mapping keeps the old inode and its
+    // contents stay valid until the file is mapped again. A file rewritten
+    // in place by anything else breaks this
+    bool is_outdated() {
+        return get_file_mtime(this->file_path) != this->mtime;
+    }
+};
+
+// -----------------------------------------------------------------------
+// gpu buffers
+// rlgl doesn't wrap uniform buffer bindings, so this entry point is taken
+// directly from the gl loader bundled into raylib
+#define GL_UNIFORM_BUFFER 0x8A11
+extern "C" void (*glad_glBindBufferBase)(
+    unsigned int target, unsigned int index, unsigned int buffer
+);
+
+class UniformBuffer {
+  private:
+    unsigned int id = 0;
+
+  public:
+    UniformBuffer() = default;
+
+    // the block binding is global gl state, so it's done only once here
+    UniformBuffer(unsigned int size, unsigned int binding) {
+        this->id = rlLoadShaderBuffer(size, NULL, RL_DYNAMIC_DRAW);
+        glad_glBindBufferBase(GL_UNIFORM_BUFFER, binding, this->id);
+    }
+
+    void update(const void *data, unsigned int size) {
+        rlUpdateShaderBuffer(this->id, data, size, 0);
+    }
+
+    void unload() {
+        rlUnloadShaderBuffer(this->id);
+    }
+};
+
+class StorageBuffer {
+  private:
+    unsigned int id = 0;
+
+  public:
+    StorageBuffer() = default;
+
+    StorageBuffer(unsigned int size, unsigned int binding) {
+        this->id = rlLoadShaderBuffer(size, NULL, RL_DYNAMIC_DRAW);
+        rlBindShaderBuffer(this->id, binding);
+    }
+
+    void update(const void *data, unsigned int size) {
+        rlUpdateShaderBuffer(this->id, data, size, 0);
+    }
+
+    void unload() {
+        rlUnloadShaderBuffer(this->id);
+    }
+};
+
+// rlgl binds vertexPosition to this attribute location in every shader
+#define VERTEX_POSITION_ATTRIB 0
+
+// dynamic buffer of triangle vertices, drawn with a single draw call
+class TriangleBuffer {
+  private:
+    unsigned int vao_id = 0;
+    unsigned int vbo_id = 0;
+    int capacity = 0;
+    int n_vertices = 0;
+
+    void load(int capacity) {
+        this->capacity = capacity;
+        this->vao_id = rlLoadVertexArray();
+        rlEnableVertexArray(this->vao_id);
+        this->vbo_id = rlLoadVertexBuffer(NULL, capacity * sizeof(Vector3), true);
+        rlSetVertexAttribute(VERTEX_POSITION_ATTRIB, 3, RL_FLOAT, false, 0, 0);
+        rlEnableVertexAttribute(VERTEX_POSITION_ATTRIB);
+        rlDisableVertexArray();
+    }
+
+  public:
+    TriangleBuffer() = default;
+
+    TriangleBuffer(int capacity) {
+        this->load(capacity);
+    }
+
+    // the buffer grows if the vertices don't fit
+    void update(const std::vector<Vector3> &vertices) {
+        this->n_vertices = vertices.size();
+        if (this->n_vertices > this->capacity) {
+            this->unload();
+            this->load(std::max(this->n_vertices, 2 * this->capacity));
+        }
+
+        if (this->n_vertices == 0) return;
+        unsigned int size = this->n_vertices * sizeof(Vector3);
+        rlUpdateVertexBuffer(this->vbo_id, vertices.data(), size, 0);
+    }
+
+    void draw() {
+        if (this->n_vertices == 0) return;
+        rlEnableVertexArray(this->vao_id);
+        rlDrawVertexArray(0, this->n_vertices);
+        rlDisableVertexArray();
+    }
+
+    void unload() {
+        rlUnloadVertexBuffer(this->vbo_id);
+        rlUnloadVertexArray(this->vao_id);
+    }
+};
+
+// persistently mapped buffers, fences and instanced draws aren't wrapped
+// by rlgl either
+#define GL_ARRAY_BUFFER 0x8892
+#define GL_MAP_WRITE_BIT 0x0002
+#define GL_MAP_PERSISTENT_BIT 0x0040
+#define GL_MAP_COHERENT_BIT 0x0080
+#define GL_SYNC_GPU_COMMANDS_COMPLETE 0x9117
+#define GL_SYNC_FLUSH_COMMANDS_BIT 0x0001
+#define GL_TIMEOUT_EXPIRED 0x911B
+typedef struct __GLsync *GLsync;
+extern "C" void (*glad_glGenBuffers)(int n, unsigned int *buffers);
+extern "C" void (*glad_glDeleteBuffers)(int n, const unsigned int *buffers);
+extern "C" void (*glad_glBindBuffer)(unsigned int target, unsigned int buffer);
+extern "C" void (*glad_glBufferStorage)(
+    unsigned int target, intptr_t size, const void *data, unsigned int flags
+);
+extern "C" void *(*glad_glMapBufferRange)(
+    unsigned int target, intptr_t offset, intptr_t length, unsigned int access
+);
+extern "C" unsigned char (*glad_glUnmapBuffer)(unsigned int target);
+extern "C" GLsync (*glad_glFenceSync)(unsigned int condition, unsigned int flags);
+extern "C" unsigned int (*glad_glClientWaitSync)(
+    GLsync sync, unsigned int flags, uint64_t timeout
+);
+extern "C" void (*glad_glDeleteSync)(GLsync sync);
+extern "C" void (*glad_glDrawArraysInstancedBaseInstance)(
+    unsigned int mode, int first, int count, int n_instances, unsigned int base_instance
+);
+
+// float attribute of the instance struct
+class InstanceAttribute {
+  public:
+    unsigned int location;
+    int size;  // in floats
+    int offset;  // in bytes
+};
+
+// the buffer is split into a part per frame in flight. Each frame writes
+// its own part through the persistent mapping, the fence of the part keeps
+// the cpu from overwriting the instances the gpu still reads
+#define INSTANCE_BUFFER_N_FRAMES 3
+
+class InstanceBuffer {
+  private:
+    unsigned int vao_id = 0;
+    unsigned int buffer_id = 0;
+    unsigned char *data = nullptr;
+    int instance_size = 0;
+    int capacity = 0;  // instances per frame
+    std::vector<InstanceAttribute> attributes;
+
+    int frame_idx = 0;
+    GLsync fences[INSTANCE_BUFFER_N_FRAMES] = {};
+
+    void load(int capacity) {
+        this->capacity = capacity;
+        intptr_t size = (intptr_t)INSTANCE_BUFFER_N_FRAMES * capacity
+                        * this->instance_size;
+        unsigned int flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT
+                             | GL_MAP_COHERENT_BIT;
+
+        this->vao_id = rlLoadVertexArray();
+        rlEnableVertexArray(this->vao_id);
+        glad_glGenBuffers(1, &this->buffer_id);
+        glad_glBindBuffer(GL_ARRAY_BUFFER, this->buffer_id);
+        glad_glBufferStorage(GL_ARRAY_BUFFER, size, NULL, flags);
+        this->data = (unsigned char *)glad_glMapBufferRange(
+            GL_ARRAY_BUFFER, 0, size, flags
+        );
+        for (const InstanceAttribute &attribute : this->attributes) {
+            rlSetVertexAttribute(
+                attribute.location,
+                attribute.size,
+                RL_FLOAT,
+                false,
+                this->instance_size,
+                (const void *)(intptr_t)attribute.offset
+            );
+            rlSetVertexAttributeDivisor(attribute.location, 1);
+            rlEnableVertexAttribute(attribute.location);
+        }
+        rlDisableVertexArray();
+        glad_glBindBuffer(GL_ARRAY_BUFFER, 0);
+    }
+
+    void wait_fence(int frame_idx) {
+        GLsync &fence = this->fences[frame_idx];
+        if (!fence) return;
+
+        while (glad_glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000)
+               == GL_TIMEOUT_EXPIRED) {}
+        glad_glDeleteSync(fence);
+        fence = nullptr;
+    }
+
+  public:
+    InstanceBuffer() = default;
+
+    InstanceBuffer(
+        int instance_size, int capacity, std::vector<InstanceAttribute> attributes
+    )
+        : instance_size(instance_size)
+        , attributes(attributes) {
+        this->load(capacity);
+    }
+
+    // copies the instances of the frame, called once per frame before the
+    // draws. The buffer grows if the instances don't fit
+    void update(const void *instances, int n_instances) {
+        if (n_instances > this->capacity) {
+            this->unload();
+            this->load(std::max(n_instances, 2 * this->capacity));
+        }
+
+        this->wait_fence(this->frame_idx);
+        int size = n_instances * this->instance_size;
+        int offset = this->frame_idx * this->capacity * this->instance_size;
+        std::memcpy(this->data + offset, instances, size);
+    }
+
+    // draws the range of the updated instances
+    void draw(int first_instance, int n_instances, int n_vertices) {
+        if (n_instances == 0) return;
+        rlEnableVertexArray(this->vao_id);
+        glad_glDrawArraysInstancedBaseInstance(
+            RL_TRIANGLES,
+            0,
+            n_vertices,
+            n_instances,
+            this->frame_idx * this->capacity + first_instance
+        );
+        rlDisableVertexArray();
+    }
+
+    // called after the last draw of the frame
+    void end_frame() {
+        this->fences[this->frame_idx] = glad_glFenceSync(
+            GL_SYNC_GPU_COMMANDS_COMPLETE, 0
+        );
+        this->frame_idx = (this->frame_idx + 1) % INSTANCE_BUFFER_N_FRAMES;
+    }
+
+    void unload() {
+        for (int i = 0; i < INSTANCE_BUFFER_N_FRAMES; ++i) {
+            this->wait_fence(i);
+        }
+        glad_glBindBuffer(GL_ARRAY_BUFFER, this->buffer_id);
+        glad_glUnmapBuffer(GL_ARRAY_BUFFER);
+        glad_glBindBuffer(GL_ARRAY_BUFFER, 0);
+        glad_glDeleteBuffers(1, &this->buffer_id);
+        rlUnloadVertexArray(this->vao_id);
+        this->data = nullptr;
+    }
+};
+
+// std140 mirrors of the common.glsl uniform blocks
+typedef struct CameraBlock {
+    float view_width;
+    float aspect;
+    Vector2 target;
+} CameraBlock;
+
+typedef struct LightBlock {
+    Vector2 position;
+    float intensity;
+    float _pad0;
+    Vector3 color;
+    float _pad1;
+    Vector3 attenuation;
+    int shadow_slot;
+} LightBlock;
+
+typedef struct LightsBlock {
+    int n_lights;
+    int _pad[3];
+    LightBlock lights[MAX_N_LIGHTS];
+} LightsBlock;
+
+// std430 light tiles block layout (see sprite.frag): (offset, count) range
+// per tile followed by the light ids of all tiles
+#define N_LIGHT_TILES (N_LIGHT_TILES_X * N_LIGHT_TILES_Y)
+#define LIGHT_TILES_BLOCK_MAX_SIZE \
+    ((2 * N_LIGHT_TILES + N_LIGHT_TILES * MAX_N_LIGHTS) * sizeof(uint32_t))
 
-Shader load_shader(const std::string &vs_file_name, const std::string &fs_file_name) {
-    std::string vs, fs;
+// -----------------------------------------------------------------------
+// shaders
+// permutations of a program are compiled from the same sources with the
+// extra #define lines. Linked programs are cached on disk as the driver
+// binaries, keyed by the hash of the full sources and the driver, so the
+// next launch compiles only the changed ones
+#define SHADERS_DIR "./resources/shaders/"
+#define SHADER_CACHE_DIR "./build/shader_cache/"
+#define SHADER_CACHE_MAGIC "NDSP"
+#define SHADER_CACHE_VERSION 1
+
+#define GL_VENDOR 0x1F00
+#define GL_RENDERER 0x1F01
+#define GL_VERSION 0x1F02
+#define GL_LINK_STATUS 0x8B82
+#define GL_PROGRAM_BINARY_LENGTH 0x8741
+
+extern "C" const unsigned char *(*glad_glGetString)(unsigned int name);
+extern "C" unsigned int (*glad_glCreateProgram)();
+extern "C" void (*glad_glDeleteProgram)(unsigned int program);
+extern "C" void (*glad_glGetProgramiv)(
+    unsigned int program, unsigned int name, int *value
+);
+extern "C" void (*glad_glGetProgramBinary)(
+    unsigned int program, int size, int *length, unsigned int *format, void *binary
+);
+extern "C" void (*glad_glProgramBinary)(
+    unsigned int program, unsigned int format, const void *binary, int length
+);
+
+typedef struct ShaderCacheHeader {
+    char magic[4];
+    uint32_t version;
+    uint32_t binary_format;
+    uint32_t binary_size;
+} ShaderCacheHeader;
+
+// the same locations raylib looks up for the shaders it loads itself
+Shader get_program_shader(unsigned int id) {
+    Shader shader = {.id = id};
+    if (id == rlGetShaderIdDefault()) {
+        shader.locs = rlGetShaderLocsDefault();
+        return shader;
+    }
+
+    shader.locs = (int *)RL_CALLOC(RL_MAX_SHADER_LOCATIONS, sizeof(int));
+    for (int i = 0; i < RL_MAX_SHADER_LOCATIONS; ++i) shader.locs[i] = -1;
+
+    int *locs = shader.locs;
+    locs[SHADER_LOC_VERTEX_POSITION] = rlGetLocationAttrib(id, "vertexPosition");
+    locs[SHADER_LOC_VERTEX_TEXCOORD01] = rlGetLocationAttrib(id, "vertexTexCoord");
+    locs[SHADER_LOC_VERTEX_TEXCOORD02] = rlGetLocationAttrib(id, "vertexTexCoord2");
+    locs[SHADER_LOC_VERTEX_NORMAL] = rlGetLocationAttrib(id, "vertexNormal");
+    locs[SHADER_LOC_VERTEX_TANGENT] = rlGetLocationAttrib(id, "vertexTangent");
+    locs[SHADER_LOC_VERTEX_COLOR] = rlGetLocationAttrib(id, "vertexColor");
+    locs[SHADER_LOC_MATRIX_MVP] = rlGetLocationUniform(id, "mvp");
+    locs[SHADER_LOC_MATRIX_VIEW] = rlGetLocationUniform(id, "matView");
+    locs[SHADER_LOC_MATRIX_PROJECTION] = rlGetLocationUniform(id, "matProjection");
+    locs[SHADER_LOC_MATRIX_MODEL] = rlGetLocationUniform(id, "matModel");
+    locs[SHADER_LOC_MATRIX_NORMAL] = rlGetLocationUniform(id, "matNormal");
+    locs[SHADER_LOC_COLOR_DIFFUSE] = rlGetLocationUniform(id, "colDiffuse");
+    locs[SHADER_LOC_MAP_DIFFUSE] = rlGetLocationUniform(id, "texture0");
+    locs[SHADER_LOC_MAP_SPECULAR] = rlGetLocationUniform(id, "texture1");
+    locs[SHADER_LOC_MAP_NORMAL] = rlGetLocationUniform(id, "texture2");
 
-    vs = load_shader_src(vs_file_name);
-    fs = load_shader_src(fs_file_name);
-    Shader shader = LoadShaderFromMemory(vs.c_str(), fs.c_str());
     return shader;
 }
 
+class ShaderManager {
+  private:
+    // vendor, renderer and version, binaries of another driver don't load
+    std::string driver;
+
+    // sources are read once, common.glsl is shared by all of them
+    std::string constants_src;
+    std::unordered_map<std::string, std::string> sources;
+
+    // by the source file names and the defines
+    std::unordered_map<std::string, Shader> programs;
+
+    const std::string &get_source(const std::string &file_name) {
+        auto it = this->sources.find(file_name);
+        if (it != this->sources.end()) return it->second;
+
+        std::string file_path = SHADERS_DIR + file_name;
+        std::ifstream file(file_path);
+        if (!file) throw std::runtime_error("Failed to open file: " + file_path);
+
+        std::stringstream stream;
+        stream << file.rdbuf();
+        return this->sources[file_name] = stream.str();
+    }
+
+    std::string get_full_src(
+        const std::string &file_name, const std::vector<std::string> &defines
+    ) {
+        std::string src = "#version 460 core\n" + this->constants_src;
+        for (const std::string &define : defines) src += "#define " + define + "\n";
+        src += this->get_source("common.glsl") + "\n" + this->get_source(file_name);
+        return src;
+    }
+
+    // 0 if there is no cached binary or the driver rejects it
+    unsigned int load_cached_program(const std::string &file_path) {
+        std::ifstream file(file_path, std::ios::binary);
+        if (!file) return 0;
+
+        ShaderCacheHeader header;
+        file.read((char *)&header, sizeof(header));
+        if (!file || std::memcmp(header.magic, SHADER_CACHE_MAGIC, 4) != 0
+            || header.version != SHADER_CACHE_VERSION) {
+            return 0;
+        }
+        // a truncated or corrupted file must not size the buffer
+        std::error_code error;
+        uintmax_t file_size = fs::file_size(file_path, error);
+        if (error || header.binary_size > file_size - sizeof(header)) return 0;
+
+        std::vector<char> binary(header.binary_size);
+        if (!file.read(binary.data(), binary.size())) return 0;
+
+        unsigned int id = glad_glCreateProgram();
+        glad_glProgramBinary(id, header.binary_format, binary.data(), binary.size());
+
+        int is_linked = 0;
+        glad_glGetProgramiv(id, GL_LINK_STATUS, &is_linked);
+        if (!is_linked) {
+            glad_glDeleteProgram(id);
+            return 0;
+        }
+        return id;
+    }
+
+    // the cache is optional, a failed write only costs a compile next time
+    void save_cached_program(unsigned int id, const std::string &file_path) {
+        int size = 0;
+        glad_glGetProgramiv(id, GL_PROGRAM_BINARY_LENGTH, &size);
+        if (size <= 0) return;
+
+        ShaderCacheHeader header = {.version = SHADER_CACHE_VERSION};
+        std::memcpy(header.magic, SHADER_CACHE_MAGIC, 4);
+        std::vector<char> binary(size);
+        int length = 0;
+        glad_glGetProgramBinary(id, size, &length, &header.binary_format, binary.data());
+        if (length <= 0) return;
+        header.binary_size = length;
+
+        // written aside and renamed, so a crash or a concurrent launch never
+        // leaves a partial file under the cache key
+        std::error_code error;
+        fs::create_directories(SHADER_CACHE_DIR, error);
+        std::string tmp_file_path = file_path + ".tmp";
+        {
+            std::ofstream file(tmp_file_path, std::ios::binary);
+            file.write((const char *)&header, sizeof(header));
+            file.write(binary.data(), length);
+            if (!file.flush()) {
+                fs::remove(tmp_file_path, error);
+                return;
+            }
+        }
+        fs::rename(tmp_file_path, file_path, error);
+        if (error) fs::remove(tmp_file_path, error);
+    }
+
+  public:
+    int n_cached = 0;
+    int n_compiled = 0;
+
+    ShaderManager() = default;
+
+    // needs the gl context
+    void load() {
+        for (unsigned int name : {GL_VENDOR, GL_RENDERER, GL_VERSION}) {
+            const unsigned char *value = glad_glGetString(name);
+            if (value) this->driver += (const char *)value;
+            this->driver += "\n";
+        }
+
+        // constants shared between the game and the shaders
+        std::stringstream stream;
+        stream << "#define MAX_N_LIGHTS " << MAX_N_LIGHTS << "\n";
+        stream << "#define CAMERA_BLOCK_BINDING " << CAMERA_BLOCK_BINDING << "\n";
+        stream << "#define LIGHTS_BLOCK_BINDING " << LIGHTS_BLOCK_BINDING << "\n";
+        stream << "#define LIGHT_TILES_BLOCK_BINDING " << LIGHT_TILES_BLOCK_BINDING
+               << "\n";
+        stream << "#define N_LIGHT_TILES_X " << N_LIGHT_TILES_X << "\n";
+        stream << "#define N_LIGHT_TILES_Y " << N_LIGHT_TILES_Y << "\n";
+        stream << "#define SHADOW_ATLAS_N_COLS " << SHADOW_ATLAS_N_COLS << "\n";
+        stream << "#define SHADOW_ATLAS_N_ROWS " << SHADOW_ATLAS_N_ROWS << "\n";
+        this->constants_src = stream.str();
+    }
+
+    // defines are the #define bodies, e.g. "SHADOWS" or "N_SAMPLES 4"
+    Shader get(
+        const std::string &vs_file_name,
+        const std::string &fs_file_name,
+        const std::vector<std::string> &defines = {}
+    ) {
+        std::string key = vs_file_name + "|" + fs_file_name;
+        for (const std::string &define : defines) key += "|" + define;
+        auto it = this->programs.find(key);
+        if (it != this->programs.end()) return it->second;
+
+        std::string vs_src = this->get_full_src(vs_file_name, defines);
+        std::string fs_src = this->get_full_src(fs_file_name, defines);
+        uint64_t hash = get_fnv_hash(vs_src.data(), vs_src.size());
+        hash = get_fnv_hash(fs_src.data(), fs_src.size(), hash);
+        hash = get_fnv_hash(this->driver.data(), this->driver.size(), hash);
+
+        char file_name[32];
+        snprintf(file_name, sizeof(file_name), "%016llx.bin", (unsigned long long)hash);
+        std::string file_path = SHADER_CACHE_DIR + std::string(file_name);
+
+        unsigned int id = this->load_cached_program(file_path);
+        if (id != 0) {
+            this->n_cached += 1;
+        } else {
+            // a failed compile falls back to the default shader, it's not cached
+            id = rlLoadShaderCode(vs_src.c_str(), fs_src.c_str());
+            if (id != rlGetShaderIdDefault()) this->save_cached_program(id, file_path);
+            this->n_compiled += 1;
+        }
+
+        return this->programs[key] = get_program_shader(id);
+    }
+
+    void unload() {
+        for (auto &pair : this->programs) UnloadShader(pair.second);
+        this->programs.clear();
+    }
+};
+
 // -----------------------------------------------------------------------
 // geometry and collisions
 #define LEFT (1 << 0)
@@ -205,18 +1052,101 @@ Vector2 get_aabb_mtv(Rectangle r1, Rectangle r2) {
     return mtv;
 }
 
+// mtv of the rects after their steps which pushes r1 out through the side
+// it entered r2 from, so a relative step deeper than half of the rect
+// doesn't push it through. Rects overlapped before the steps, or entered
+// through a corner, fall back to the least penetration mtv
+Vector2 get_swept_aabb_mtv(Rectangle r1, Vector2 step1, Rectangle r2, Vector2 step2) {
+    Vector2 mtv = Vector2Zero();
+    if (!CheckCollisionRecs(r1, r2)) return mtv;
+
+    float x = r1.x - step1.x + step2.x;
+    float y = r1.y - step1.y + step2.y;
+    bool was_west = x + r1.width <= r2.x + CONTACT_SKIN;
+    bool was_east = x >= r2.x + r2.width - CONTACT_SKIN;
+    bool was_north = y + r1.height <= r2.y + CONTACT_SKIN;
+    bool was_south = y >= r2.y + r2.height - CONTACT_SKIN;
+    bool was_apart_x = was_west || was_east;
+    bool was_apart_y = was_north || was_south;
+    if (was_apart_x == was_apart_y) return get_aabb_mtv(r1, r2);
+
+    if (was_west) mtv.x = r2.x - r1.x - r1.width;
+    else if (was_east) mtv.x = r2.x + r2.width - r1.x;
+    else if (was_north) mtv.y = r2.y - r1.y - r1.height;
+    else mtv.y = r2.y + r2.height - r1.y;
+
+    return mtv;
+}
+
+// time of the first contact in [0, 1] of the rect moving by the step with
+// the other one, 1 if they don't meet. Already overlapping rects are left
+// to the mtv resolve, but the step mustn't push the rect deeper
+float get_aabb_toi(Rectangle r1, Vector2 step, Rectangle r2) {
+    if (CheckCollisionRecs(r1, r2)) {
+        return Vector2DotProduct(step, get_aabb_mtv(r1, r2)) < 0.0 ? 0.0 : 1.0;
+    }
+
+    // per axis, rects overlap while the offset is in (lo, hi)
+    float t_enter = 0.0;
+    float t_exit = 1.0;
+    for (int axis = 0; axis < 2; ++axis) {
+        float p = axis == 0 ? r1.x : r1.y;
+        float q = axis == 0 ? r2.x : r2.y;
+        float d = axis == 0 ? step.x : step.y;
+        float lo = q - p - (axis == 0 ? r1.width : r1.height);
+        float hi = q - p + (axis == 0 ? r2.width : r2.height);
+
+        if (fabs(d) < EPSILON) {
+            if (lo >= 0.0 || hi <= 0.0) return 1.0;
+            continue;
+        }
+
+        float t0 = lo / d;
+        float t1 = hi / d;
+        if (t0 > t1) std::swap(t0, t1);
+        t_enter = std::max(t_enter, t0);
+        t_exit = std::min(t_exit, t1);
+        if (t_enter >= t_exit) return 1.0;
+    }
+
+    return t_enter;
+}
+
+// zero for the point inside the rect
+float get_point_rect_dist(Vector2 point, Rectangle rect) {
+    float dx = std::fmax(rect.x - point.x, point.x - rect.x - rect.width);
+    float dy = std::fmax(rect.y - point.y, point.y - rect.y - rect.height);
+    return Vector2Length({std::fmax(dx, 0.0f), std::fmax(dy, 0.0f)});
+}
+
+bool check_point_inside_rect(Vector2 point, Rectangle rect) {
+    return point.x > rect.x && point.x < rect.x + rect.width && point.y > rect.y
+           && point.y < rect.y + rect.height;
+}
+
+// true if the segment crosses the rect border. Separating axis test: rect
+// x and y axes and the segment normal, the segment which lies strictly
+// inside the rect doesn't cross the border
 bool check_collision_rect_line(Rectangle rect, Vector2 start, Vector2 end) {
-    // TODO: factor out into RectangleVerts
-    Vector2 rect_tl = {rect.x, rect.y};
-    Vector2 rect_tr = {rect.x + rect.width, rect.y};
-    Vector2 rect_br = {rect.x + rect.width, rect.y + rect.height};
-    Vector2 rect_bl = {rect.x, rect.y + rect.height};
+    float half_width = rect.width * 0.5f;
+    float half_height = rect.height * 0.5f;
+    float half_dx = (end.x - start.x) * 0.5f;
+    float half_dy = (end.y - start.y) * 0.5f;
+    float abs_half_dx = fabs(half_dx);
+    float abs_half_dy = fabs(half_dy);
+
+    // segment middle relative to the rect center
+    float mid_x = (start.x + half_dx) - (rect.x + half_width);
+    float mid_y = (start.y + half_dy) - (rect.y + half_height);
+
+    if (fabs(mid_x) > half_width + abs_half_dx) return false;
+    if (fabs(mid_y) > half_height + abs_half_dy) return false;
+    if (fabs(mid_x * half_dy - mid_y * half_dx)
+        > half_width * abs_half_dy + half_height * abs_half_dx) {
+        return false;
+    }
 
-    Vector2 point;
-    return CheckCollisionLines(start, end, rect_tl, rect_tr, &point)
-           || CheckCollisionLines(start, end, rect_tr, rect_br, &point)
-           || CheckCollisionLines(start, end, rect_br, rect_bl, &point)
-           || CheckCollisionLines(start, end, rect_bl, rect_tl, &point);
+    return !check_point_inside_rect(start, rect) || !check_point_inside_rect(end, rect);
 }
 
 bool check_collision_lines(Line line0, Line line1) {
@@ -224,1646 +1154,5219 @@ bool check_collision_lines(Line line0, Line line1) {
     return CheckCollisionLines(line0.a, line0.b, line1.a, line1.b, &point);
 }
 
-// -----------------------------------------------------------------------
-// sprite
-Rectangle rect_from_json(json data) {
-    Rectangle rect = {
-        .x = data["x"], .y = data["y"], .width = data["w"], .height = data["h"]};
+Rectangle get_rects_bound(Rectangle r1, Rectangle r2) {
+    float x = std::min(r1.x, r2.x);
+    float y = std::min(r1.y, r2.y);
+    float width = std::max(r1.x + r1.width, r2.x + r2.width) - x;
+    float height = std::max(r1.y + r1.height, r2.y + r2.height) - y;
+    return {.x = x, .y = y, .width = width, .height = height};
+}
 
-    return rect;
+bool check_rects_equal(Rectangle r1, Rectangle r2) {
+    return r1.x == r2.x && r1.y == r2.y && r1.width == r2.width
+           && r1.height == r2.height;
 }
 
-enum class PivotType {
-    CENTER_BOTTOM,
-    CENTER_TOP,
-    LEFT_CENTER,
-    RIGHT_CENTER,
-    CENTER_CENTER,
-};
+// smallest rect on the step grid which contains the rect with one step margin
+Rectangle snap_rect(Rectangle rect, float step) {
+    float x0 = (std::floor(rect.x / step) - 1.0f) * step;
+    float y0 = (std::floor(rect.y / step) - 1.0f) * step;
+    float x1 = (std::ceil((rect.x + rect.width) / step) + 1.0f) * step;
+    float y1 = (std::ceil((rect.y + rect.height) / step) + 1.0f) * step;
+    return {.x = x0, .y = y0, .width = x1 - x0, .height = y1 - y0};
+}
 
-class Pivot {
-  public:
-    PivotType type;
-    Vector2 position;
+// -----------------------------------------------------------------------
+// batch collision
+// Narrowphase of one rect (or segment) against the candidate rects given by
+// their indices. With SSE the candidates are tested 4 at a time: Rectangle
+// is 4 floats, so 4 candidates are loaded as rows and transposed into x, y,
+// width and height lanes. Lanes do exactly the scalar math, so the results
+// are the same as of the per-pair get_aabb_mtv and check_collision_rect_line
+#if defined(__SSE2__)
+__m128 mm_abs(__m128 v) {
+    return _mm_andnot_ps(_mm_set1_ps(-0.0f), v);
+}
 
-    Pivot(PivotType type, Vector2 position)
-        : type(type)
-        , position(position) {}
-};
+__m128 mm_select(__m128 mask, __m128 a, __m128 b) {
+    return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b));
+}
 
-class Sprite {
-  private:
-    Texture2D texture;
-    Rectangle src;
-    Rectangle dst;
-    std::unordered_map<std::string, Rectangle> masks;
+void load_rects(
+    const std::vector<Rectangle> &rects,
+    const int *ids,
+    __m128 &x,
+    __m128 &y,
+    __m128 &width,
+    __m128 &height
+) {
+    x = _mm_loadu_ps(&rects[ids[0]].x);
+    y = _mm_loadu_ps(&rects[ids[1]].x);
+    width = _mm_loadu_ps(&rects[ids[2]].x);
+    height = _mm_loadu_ps(&rects[ids[3]].x);
+    _MM_TRANSPOSE4_PS(x, y, width, height);
+}
+#endif
 
-  public:
-    Sprite() {}
+// mtvs[i] is get_aabb_mtv(rect, rects[ids[i]])
+void get_aabb_mtvs(
+    Rectangle rect,
+    const std::vector<Rectangle> &rects,
+    const std::vector<int> &ids,
+    std::vector<Vector2> &mtvs
+) {
+    int n = ids.size();
+    mtvs.resize(n);
+
+    int i = 0;
+#if defined(__SSE2__)
+    __m128 r_x = _mm_set1_ps(rect.x);
+    __m128 r_y = _mm_set1_ps(rect.y);
+    __m128 r_width = _mm_set1_ps(rect.width);
+    __m128 r_height = _mm_set1_ps(rect.height);
+    __m128 r_right = _mm_set1_ps(rect.x + rect.width);
+    __m128 r_bottom = _mm_set1_ps(rect.y + rect.height);
+    for (; i + 4 <= n; i += 4) {
+        __m128 x, y, width, height;
+        load_rects(rects, &ids[i], x, y, width, height);
+        __m128 right = _mm_add_ps(x, width);
+        __m128 bottom = _mm_add_ps(y, height);
+
+        __m128 is_hit = _mm_and_ps(
+            _mm_and_ps(_mm_cmpgt_ps(right, r_x), _mm_cmpgt_ps(r_right, x)),
+            _mm_and_ps(_mm_cmpgt_ps(bottom, r_y), _mm_cmpgt_ps(r_bottom, y))
+        );
 
-    Sprite(
-        Texture2D texture,
-        Rectangle src,
-        Rectangle dst,
-        std::unordered_map<std::string, Rectangle> masks
-    )
-        : texture(texture)
-        , src(src)
-        , dst(dst)
-        , masks(masks) {}
+        __m128 x_west = _mm_sub_ps(_mm_sub_ps(x, r_x), r_width);
+        __m128 x_east = _mm_sub_ps(right, r_x);
+        __m128 mtv_x = mm_select(
+            _mm_cmplt_ps(mm_abs(x_west), mm_abs(x_east)), x_west, x_east
+        );
 
-    Sprite(json frame_json, Texture2D texture, Pivot pivot, bool is_hflip)
-        : texture(texture) {
+        __m128 y_south = _mm_sub_ps(bottom, r_y);
+        __m128 y_north = _mm_sub_ps(_mm_sub_ps(y, r_y), r_height);
+        __m128 mtv_y = mm_select(
+            _mm_cmplt_ps(mm_abs(y_south), mm_abs(y_north)), y_south, y_north
+        );
 
-        // flip sprite pivot if is_hflip = true
-        if (is_hflip) {
-            if (pivot.type == PivotType::LEFT_CENTER) {
-                pivot.type = PivotType::RIGHT_CENTER;
-            } else if (pivot.type == PivotType::RIGHT_CENTER) {
-                pivot.type = PivotType::LEFT_CENTER;
-            }
-        }
+        // keep only the shorter axis
+        __m128 is_y_shorter = _mm_cmpgt_ps(mm_abs(mtv_x), mm_abs(mtv_y));
+        mtv_x = _mm_and_ps(_mm_andnot_ps(is_y_shorter, mtv_x), is_hit);
+        mtv_y = _mm_and_ps(_mm_and_ps(is_y_shorter, mtv_y), is_hit);
 
-        json sprite_json = frame_json["sprite"];
-        json masks_json = frame_json["masks"];
+        // interleave back into Vector2s
+        _mm_storeu_ps(&mtvs[i].x, _mm_unpacklo_ps(mtv_x, mtv_y));
+        _mm_storeu_ps(&mtvs[i + 2].x, _mm_unpackhi_ps(mtv_x, mtv_y));
+    }
+#endif
 
-        Rectangle src = rect_from_json(sprite_json);
+    for (; i < n; ++i) {
+        mtvs[i] = get_aabb_mtv(rect, rects[ids[i]]);
+    }
+}
 
-        // find sprite's top left corner (because that's how sprites are rendered)
-        Vector2 offset;
-        switch (pivot.type) {
-            case PivotType::CENTER_BOTTOM:
-                offset = {-0.5f * src.width, -src.height};
-                break;
-            case PivotType::CENTER_TOP: offset = {-0.5f * src.width, 0.0}; break;
-            case PivotType::LEFT_CENTER: offset = {0.0, -0.5f * src.height}; break;
-            case PivotType::RIGHT_CENTER:
-                offset = {-src.width, -0.5f * src.height};
-                break;
-            case PivotType::CENTER_CENTER:
-                offset = {-0.5f * src.width, -0.5f * src.height};
-                break;
-        }
+// hits[i] is check_collision_rect_line(rects[ids[i]], start, end),
+// returns the number of hits
+int check_collision_rects_line(
+    const std::vector<Rectangle> &rects,
+    const std::vector<int> &ids,
+    Vector2 start,
+    Vector2 end,
+    std::vector<uint8_t> &hits
+) {
+    int n = ids.size();
+    hits.resize(n);
+
+    int n_hits = 0;
+    int i = 0;
+#if defined(__SSE2__)
+    float half_dx = (end.x - start.x) * 0.5f;
+    float half_dy = (end.y - start.y) * 0.5f;
+    __m128 l_half_dx = _mm_set1_ps(half_dx);
+    __m128 l_half_dy = _mm_set1_ps(half_dy);
+    __m128 l_abs_half_dx = _mm_set1_ps(fabs(half_dx));
+    __m128 l_abs_half_dy = _mm_set1_ps(fabs(half_dy));
+    __m128 l_mid_x = _mm_set1_ps(start.x + half_dx);
+    __m128 l_mid_y = _mm_set1_ps(start.y + half_dy);
+    __m128 start_x = _mm_set1_ps(start.x);
+    __m128 start_y = _mm_set1_ps(start.y);
+    __m128 end_x = _mm_set1_ps(end.x);
+    __m128 end_y = _mm_set1_ps(end.y);
+    __m128 half = _mm_set1_ps(0.5f);
+    for (; i + 4 <= n; i += 4) {
+        __m128 x, y, width, height;
+        load_rects(rects, &ids[i], x, y, width, height);
+        __m128 right = _mm_add_ps(x, width);
+        __m128 bottom = _mm_add_ps(y, height);
+        __m128 half_width = _mm_mul_ps(width, half);
+        __m128 half_height = _mm_mul_ps(height, half);
+        __m128 mid_x = _mm_sub_ps(l_mid_x, _mm_add_ps(x, half_width));
+        __m128 mid_y = _mm_sub_ps(l_mid_y, _mm_add_ps(y, half_height));
+
+        __m128 is_separated = _mm_or_ps(
+            _mm_cmpgt_ps(mm_abs(mid_x), _mm_add_ps(half_width, l_abs_half_dx)),
+            _mm_cmpgt_ps(mm_abs(mid_y), _mm_add_ps(half_height, l_abs_half_dy))
+        );
+        __m128 cross = _mm_sub_ps(
+            _mm_mul_ps(mid_x, l_half_dy), _mm_mul_ps(mid_y, l_half_dx)
+        );
+        __m128 extent = _mm_add_ps(
+            _mm_mul_ps(half_width, l_abs_half_dy), _mm_mul_ps(half_height, l_abs_half_dx)
+        );
+        is_separated = _mm_or_ps(is_separated, _mm_cmpgt_ps(mm_abs(cross), extent));
 
-        Rectangle dst = src;
+        __m128 is_start_inside = _mm_and_ps(
+            _mm_and_ps(_mm_cmpgt_ps(start_x, x), _mm_cmplt_ps(start_x, right)),
+            _mm_and_ps(_mm_cmpgt_ps(start_y, y), _mm_cmplt_ps(start_y, bottom))
+        );
+        __m128 is_end_inside = _mm_and_ps(
+            _mm_and_ps(_mm_cmpgt_ps(end_x, x), _mm_cmplt_ps(end_x, right)),
+            _mm_and_ps(_mm_cmpgt_ps(end_y, y), _mm_cmplt_ps(end_y, bottom))
+        );
+        __m128 is_miss = _mm_or_ps(
+            is_separated, _mm_and_ps(is_start_inside, is_end_inside)
+        );
 
-        dst.x = pivot.position.x + offset.x;
-        dst.y = pivot.position.y + offset.y;
+        int hit_mask = ~_mm_movemask_ps(is_miss) & 0xf;
+        for (int k = 0; k < 4; ++k) {
+            hits[i + k] = (hit_mask >> k) & 1;
+        }
+        n_hits += __builtin_popcount(hit_mask);
+    }
+#endif
 
-        std::unordered_map<std::string, Rectangle> masks;
-        for (auto it = masks_json.begin(); it != masks_json.end(); ++it) {
-            const auto &mask_name = it.key();
-            const auto &mask_json = it.value();
+    for (; i < n; ++i) {
+        hits[i] = check_collision_rect_line(rects[ids[i]], start, end);
+        n_hits += hits[i];
+    }
 
-            Rectangle mask = rect_from_json(mask_json);
-            mask.y = dst.y + mask.y;
-            mask.x = is_hflip ? dst.x - mask.x + src.width - mask.width : dst.x + mask.x;
-            this->masks[mask_name] = mask;
+    return n_hits;
+}
+
+// -----------------------------------------------------------------------
+// broadphase
+// Uniform grid which maps cells to the item indices whose rects overlap
+// them. Queries return candidate indices (sorted and without duplicates),
+// the exact test is still up to the caller.
+
+// used to skip items which overlap several cells. Grid keeps its own stamps,
+// concurrent queries bring their own ones
+class GridStamps {
+  public:
+    std::vector<uint32_t> item_stamps;
+    uint32_t stamp = 0;
+
+    void next(int n_items) {
+        if (n_items > this->item_stamps.size()) this->item_stamps.resize(n_items, 0);
+        if (++this->stamp == 0) {
+            std::fill(this->item_stamps.begin(), this->item_stamps.end(), 0);
+            this->stamp = 1;
         }
+    }
+};
 
-        src.width = is_hflip ? -src.width : src.width;
+class SpatialGrid {
+  private:
+    float cell_size = 1.0;
+    std::unordered_map<uint64_t, std::vector<int>> cells;
+    int n_items = 0;
+    GridStamps stamps;
 
-        this->src = src;
-        this->dst = dst;
+    int get_cell_coord(float val) const {
+        return std::floor(val / this->cell_size);
     }
 
-    void draw() {
-        DrawTexturePro(this->texture, this->src, this->dst, Vector2Zero(), 0.0, WHITE);
+    uint64_t get_cell_key(int x, int y) const {
+        return ((uint64_t)(uint32_t)x << 32) | (uint32_t)y;
     }
 
-    Rectangle *get_mask(std::string name) {
-        return HASHMAP_GET_OR_NULL(this->masks, name);
-    }
-};
+    void push_cell_items(int x, int y, std::vector<int> &out, GridStamps &stamps) const {
+        auto it = this->cells.find(this->get_cell_key(x, y));
+        if (it == this->cells.end()) return;
 
-class SpriteSheet {
-  private:
-    Texture2D texture;
-    json meta;
+        for (int idx : it->second) {
+            if (stamps.item_stamps[idx] == stamps.stamp) continue;
+            stamps.item_stamps[idx] = stamps.stamp;
+            out.push_back(idx);
+        }
+    }
 
   public:
-    SpriteSheet(){};
+    SpatialGrid() = default;
+    SpatialGrid(float cell_size)
+        : cell_size(cell_size) {}
+
+    // keeps cells memory, so the grid can be cheaply refilled every frame
+    void clear() {
+        for (auto &item : this->cells) {
+            item.second.clear();
+        }
+    }
 
-    SpriteSheet(std::string dir_path, std::string name) {
-        std::string meta_file_path = fs::path(dir_path) / fs::path(name + ".json");
-        std::string texture_file_path = fs::path(dir_path) / fs::path(name + ".png");
-        meta = load_json(meta_file_path);
+    void insert(int idx, Rectangle rect) {
+        this->n_items = std::max(this->n_items, idx + 1);
 
-        texture = LoadTexture(texture_file_path.c_str());
-        SetTextureFilter(texture, TEXTURE_FILTER_BILINEAR);
+        int x0 = this->get_cell_coord(rect.x);
+        int y0 = this->get_cell_coord(rect.y);
+        int x1 = this->get_cell_coord(rect.x + rect.width);
+        int y1 = this->get_cell_coord(rect.y + rect.height);
+        for (int y = y0; y <= y1; ++y) {
+            for (int x = x0; x <= x1; ++x) {
+                this->cells[this->get_cell_key(x, y)].push_back(idx);
+            }
+        }
     }
 
-    int count_frames(std::string &name) {
-        if (!meta["frames"].contains(name)) {
-            return 0;
+    void query_rect(Rectangle rect, std::vector<int> &out) {
+        out.clear();
+        this->stamps.next(this->n_items);
+
+        int x0 = this->get_cell_coord(rect.x);
+        int y0 = this->get_cell_coord(rect.y);
+        int x1 = this->get_cell_coord(rect.x + rect.width);
+        int y1 = this->get_cell_coord(rect.y + rect.height);
+        for (int y = y0; y <= y1; ++y) {
+            for (int x = x0; x <= x1; ++x) {
+                this->push_cell_items(x, y, out, this->stamps);
+            }
         }
-        return meta["frames"][name].size();
+
+        std::sort(out.begin(), out.end());
     }
 
-    Sprite get_sprite(std::string &name, int idx, Pivot pivot, bool is_hflip) {
-        if (!meta["frames"].contains(name)) {
-            return Sprite();
-        }
-        json frame_json = meta["frames"][name][idx];
-        Sprite sprite(frame_json, this->texture, pivot, is_hflip);
-        return sprite;
+    void query_line(Vector2 start, Vector2 end, std::vector<int> &out) {
+        this->query_line(start, end, out, this->stamps);
     }
 
-    void unload() {
-        UnloadTexture(texture);
+    // walks only the cells crossed by the segment (Amanatides-Woo traversal).
+    // Doesn't touch the grid, so several threads can query the filled grid
+    // at once, each with its own stamps
+    void query_line(
+        Vector2 start, Vector2 end, std::vector<int> &out, GridStamps &stamps
+    ) const {
+        out.clear();
+        stamps.next(this->n_items);
+
+        int x = this->get_cell_coord(start.x);
+        int y = this->get_cell_coord(start.y);
+        int end_x = this->get_cell_coord(end.x);
+        int end_y = this->get_cell_coord(end.y);
+        int n_steps = abs(end_x - x) + abs(end_y - y);
+
+        float dx = end.x - start.x;
+        float dy = end.y - start.y;
+        int step_x = dx > 0.0 ? 1 : -1;
+        int step_y = dy > 0.0 ? 1 : -1;
+        float next_x = (x + (step_x > 0 ? 1 : 0)) * this->cell_size;
+        float next_y = (y + (step_y > 0 ? 1 : 0)) * this->cell_size;
+        float t_max_x = dx != 0.0 ? (next_x - start.x) / dx : INFINITY;
+        float t_max_y = dy != 0.0 ? (next_y - start.y) / dy : INFINITY;
+        float t_delta_x = dx != 0.0 ? this->cell_size / fabs(dx) : INFINITY;
+        float t_delta_y = dy != 0.0 ? this->cell_size / fabs(dy) : INFINITY;
+
+        this->push_cell_items(x, y, out, stamps);
+        for (int i = 0; i < n_steps; ++i) {
+            if (t_max_x < t_max_y) {
+                x += step_x;
+                t_max_x += t_delta_x;
+            } else {
+                y += step_y;
+                t_max_y += t_delta_y;
+            }
+            this->push_cell_items(x, y, out, stamps);
+        }
+
+        std::sort(out.begin(), out.end());
     }
 };
 
-class Collider {
+// buffers of the grid queries and of the batch tests, one per thread
+class QueryScratch {
   public:
-    Rectangle mask;
-    uint32_t id;
+    std::vector<int> candidates;
+    GridStamps stamps;
+    std::vector<uint8_t> hits;
+};
 
-    Collider()
-        : mask()
-        , id(0) {}
+// -----------------------------------------------------------------------
+// slot map
+// Handle stays valid while its item is alive. Freed slots are reused with
+// the incremented generation, so stale handles resolve to nothing
+class Handle {
+  public:
+    uint32_t idx = 0;
+    uint32_t generation = 0;  // slots start at 1, so the default handle is null
 
-    Collider(Rectangle mask, int id)
-        : mask(mask)
-        , id(id) {}
+    bool operator==(const Handle &other) const {
+        return this->idx == other.idx && this->generation == other.generation;
+    }
 };
 
-class SpriteSheetAnimator {
+namespace std {
+template <> struct hash<Handle> {
+    size_t operator()(const Handle &handle) const {
+        return hash<uint64_t>()(((uint64_t)handle.generation << 32) | handle.idx);
+    }
+};
+}  // namespace std
+
+// Items are stored densely and can be iterated and indexed like a vector.
+// Removal moves the last item into the freed place, so the dense index of
+// an item may change, its handle doesn't
+template <typename T> class SlotMap {
   private:
-    static uint32_t global_animation_id;
-    uint32_t animation_id;
+    class Slot {
+      public:
+        uint32_t dense_idx = 0;
+        uint32_t generation = 1;
+    };
 
-    SpriteSheet *sprite_sheet;
-    std::string base_name = "";
-    std::string animation_name = "";
-    float frame_duration = 0.0;
-    bool is_repeat = true;
+    std::vector<T> items;
+    std::vector<uint32_t> item_slots;  // aligned with items
+    std::vector<Slot> slots;
+    std::vector<uint32_t> free_slots;
 
-    std::string get_full_name() {
-        if (this->animation_name.empty()) {
-            return this->base_name;
+  public:
+    Handle insert(T item) {
+        uint32_t slot_idx;
+        if (this->free_slots.size()) {
+            slot_idx = this->free_slots.back();
+            this->free_slots.pop_back();
         } else {
-            return this->base_name + "_" + this->animation_name;
+            slot_idx = this->slots.size();
+            this->slots.push_back(Slot());
         }
-    }
 
-  public:
-    float progress = 0.0;
-    SpriteSheetAnimator() {}
-    SpriteSheetAnimator(SpriteSheet *sprite_sheet, std::string base_name)
-        : sprite_sheet(sprite_sheet)
-        , base_name(base_name) {}
+        Slot &slot = this->slots[slot_idx];
+        slot.dense_idx = this->items.size();
+        this->items.push_back(std::move(item));
+        this->item_slots.push_back(slot_idx);
 
-    void play(std::string animation_name, float frame_duration, bool is_repeat) {
-        this->frame_duration = frame_duration;
-        this->is_repeat = is_repeat;
+        return {.idx = slot_idx, .generation = slot.generation};
+    }
 
-        if (this->animation_name != animation_name) {
-            this->animation_name = animation_name;
-            this->progress = 0.0;
-            this->animation_id = ++this->global_animation_id;
-        }
+    // returns nullptr if the item was removed
+    T *get(Handle handle) {
+        if (handle.idx >= this->slots.size()) return nullptr;
+
+        Slot &slot = this->slots[handle.idx];
+        if (slot.generation != handle.generation) return nullptr;
+        return &this->items[slot.dense_idx];
     }
 
-    void play(float frame_duration, bool is_repeat) {
-        return this->play("", frame_duration, is_repeat);
+    // returns -1 if the item was removed
+    int get_dense_idx(Handle handle) {
+        if (!this->get(handle)) return -1;
+        return this->slots[handle.idx].dense_idx;
     }
 
-    void update(float dt) {
-        std::string name = this->get_full_name();
+    Handle get_handle(int dense_idx) {
+        uint32_t slot_idx = this->item_slots[dense_idx];
+        return {.idx = slot_idx, .generation = this->slots[slot_idx].generation};
+    }
 
-        int n_frames = this->sprite_sheet->count_frames(name);
+    void remove(Handle handle) {
+        if (!this->get(handle)) return;
 
-        this->progress += dt / (n_frames * this->frame_duration);
-        if (this->is_repeat) {
-            if (this->progress >= 1.0) {
-                this->animation_id = ++this->global_animation_id;
-            }
-            this->progress -= std::floor(this->progress);
-        } else {
-            this->progress = std::fmin(this->progress, 1.0);
+        Slot &slot = this->slots[handle.idx];
+        uint32_t last_idx = this->items.size() - 1;
+        if (slot.dense_idx != last_idx) {
+            this->items[slot.dense_idx] = std::move(this->items[last_idx]);
+            this->item_slots[slot.dense_idx] = this->item_slots[last_idx];
+            this->slots[this->item_slots[slot.dense_idx]].dense_idx = slot.dense_idx;
         }
+        this->items.pop_back();
+        this->item_slots.pop_back();
+
+        slot.generation += 1;
+        this->free_slots.push_back(handle.idx);
     }
 
-    bool is_finished() {
-        return this->progress == 1.0 && !this->is_repeat;
+    void clear() {
+        for (uint32_t slot_idx : this->item_slots) {
+            this->slots[slot_idx].generation += 1;
+            this->free_slots.push_back(slot_idx);
+        }
+        this->items.clear();
+        this->item_slots.clear();
     }
 
-    Sprite get_sprite(Pivot pivot, bool is_hflip) {
-        std::string name = this->get_full_name();
+    int size() {
+        return this->items.size();
+    }
 
-        int n_frames = this->sprite_sheet->count_frames(name);
-        int idx = std::round(this->progress * (n_frames - 1.0));
-        Sprite sprite = this->sprite_sheet->get_sprite(name, idx, pivot, is_hflip);
-        return sprite;
+    T &operator[](int dense_idx) {
+        return this->items[dense_idx];
     }
 
-    Collider get_collider(std::string name, Pivot pivot, bool is_hflip) {
-        Sprite sprite = this->get_sprite(pivot, is_hflip);
-        Rectangle *mask = sprite.get_mask(name);
-        if (!mask) return Collider();
+    typename std::vector<T>::iterator begin() {
+        return this->items.begin();
+    }
 
-        return Collider(*mask, this->animation_id);
+    typename std::vector<T>::iterator end() {
+        return this->items.end();
     }
 };
 
-uint32_t SpriteSheetAnimator::global_animation_id = 0;
-
 // -----------------------------------------------------------------------
-// tiled level
-class TileSheet {
+// jobs
+// Batch of indices is split into chunks which are run by the worker threads
+// and by the calling thread. Each thread starts with its own contiguous
+// share of chunks and steals chunks from the other shares when its own is
+// done. Jobs must write only to the items of their own indices, so the
+// results don't depend on which thread runs which chunk
+#define JOBS_MAX_N_WORKERS 7
+#define JOBS_CHUNK_SIZE 32
+
+// smaller batches run inline, waking the workers costs more than they save
+#define JOBS_MIN_N_ITEMS 128
+
+// job(thread_idx, begin, end), thread_idx is in [0, n_threads), so the job
+// can use per-thread scratch buffers. Job only refers to the callable, which
+// outlives the parallel_for, so unlike std::function it never allocates
+class Job {
   private:
-    Texture2D texture;
-    json meta;
-    int tile_width;
-    int tile_height;
+    void *fn;
+    void (*call)(void *fn, int thread_idx, int begin, int end);
 
   public:
-    int n_tiles;
-    TileSheet(){};
+    template <typename Fn>
+    Job(Fn &fn)
+        : fn(&fn)
+        , call([](void *fn, int thread_idx, int begin, int end) {
+            (*(Fn *)fn)(thread_idx, begin, end);
+        }) {}
+
+    void operator()(int thread_idx, int begin, int end) const {
+        this->call(this->fn, thread_idx, begin, end);
+    }
+};
+
+class JobSystem {
+  private:
+    // aligned, so the threads don't fight over the same cache line
+    class alignas(64) Share {
+      public:
+        std::atomic<int> next_chunk{0};
+        int end_chunk = 0;
+    };
 
-    TileSheet(std::string meta_file_path) {
-        meta = load_json(meta_file_path);
+    std::vector<std::thread> workers;
+    std::vector<Share> shares;  // one per thread, the caller's one is the last
+
+    std::mutex mutex;
+    std::condition_variable start_cv;
+    std::condition_variable done_cv;
+    uint64_t batch_id = 0;
+    int n_busy_workers = 0;
+    bool is_stopped = false;
+
+    const Job *job = nullptr;
+    int n_items = 0;
+
+    void run_chunks(int thread_idx) {
+        int n_threads = this->shares.size();
+        for (int i = 0; i < n_threads; ++i) {
+            Share &share = this->shares[(thread_idx + i) % n_threads];
+            while (true) {
+                int chunk = share.next_chunk.fetch_add(1);
+                if (chunk >= share.end_chunk) break;
+
+                int begin = chunk * JOBS_CHUNK_SIZE;
+                int end = std::min(begin + JOBS_CHUNK_SIZE, this->n_items);
+                (*this->job)(thread_idx, begin, end);
+            }
+        }
+    }
+
+    void work(int thread_idx) {
+        uint64_t last_batch_id = 0;
+        while (true) {
+            {
+                std::unique_lock<std::mutex> lock(this->mutex);
+                this->start_cv.wait(lock, [&] {
+                    return this->is_stopped || this->batch_id != last_batch_id;
+                });
+                if (this->is_stopped) return;
+                last_batch_id = this->batch_id;
+            }
 
-        this->tile_width = meta["tilewidth"];
-        this->tile_height = meta["tileheight"];
-        this->n_tiles = meta["tilecount"];
+            this->run_chunks(thread_idx);
 
-        std::string texture_file_path = LEVELS_DIR + std::string(meta["image"]);
-        this->texture = LoadTexture(texture_file_path.c_str());
-        SetTextureFilter(texture, TEXTURE_FILTER_BILINEAR);
+            std::lock_guard<std::mutex> lock(this->mutex);
+            if (--this->n_busy_workers == 0) this->done_cv.notify_one();
+        }
     }
 
-    Sprite get_sprite(int idx, Vector2 position) {
-        int n_cols = this->texture.width / this->tile_width;
-        int n_rows = this->texture.height / this->tile_height;
-        int i_row = idx / n_cols;
-        int i_col = idx % n_cols;
-        float src_x = i_col * this->tile_width;
-        float src_y = i_row * this->tile_height;
-        float src_width = this->tile_width;
-        float src_height = this->tile_height;
-        float dst_x = position.x;
-        float dst_y = position.y;
-        float dst_width = this->tile_width;
-        float dst_height = this->tile_height;
-        Rectangle src = {
-            .x = src_x, .y = src_y, .width = src_width, .height = src_height};
-        Rectangle dst = {
-            .x = dst_x, .y = dst_y, .width = dst_width, .height = dst_height};
-        Sprite sprite(this->texture, src, dst, {});
-        return sprite;
+  public:
+    // n_workers < 0 picks one worker per spare hardware thread
+    JobSystem(int n_workers) {
+        if (n_workers < 0) n_workers = (int)std::thread::hardware_concurrency() - 1;
+        n_workers = std::clamp(n_workers, 0, JOBS_MAX_N_WORKERS);
+
+        this->shares = std::vector<Share>(n_workers + 1);
+        for (int i = 0; i < n_workers; ++i) {
+            this->workers.emplace_back(&JobSystem::work, this, i);
+        }
     }
 
-    void unload() {
-        UnloadTexture(texture);
+    JobSystem(const JobSystem &) = delete;
+    JobSystem &operator=(const JobSystem &) = delete;
+
+    ~JobSystem() {
+        {
+            std::lock_guard<std::mutex> lock(this->mutex);
+            this->is_stopped = true;
+        }
+        this->start_cv.notify_all();
+        for (std::thread &worker : this->workers) {
+            worker.join();
+        }
     }
-};
 
-class TiledLevel {
-  private:
-    std::unordered_map<std::string, TileSheet> tile_sheets;
+    int get_n_threads() {
+        return this->shares.size();
+    }
 
-  public:
-    json meta;
+    // returns when all the indices in [0, n_items) are done
+    void parallel_for(int n_items, const Job &job) {
+        int n_threads = this->shares.size();
+        if (n_threads == 1 || n_items < JOBS_MIN_N_ITEMS) {
+            if (n_items > 0) job(n_threads - 1, 0, n_items);
+            return;
+        }
 
-    TiledLevel() {}
+        int n_chunks = (n_items + JOBS_CHUNK_SIZE - 1) / JOBS_CHUNK_SIZE;
+        for (int i = 0; i < n_threads; ++i) {
+            this->shares[i].next_chunk = i * n_chunks / n_threads;
+            this->shares[i].end_chunk = (i + 1) * n_chunks / n_threads;
+        }
 
-    TiledLevel(std::string dir_path, std::string name) {
-        this->meta = load_json(fs::path(dir_path) / fs::path(name + ".json"));
-        for (auto tileset_json : meta["tilesets"]) {
-            std::string name = tileset_json["source"];
-            std::string meta_file_path = fs::path(dir_path) / std::string(name);
-            auto tile_sheet = TileSheet(meta_file_path);
-            if (!HASHMAP_GET_OR_NULL(this->tile_sheets, name)) {
-                this->tile_sheets[name] = tile_sheet;
-            }
+        {
+            std::lock_guard<std::mutex> lock(this->mutex);
+            this->job = &job;
+            this->n_items = n_items;
+            this->n_busy_workers = this->workers.size();
+            this->batch_id += 1;
         }
+        this->start_cv.notify_all();
+
+        this->run_chunks(n_threads - 1);
+
+        std::unique_lock<std::mutex> lock(this->mutex);
+        this->done_cv.wait(lock, [&] { return this->n_busy_workers == 0; });
     }
+};
 
-    Sprite get_sprite(int tile_id, Vector2 position) {
-        for (auto &tileset_json : this->meta["tilesets"]) {
-            int tile_first_id = tileset_json["firstgid"];
-            if (tile_id < tile_first_id) continue;
+// -----------------------------------------------------------------------
+// frame arena
+// bump allocator of the transient per-frame data. Everything allocated
+// during the frame is released at once by the reset at the end of the
+// frame. A frame which doesn't fit chains more blocks, on reset they are
+// merged into one, so the arena settles on the steady frame size and stops
+// touching the heap. Main thread only
+#define FRAME_ARENA_INITIAL_SIZE (1 << 20)
+
+class FrameArena {
+  private:
+    class Block {
+      public:
+        uint8_t *data;
+        size_t size;
+    };
 
-            TileSheet tile_sheet = this->tile_sheets[tileset_json["source"]];
-            int tile_last_id = tile_sheet.n_tiles + tile_first_id - 1;
-            if (tile_id > tile_last_id) continue;
+    std::vector<Block> blocks;  // the last one is being filled
+    size_t offset = 0;
 
-            return tile_sheet.get_sprite(tile_id - tile_first_id, position);
+  public:
+    size_t n_bytes = 0;  // allocated since the reset
+    int n_heap_allocations = 0;  // blocks allocated since the start
+
+    FrameArena() = default;
+    FrameArena(const FrameArena &) = delete;
+    FrameArena &operator=(const FrameArena &) = delete;
+
+    ~FrameArena() {
+        for (Block &block : this->blocks)
+            std::free(block.data);
+    }
+
+    void *allocate(size_t size, size_t alignment) {
+        size_t start = (this->offset + alignment - 1) & ~(alignment - 1);
+        if (this->blocks.empty() || start + size > this->blocks.back().size) {
+            size_t block_size = this->blocks.empty() ? FRAME_ARENA_INITIAL_SIZE
+                                                     : 2 * this->blocks.back().size;
+            block_size = std::max(block_size, size);
+            this->blocks.push_back({(uint8_t *)std::malloc(block_size), block_size});
+            this->n_heap_allocations += 1;
+            start = 0;
         }
 
-        return Sprite();
+        this->offset = start + size;
+        this->n_bytes += size;
+        return this->blocks.back().data + start;
     }
 
-    void unload() {
-        for (auto &item : this->tile_sheets) {
-            item.second.unload();
+    void reset() {
+        if (this->blocks.size() > 1) {
+            size_t size = 0;
+            for (Block &block : this->blocks) {
+                size += block.size;
+                std::free(block.data);
+            }
+            this->blocks.clear();
+            this->blocks.push_back({(uint8_t *)std::malloc(size), size});
+            this->n_heap_allocations += 1;
         }
-        this->tile_sheets.clear();
+
+        this->offset = 0;
+        this->n_bytes = 0;
     }
 };
 
-// -----------------------------------------------------------------------
-// game camera
-class GameCamera {
+// containers on the arena never free, their memory goes away with the
+// reset. A container must be recreated after the reset, not just cleared
+template <typename T> class FrameAllocator {
   public:
-    float view_width;
-    float aspect;
-    Vector2 target;
+    using value_type = T;
+    using propagate_on_container_copy_assignment = std::true_type;
+    using propagate_on_container_move_assignment = std::true_type;
+    using propagate_on_container_swap = std::true_type;
 
-    GameCamera() = default;
-    GameCamera(float view_width, float aspect)
-        : view_width(view_width)
-        , aspect(aspect) {}
+    FrameArena *arena = nullptr;
 
-    Rectangle get_screen_rect() {
-        float view_height = this->view_width / this->aspect;
-        Vector2 top_left = {
-            this->target.x - 0.5f * this->view_width,
-            this->target.y - 0.5f * view_height};
-        Vector2 top_right = {top_left.x + this->view_width, top_left.y};
-        Vector2 bot_right = {top_right.x, top_right.y + view_height};
+    FrameAllocator() = default;
+    FrameAllocator(FrameArena *arena)
+        : arena(arena) {}
 
-        return {
-            top_left.x, top_left.y, top_right.x - top_left.x, bot_right.y - top_right.y};
+    template <typename U>
+    FrameAllocator(const FrameAllocator<U> &other)
+        : arena(other.arena) {}
+
+    T *allocate(size_t n) {
+        return (T *)this->arena->allocate(n * sizeof(T), alignof(T));
     }
 
-    RectDetailed get_screen_rect_detailed() {
-        return get_rect_detailed(this->get_screen_rect());
+    void deallocate(T *, size_t) {}
+
+    template <typename U> bool operator==(const FrameAllocator<U> &other) const {
+        return this->arena == other.arena;
     }
 
-    void set_shader_values(Shader shader) {
-        SetShaderValue(
-            shader,
-            GetShaderLocation(shader, "camera.view_width"),
-            &this->view_width,
-            SHADER_UNIFORM_FLOAT
-        );
-        SetShaderValue(
-            shader,
-            GetShaderLocation(shader, "camera.aspect"),
-            &this->aspect,
-            SHADER_UNIFORM_FLOAT
-        );
-        SetShaderValue(
-            shader,
-            GetShaderLocation(shader, "camera.target"),
-            &this->target,
-            SHADER_UNIFORM_VEC2
-        );
+    template <typename U> bool operator!=(const FrameAllocator<U> &other) const {
+        return this->arena != other.arena;
     }
 };
 
+template <typename T> using FrameVector = std::vector<T, FrameAllocator<T>>;
+
 // -----------------------------------------------------------------------
-// creatures
-enum class CreatureState {
-    IDLE,
-    MOVING,
-    JUMPING,
-    FALLING,
-    LANDING,
-    DASHING,
-    BLOCKING,
-    ATTACK_0,
-    ATTACK_1,
-    ATTACK_2,
-    DEATH,
-    DELETE,
-};
+// texture streaming
+// baked textures never block the main thread on the decode: the loader
+// thread inflates their bands and the main thread uploads a few decoded
+// bands per frame. A texture is created cleared, with its full size, so
+// its users compute the uvs right away and see the bands as they arrive
+#define TEXTURE_UPLOAD_N_BANDS_PER_FRAME 4
+
+#define GL_RGBA 0x1908
+#define GL_UNSIGNED_BYTE 0x1401
+
+extern "C" void (*glad_glClearTexImage)(
+    unsigned int texture,
+    int level,
+    unsigned int format,
+    unsigned int type,
+    const void *data
+);
+
+class TextureStreamer {
+  private:
+    class Band {
+      public:
+        Texture2D texture;
+        Rectangle rect;
+        uint32_t format;
+        const unsigned char *data;  // in the mapped file
+        uint32_t size;
+        std::vector<unsigned char> pixels;  // decoded, empty for the raw bands
+    };
 
-enum class CreatureType {
-    NONE,
-    RIGID_COLLIDER,
-    SPRITE,
-    PLATFORM,
-    PLAYER,
-    BAT,
-    WOLF,
-    GOLEM,
-};
+    std::thread thread;
+
+    // guarded by the mutex
+    std::mutex mutex;
+    std::condition_variable has_requests;
+    std::condition_variable is_decoded;
+    std::deque<Band> requests;
+    std::vector<Band> decoded;
+    bool is_decoding = false;
+    bool is_stopped = false;
+
+    // main thread only. Bands point into the files, which are kept by
+    // their texture ids until the texture is unloaded
+    std::unordered_map<unsigned int, MappedFile> files;
+    std::deque<Band> ready;
+
+    void run() {
+        std::unique_lock<std::mutex> lock(this->mutex);
+        while (true) {
+            this->has_requests.wait(lock, [this] {
+                return this->is_stopped || !this->requests.empty();
+            });
+            if (this->is_stopped) return;
+
+            Band band = std::move(this->requests.front());
+            this->requests.pop_front();
+            this->is_decoding = true;
+            lock.unlock();
+
+            int n_bytes = 4 * band.rect.width * band.rect.height;
+            int size = 0;
+            unsigned char *pixels = DecompressData(band.data, band.size, &size);
+            if (pixels && size == n_bytes) band.pixels.assign(pixels, pixels + size);
+            MemFree(pixels);
+
+            lock.lock();
+            this->decoded.push_back(std::move(band));
+            this->is_decoding = false;
+            this->is_decoded.notify_all();
+        }
+    }
+
+    template <typename Bands> void erase_bands(Bands &bands, unsigned int texture_id) {
+        bands.erase(
+            std::remove_if(
+                bands.begin(),
+                bands.end(),
+                [=](const Band &band) { return band.texture.id == texture_id; }
+            ),
+            bands.end()
+        );
+    }
 
-class Light {
   public:
-    float intensity = 0.0;
-    Vector2 position;
-    Vector3 color;
-    Vector3 attenuation;
+    TextureStreamer() = default;
+
+    Texture2D load(const std::string &file_path) {
+        MappedFile file(file_path);
+        auto header = file.get_header<BakedTextureHeader>(BAKED_TEXTURE_MAGIC);
+        bool is_known_format = header->format == BAKED_TEXTURE_RAW
+                               || header->format == BAKED_TEXTURE_DEFLATE;
+        file.check(
+            is_known_format && header->width > 0 && header->band_height > 0
+            && header->n_bands
+                   == (header->height + header->band_height - 1) / header->band_height
+        );
+        auto bands = file.get_table<BakedTextureBand>(
+            header->bands_offset, header->n_bands
+        );
 
-    bool is_off = true;
+        Texture2D texture = {
+            .width = (int)header->width,
+            .height = (int)header->height,
+            .mipmaps = 1,
+            .format = PIXELFORMAT_UNCOMPRESSED_R8G8B8A8};
+        texture.id = rlLoadTexture(
+            NULL, texture.width, texture.height, texture.format, texture.mipmaps
+        );
+        glad_glClearTexImage(texture.id, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+
+        for (int i = 0; i < header->n_bands; ++i) {
+            const BakedTextureBand &baked = bands[i];
+            uint32_t y = i * header->band_height;
+            uint32_t height = std::min(header->band_height, header->height - y);
+            file.check(baked.offset <= UINT32_MAX - header->data_offset);
+
+            Band band = {
+                .texture = texture,
+                .rect = {0.0, (float)y, (float)header->width, (float)height},
+                .format = header->format,
+                .data = file.get_table<unsigned char>(
+                    header->data_offset + baked.offset, baked.size
+                ),
+                .size = baked.size};
+            if (band.format == BAKED_TEXTURE_RAW) {
+                file.check(band.size == 4 * header->width * height);
+                this->ready.push_back(std::move(band));
+            } else {
+                std::lock_guard<std::mutex> lock(this->mutex);
+                this->requests.push_back(std::move(band));
+            }
+        }
+        this->files[texture.id] = std::move(file);
 
-    // set in runtime for sorting
-    float _dist;
+        if (!this->thread.joinable()) {
+            this->thread = std::thread(&TextureStreamer::run, this);
+        }
+        this->has_requests.notify_one();
 
-    Light() = default;
-    Light(float intensity, Vector2 position, Vector3 color, Vector3 attenuation)
-        : intensity(intensity)
-        , position(position)
-        , color(color)
-        , attenuation(attenuation)
-        , is_off(false) {}
-};
+        return texture;
+    }
 
-class Creature {
-  private:
-    PivotType sprite_pivot_type = PivotType::CENTER_BOTTOM;
+    // drops the bands of the texture which are not uploaded yet
+    void cancel(unsigned int texture_id) {
+        std::unique_lock<std::mutex> lock(this->mutex);
+        this->erase_bands(this->requests, texture_id);
+        this->is_decoded.wait(lock, [this] { return !this->is_decoding; });
+        this->erase_bands(this->decoded, texture_id);
+        lock.unlock();
 
-  public:
-    CreatureType type;
-    CreatureState state;
-    SpriteSheetAnimator animator;
-    Light light;
+        this->erase_bands(this->ready, texture_id);
+        this->files.erase(texture_id);
+    }
 
-    float move_speed = 0.0;
-    float jump_speed = 0.0;
-    float max_health = 0.0;
-    float health = 0.0;
-    float damage = 0.0;
-    float attack_distance = 0.0;
-    bool can_view_vertically = false;
+    void update() {
+        bool has_pending_bands;
+        {
+            std::lock_guard<std::mutex> lock(this->mutex);
+            for (Band &band : this->decoded) this->ready.push_back(std::move(band));
+            this->decoded.clear();
+            has_pending_bands = !this->ready.empty() || !this->requests.empty()
+                                || this->is_decoding;
+        }
 
-    Vector2 position = {0.0, 0.0};
-    Vector2 velocity = {0.0, 0.0};
+        // a rebaked file drops its pending bands before any further band is
+        // read from it. The baker renames the new file over the old one, so
+        // the band being decoded still reads the old mapping, and the
+        // texture keeps the uploaded bands until it's reloaded
+        if (has_pending_bands) {
+            std::vector<unsigned int> outdated_texture_ids;
+            for (auto &pair : this->files) {
+                if (pair.second.is_outdated()) outdated_texture_ids.push_back(pair.first);
+            }
+            for (unsigned int texture_id : outdated_texture_ids) this->cancel(texture_id);
+        }
 
-    bool is_hflip = false;
-    bool is_grounded = false;
-    bool is_flying = false;
-    bool can_see_player = false;
-    bool can_attack_player = false;
-    float landed_at_speed = 0.0;
-    float last_received_damage_time = -1.0;
-    std::unordered_set<uint32_t> received_attack_ids;
+        for (int i = 0; i < TEXTURE_UPLOAD_N_BANDS_PER_FRAME && !this->ready.empty();
+             ++i) {
+            Band &band = this->ready.front();
+            const void *pixels = band.data;
+            if (band.format != BAKED_TEXTURE_RAW) pixels = band.pixels.data();
 
-    // RIGID_COLLIDER
-    Rectangle rigid_collider_rect;
+            // a corrupted band is left cleared
+            if (band.format == BAKED_TEXTURE_RAW || !band.pixels.empty()) {
+                UpdateTextureRec(band.texture, band.rect, pixels);
+            }
+            this->ready.pop_front();
+        }
+    }
 
-    // PLATFORM
-    std::unordered_set<Creature *> creatures_on_platform;
-    std::string platform_tag;
-    Vector2 platform_start;
-    Vector2 platform_end;
-    float platform_speed;
+    void unload() {
+        if (this->thread.joinable()) {
+            {
+                std::lock_guard<std::mutex> lock(this->mutex);
+                this->is_stopped = true;
+            }
+            this->has_requests.notify_one();
+            this->thread.join();
+        }
 
-    Creature() {}
+        this->requests.clear();
+        this->decoded.clear();
+        this->ready.clear();
+        this->files.clear();
+    }
+};
 
-    Creature(
-        CreatureType type,
-        CreatureState state,
-        SpriteSheetAnimator animator,
-        Light light,
-        float move_speed,
-        float jump_speed,
-        float max_health,
-        float damage,
-        float attack_distance,
-        bool can_view_vertically,
-        Vector2 position
-    )
-        : type(type)
-        , state(state)
-        , animator(animator)
-        , light(light)
-        , move_speed(move_speed)
-        , jump_speed(jump_speed)
-        , max_health(max_health)
-        , damage(damage)
-        , attack_distance(attack_distance)
-        , can_view_vertically(can_view_vertically)
-        , position(position)
-        , health(max_health) {}
+// -----------------------------------------------------------------------
+// textures
+// every texture is loaded once and owned here. Sprite and tile sheets
+// keep pointers to the cached textures, so a texture changed on disk is
+// replaced in place without touching its users
+class TextureCache {
+  private:
+    class CachedTexture {
+      public:
+        Texture2D texture = {0};
+        std::string loaded_file_path;  // the baked texture or the image
+        int64_t mtime = -1;
+    };
 
-    static Creature create_sprite(
-        SpriteSheetAnimator animator,
-        Vector2 position,
-        bool is_hflip,
-        PivotType sprite_pivot_type
-    ) {
-        Creature sprite;
-        sprite.type = CreatureType::SPRITE;
-        sprite.state = CreatureState::IDLE;
-        sprite.animator = animator;
-        sprite.position = position;
-        sprite.is_hflip = is_hflip;
-        sprite.sprite_pivot_type = sprite_pivot_type;
-        sprite.is_flying = true;
+    // node based, pointers to the textures stay valid
+    std::unordered_map<std::string, CachedTexture> textures;
+    TextureStreamer streamer;
 
-        return sprite;
+    // the baked texture next to the image is preferred
+    void load(const std::string &file_path, CachedTexture &cached) {
+        std::string baked_file_path = fs::path(file_path).replace_extension(".tex");
+        if (get_file_mtime(baked_file_path) != -1) {
+            cached.loaded_file_path = baked_file_path;
+            cached.texture = this->streamer.load(baked_file_path);
+        } else {
+            cached.loaded_file_path = file_path;
+            cached.texture = LoadTexture(file_path.c_str());
+        }
+        cached.mtime = get_file_mtime(cached.loaded_file_path);
+        SetTextureFilter(cached.texture, TEXTURE_FILTER_BILINEAR);
     }
 
-    static Creature create_platform(
-        SpriteSheetAnimator animator,
-        std::string tag,
-        float speed,
-        Vector2 start,
-        Vector2 end
-    ) {
-        Creature platform;
-        platform.type = CreatureType::PLATFORM;
-        platform.state = CreatureState::IDLE;
-        platform.animator = animator;
-        platform.platform_tag = tag;
-        platform.platform_speed = speed;
-        platform.position = start;
-        platform.platform_start = start;
-        platform.platform_end = end;
-        platform.is_flying = true;
-
-        return platform;
+  public:
+    // headless cache doesn't load anything, its textures are empty
+    bool is_headless = false;
+
+    TextureCache() = default;
+    TextureCache(bool is_headless)
+        : is_headless(is_headless) {}
+
+    const Texture2D *get(const std::string &path) {
+        // tile sheets of different levels refer to the same images by
+        // different relative paths
+        std::string file_path = fs::path(path).lexically_normal();
+        auto it = this->textures.find(file_path);
+        if (it != this->textures.end()) return &it->second.texture;
+
+        CachedTexture &cached = this->textures[file_path];
+        if (!this->is_headless) this->load(file_path, cached);
+        return &cached.texture;
     }
 
-    static Creature create_rigid_collider(Rectangle rect) {
-        Creature rigid_collider;
-        rigid_collider.type = CreatureType::RIGID_COLLIDER;
-        rigid_collider.rigid_collider_rect = rect;
-        rigid_collider.is_flying = true;
+    // reloads the textures changed on disk, returns true if any of them
+    // changed its size, so the uvs computed from the old size are outdated
+    bool reload_changed() {
+        if (this->is_headless) return false;
+
+        bool is_resized = false;
+        for (auto &pair : this->textures) {
+            CachedTexture &cached = pair.second;
+            if (get_file_mtime(cached.loaded_file_path) == cached.mtime) continue;
+
+            Texture2D old_texture = cached.texture;
+            this->streamer.cancel(old_texture.id);
+            UnloadTexture(old_texture);
+            this->load(pair.first, cached);
+            is_resized |= cached.texture.width != old_texture.width
+                          || cached.texture.height != old_texture.height;
+        }
 
-        return rigid_collider;
+        return is_resized;
     }
 
-    int get_view_dir() {
-        return this->is_hflip ? -1 : 1;
+    // uploads the streamed bands decoded so far
+    void update() {
+        if (!this->is_headless) this->streamer.update();
     }
 
-    Pivot get_pivot() {
-        return Pivot(this->sprite_pivot_type, this->position);
+    void unload() {
+        this->streamer.unload();
+        for (auto &pair : this->textures) {
+            if (pair.second.texture.id) UnloadTexture(pair.second.texture);
+        }
+        this->textures.clear();
     }
+};
 
-    Sprite get_sprite() {
-        Sprite sprite = this->animator.get_sprite(this->get_pivot(), this->is_hflip);
-        return sprite;
-    }
+// source image in the atlas texture. For the image missing in the atlas
+// the origin is zero and the texture is the image itself
+class AtlasImage {
+  public:
+    const Texture2D *texture = nullptr;
+    Vector2 origin = {0.0, 0.0};
+};
 
-    Collider get_rigid_collider() {
-        Collider collider = this->animator.get_collider(
-            "rigid", this->get_pivot(), is_hflip
-        );
-        return collider;
-    }
+// tile and sprite sheet images are baked into one texture, so all of
+// them are drawn without switching textures
+class TextureAtlas {
+  private:
+    MappedFile file;
+    const Texture2D *texture = nullptr;
+    const BakedAtlasImage *images = nullptr;
+    const char *strings = nullptr;
+    int n_images = 0;
 
-    Collider get_attack_collider() {
-        Collider collider = this->animator.get_collider(
-            "attack", this->get_pivot(), is_hflip
+  public:
+    TextureAtlas() {}
+
+    TextureAtlas(std::string file_path, TextureCache &textures)
+        : file(fs::path(file_path).replace_extension(".bin")) {
+        auto header = this->file.get_header<BakedAtlasHeader>(BAKED_ATLAS_MAGIC);
+        this->n_images = header->n_images;
+        this->images = this->file.get_table<BakedAtlasImage>(
+            header->images_offset, header->n_images
         );
-        return collider;
+        this->strings = this->file.get_strings(
+            header->strings_offset, header->strings_size
+        );
+        for (int i = 0; i < this->n_images; ++i) {
+            const BakedAtlasImage &image = this->images[i];
+            this->file.check(
+                image.path_offset < header->strings_size
+                && image.x + image.width <= header->width
+                && image.y + image.height <= header->height
+            );
+        }
+
+        this->texture = textures.get(file_path);
     }
 
-    Collider get_block_collider() {
-        Collider collider = this->animator.get_collider(
-            "block", this->get_pivot(), is_hflip
-        );
-        return collider;
+    bool is_outdated() {
+        return this->file.is_outdated();
     }
 
-    Rectangle get_rigid_rect() {
-        Rectangle rect = {0.0, 0.0, 0.0, 0.0};
-        switch (this->type) {
-            case (CreatureType::RIGID_COLLIDER): rect = this->rigid_collider_rect; break;
-            case (CreatureType::PLATFORM): rect = this->get_rigid_collider().mask; break;
-            default: break;
+    // the atlas has just a few images and they are looked up only on load
+    AtlasImage get_image(const std::string &path, TextureCache &textures) {
+        std::string file_path = fs::path(path).lexically_normal();
+        for (int i = 0; i < this->n_images; ++i) {
+            const BakedAtlasImage &image = this->images[i];
+            if (file_path != this->strings + image.path_offset) continue;
+            return {.texture = this->texture, .origin = {(float)image.x, (float)image.y}};
         }
-        return rect;
-    }
 
-    Light get_light() {
-        Light light = this->light;
-        light.position = Vector2Add(light.position, this->position);
-        return light;
+        // the image is not baked yet
+        return {.texture = textures.get(path)};
     }
 };
 
 // -----------------------------------------------------------------------
-// game
-class Game {
+// sprite
+#define N_MASK_TYPES 3
+
+enum class PivotType {
+    CENTER_BOTTOM,
+    CENTER_TOP,
+    LEFT_CENTER,
+    RIGHT_CENTER,
+    CENTER_CENTER,
+};
+
+// sprite sheet masks are stored in fixed slots, so the lookup
+// doesn't need to hash the mask name. The order is baked
+enum class MaskType {
+    RIGID,
+    ATTACK,
+    BLOCK,
+};
+
+class Pivot {
   public:
-    RenderTexture2D shadow_map;
+    PivotType type;
+    Vector2 position;
 
-    std::unordered_map<std::string, Shader> shaders;
-    std::unordered_map<std::string, SpriteSheet> sprite_sheets;
-    TiledLevel tiled_level;
+    Pivot(PivotType type, Vector2 position)
+        : type(type)
+        , position(position) {}
+};
 
-    std::vector<Creature> creatures;
-    std::vector<Creature> new_creatures;
+// sprite sheet frame as it's baked, so frames are used right from the
+// mapped file. Masks are relative to the frame's top left corner,
+// zero-sized masks are not present in the frame
+class SpriteSheetFrame {
+  public:
+    Rectangle src = {0.0, 0.0, 0.0, 0.0};
+    Rectangle masks[N_MASK_TYPES] = {};
+};
 
-    GameCamera camera;
+static_assert(sizeof(SpriteSheetFrame) == (1 + N_MASK_TYPES) * sizeof(Rectangle));
+
+// per instance attributes of sprite_batch.vert
+typedef struct SpriteInstance {
+    Rectangle dst;
+    Rectangle uv;  // negative width flips the sprite horizontally
+    float is_flash;  // 1.0 if the sprite is drawn with the plain white color
+} SpriteInstance;
+
+class Sprite {
+  private:
+    const Texture2D *texture = nullptr;
+    Rectangle src = {0.0, 0.0, 0.0, 0.0};
+    Rectangle dst = {0.0, 0.0, 0.0, 0.0};
+    Rectangle masks[N_MASK_TYPES] = {};
+
+  public:
+    Sprite() {}
+
+    Sprite(const SpriteSheetFrame &frame, AtlasImage image, Pivot pivot, bool is_hflip)
+        : texture(image.texture) {
+
+        // flip sprite pivot if is_hflip = true
+        if (is_hflip) {
+            if (pivot.type == PivotType::LEFT_CENTER) {
+                pivot.type = PivotType::RIGHT_CENTER;
+            } else if (pivot.type == PivotType::RIGHT_CENTER) {
+                pivot.type = PivotType::LEFT_CENTER;
+            }
+        }
+
+        Rectangle src = frame.src;
+
+        // find sprite's top left corner (because that's how sprites are rendered)
+        Vector2 offset;
+        switch (pivot.type) {
+            case PivotType::CENTER_BOTTOM:
+                offset = {-0.5f * src.width, -src.height};
+                break;
+            case PivotType::CENTER_TOP: offset = {-0.5f * src.width, 0.0}; break;
+            case PivotType::LEFT_CENTER: offset = {0.0, -0.5f * src.height}; break;
+            case PivotType::RIGHT_CENTER:
+                offset = {-src.width, -0.5f * src.height};
+                break;
+            case PivotType::CENTER_CENTER:
+                offset = {-0.5f * src.width, -0.5f * src.height};
+                break;
+        }
+
+        Rectangle dst = src;
+
+        dst.x = pivot.position.x + offset.x;
+        dst.y = pivot.position.y + offset.y;
+
+        for (int i = 0; i < N_MASK_TYPES; ++i) {
+            Rectangle mask = frame.masks[i];
+            if (mask.width <= 0.0) continue;
+
+            mask.y = dst.y + mask.y;
+            mask.x = is_hflip ? dst.x - mask.x + src.width - mask.width : dst.x + mask.x;
+            this->masks[i] = mask;
+        }
+
+        src.x += image.origin.x;
+        src.y += image.origin.y;
+        src.width = is_hflip ? -src.width : src.width;
+
+        this->src = src;
+        this->dst = dst;
+    }
+
+    // sprite without a texture is not drawn
+    const Texture2D *get_texture() const {
+        return this->texture && this->texture->id ? this->texture : nullptr;
+    }
+
+    SpriteInstance get_instance(bool is_flash) const {
+        float texture_width = this->texture->width;
+        float texture_height = this->texture->height;
+        Rectangle uv = {
+            .x = this->src.x / texture_width,
+            .y = this->src.y / texture_height,
+            .width = this->src.width / texture_width,
+            .height = this->src.height / texture_height};
+
+        // flipped sprite starts from the right edge of its src
+        if (uv.width < 0.0) uv.x -= uv.width;
+
+        return {.dst = this->dst, .uv = uv, .is_flash = is_flash ? 1.0f : 0.0f};
+    }
+
+    Rectangle get_dst() {
+        return this->dst;
+    }
+
+    Rectangle *get_mask(MaskType type) {
+        Rectangle *mask = &this->masks[(int)type];
+        return mask->width > 0.0 ? mask : nullptr;
+    }
+};
+
+// sprites pushed during the frame are drawn as instanced quads, one draw
+// call per texture run. Sprites are ordered by the layer first, so the
+// upper layers are drawn on top, and by the texture inside the layer
+#define SPRITE_BATCH_CAPACITY 1024
+#define SPRITE_QUAD_N_VERTICES 6
+
+enum class SpriteLayer {
+    CREATURES,
+    EFFECTS,
+    FLASHES,
+};
+
+class SpriteBatch {
+  private:
+    class BatchedSprite {
+      public:
+        SpriteLayer layer;
+        unsigned int texture_id;
+        SpriteInstance instance;
+    };
+
+    InstanceBuffer buffer;
+    std::vector<BatchedSprite> sprites;
+    std::vector<SpriteInstance> instances;
+
+  public:
+    SpriteBatch() = default;
+
+    SpriteBatch(int capacity)
+        : buffer(
+            sizeof(SpriteInstance),
+            capacity,
+            {{0, 4, offsetof(SpriteInstance, dst)},
+             {1, 4, offsetof(SpriteInstance, uv)},
+             {2, 1, offsetof(SpriteInstance, is_flash)}}
+        ) {}
+
+    void push(const Sprite &sprite, SpriteLayer layer, bool is_flash) {
+        const Texture2D *texture = sprite.get_texture();
+        if (!texture) return;
+        this->sprites.push_back(
+            {.layer = layer,
+             .texture_id = texture->id,
+             .instance = sprite.get_instance(is_flash)}
+        );
+    }
+
+    // draws and clears the pushed sprites, returns the number of draw calls.
+    // The shader must be enabled
+    int draw() {
+        std::stable_sort(
+            this->sprites.begin(),
+            this->sprites.end(),
+            [](const BatchedSprite &a, const BatchedSprite &b) {
+                if (a.layer != b.layer) return a.layer < b.layer;
+                return a.texture_id < b.texture_id;
+            }
+        );
+
+        this->instances.clear();
+        for (const BatchedSprite &sprite : this->sprites) {
+            this->instances.push_back(sprite.instance);
+        }
+        this->buffer.update(this->instances.data(), this->instances.size());
+
+        int n_draw_calls = 0;
+        int n_sprites = this->sprites.size();
+        for (int first = 0, last = 0; first < n_sprites; first = last) {
+            unsigned int texture_id = this->sprites[first].texture_id;
+            while (last < n_sprites && this->sprites[last].texture_id == texture_id) {
+                last += 1;
+            }
+
+            rlActiveTextureSlot(0);
+            rlEnableTexture(texture_id);
+            this->buffer.draw(first, last - first, SPRITE_QUAD_N_VERTICES);
+            n_draw_calls += 1;
+        }
+        this->buffer.end_frame();
+        this->sprites.clear();
+
+        return n_draw_calls;
+    }
+
+    void unload() {
+        this->buffer.unload();
+    }
+};
+
+// each animation is a contiguous range of the frames table,
+// animations are baked sorted by name
+typedef struct SpriteSheetAnimation {
+    uint32_t name_offset;
+    uint32_t first_frame_idx;
+    uint32_t n_frames;
+} SpriteSheetAnimation;
+
+class SpriteSheet {
+  private:
+    AtlasImage image;
+
+    MappedFile file;
+    const SpriteSheetFrame *frames = nullptr;
+    const SpriteSheetAnimation *animations = nullptr;
+    const char *strings = nullptr;
+    int n_animations = 0;
+
+  public:
+    SpriteSheet(){};
+
+    SpriteSheet(
+        std::string dir_path,
+        std::string name,
+        TextureAtlas &atlas,
+        TextureCache &textures
+    )
+        : file(fs::path(dir_path) / fs::path(name + ".bin")) {
+        std::string texture_file_path = fs::path(dir_path) / fs::path(name + ".png");
+
+        auto header = this->file.get_header<BakedSpriteSheetHeader>(
+            BAKED_SPRITE_SHEET_MAGIC
+        );
+        this->n_animations = header->n_animations;
+        this->frames = this->file.get_table<SpriteSheetFrame>(
+            header->frames_offset, header->n_frames
+        );
+        this->animations = this->file.get_table<SpriteSheetAnimation>(
+            header->animations_offset, header->n_animations
+        );
+        this->strings = this->file.get_strings(
+            header->strings_offset, header->strings_size
+        );
+        for (int i = 0; i < this->n_animations; ++i) {
+            const SpriteSheetAnimation &animation = this->animations[i];
+            this->file.check(
+                animation.name_offset < header->strings_size
+                && animation.first_frame_idx <= header->n_frames
+                && animation.n_frames <= header->n_frames - animation.first_frame_idx
+            );
+        }
+
+        this->image = atlas.get_image(texture_file_path, textures);
+    }
+
+    bool is_outdated() {
+        return this->file.is_outdated();
+    }
+
+    // returns -1 if there is no animation with such name
+    int get_animation_idx(const std::string &name) {
+        const SpriteSheetAnimation *end = this->animations + this->n_animations;
+        const SpriteSheetAnimation *it = std::lower_bound(
+            this->animations,
+            end,
+            name,
+            [this](const SpriteSheetAnimation &animation, const std::string &name) {
+                return std::strcmp(this->strings + animation.name_offset, name.c_str())
+                       < 0;
+            }
+        );
+        if (it == end || name != this->strings + it->name_offset) return -1;
+        return it - this->animations;
+    }
+
+    int count_frames(int animation_idx) {
+        if (animation_idx < 0) return 0;
+        return this->animations[animation_idx].n_frames;
+    }
+
+    Sprite get_sprite(int animation_idx, int idx, Pivot pivot, bool is_hflip) {
+        if (animation_idx < 0) return Sprite();
+
+        const SpriteSheetAnimation &animation = this->animations[animation_idx];
+        const SpriteSheetFrame &frame = this->frames[animation.first_frame_idx + idx];
+        Sprite sprite(frame, this->image, pivot, is_hflip);
+        return sprite;
+    }
+};
+
+class Collider {
+  public:
+    Rectangle mask;
+    uint32_t id;
+
+    Collider()
+        : mask()
+        , id(0) {}
+
+    Collider(Rectangle mask, int id)
+        : mask(mask)
+        , id(id) {}
+};
+
+class SpriteSheetAnimator {
+  private:
+    // counts the animations this animator has played, it's the attack
+    // collider id. Not shared, so the parallel behaviours don't race on it
+    uint32_t animation_id = 0;
+
+    SpriteSheet *sprite_sheet = nullptr;
+    std::string base_name = "";
+    std::string animation_name = "";
+    float frame_duration = 0.0;
+    bool is_repeat = true;
+
+    // resolved once per animation change, -1 if the sprite sheet
+    // doesn't have such animation
+    int animation_idx = -1;
+    int n_frames = 0;
+
+    void resolve_animation() {
+        std::string name = this->base_name;
+        if (!this->animation_name.empty()) name += "_" + this->animation_name;
+
+        this->animation_idx = this->sprite_sheet->get_animation_idx(name);
+        this->n_frames = this->sprite_sheet->count_frames(this->animation_idx);
+    }
+
+  public:
+    float progress = 0.0;
+    SpriteSheetAnimator() {}
+    SpriteSheetAnimator(SpriteSheet *sprite_sheet, std::string base_name)
+        : animation_id(1)
+        , sprite_sheet(sprite_sheet)
+        , base_name(base_name) {
+        this->resolve_animation();
+    }
+
+    void play(const std::string &animation_name, float frame_duration, bool is_repeat) {
+        this->frame_duration = frame_duration;
+        this->is_repeat = is_repeat;
+
+        if (this->animation_name != animation_name) {
+            this->animation_name = animation_name;
+            this->progress = 0.0;
+            ++this->animation_id;
+            this->resolve_animation();
+        }
+    }
+
+    void play(float frame_duration, bool is_repeat) {
+        return this->play("", frame_duration, is_repeat);
+    }
+
+    void update(float dt) {
+        if (this->n_frames == 0) return;
+
+        this->progress += dt / (this->n_frames * this->frame_duration);
+        if (this->is_repeat) {
+            if (this->progress >= 1.0) {
+                ++this->animation_id;
+            }
+            this->progress -= std::floor(this->progress);
+        } else {
+            this->progress = std::fmin(this->progress, 1.0);
+        }
+    }
+
+    bool is_finished() {
+        return this->progress == 1.0 && !this->is_repeat;
+    }
+
+    uint32_t get_animation_id() const {
+        return this->animation_id;
+    }
+
+    // of the whole animation, a single play of the repeated one
+    float get_duration() const {
+        return this->n_frames * this->frame_duration;
+    }
+
+    Sprite get_sprite(Pivot pivot, bool is_hflip) {
+        if (this->animation_idx < 0) return Sprite();
+
+        int idx = std::round(this->progress * (this->n_frames - 1.0));
+        Sprite sprite = this->sprite_sheet->get_sprite(
+            this->animation_idx, idx, pivot, is_hflip
+        );
+        return sprite;
+    }
+
+    Collider get_collider(MaskType type, Pivot pivot, bool is_hflip) {
+        Sprite sprite = this->get_sprite(pivot, is_hflip);
+        Rectangle *mask = sprite.get_mask(type);
+        if (!mask) return Collider();
+
+        return Collider(*mask, this->animation_id);
+    }
+};
+
+// -----------------------------------------------------------------------
+// tiled level
+class TileSheet {
+  private:
+    AtlasImage image;
+    int tile_width;
+    int tile_height;
+    int n_cols;
+
+  public:
+    int first_tile_id;
+    int n_tiles;
+    TileSheet(){};
+
+    TileSheet(const BakedTileSheet &baked, AtlasImage image)
+        : image(image)
+        , tile_width(baked.tile_width)
+        , tile_height(baked.tile_height)
+        , n_cols(baked.n_cols)
+        , first_tile_id(baked.first_tile_id)
+        , n_tiles(baked.n_tiles) {}
+
+    const Texture2D *get_texture() {
+        return this->image.texture;
+    }
+
+    Rectangle get_src(int idx) {
+        int i_row = idx / this->n_cols;
+        int i_col = idx % this->n_cols;
+        float src_x = this->image.origin.x + i_col * this->tile_width;
+        float src_y = this->image.origin.y + i_row * this->tile_height;
+        float src_width = this->tile_width;
+        float src_height = this->tile_height;
+        return {.x = src_x, .y = src_y, .width = src_width, .height = src_height};
+    }
+};
+
+// tiles of a single chunk which share the same texture, baked into
+// one mesh to be drawn with a single draw call
+class TileChunkMesh {
+  public:
+    int chunk_idx;  // in the layers order
+    Rectangle rect;
+    const Texture2D *texture;
+    Mesh mesh;
+
+    // only builds the vertices, so it can run off the main thread.
+    // Texcoords are in pixels until the upload, the texture size is read
+    // only there
+    TileChunkMesh(
+        int chunk_idx,
+        Rectangle rect,
+        const Texture2D *texture,
+        std::vector<Rectangle> &srcs,
+        std::vector<Rectangle> &dsts
+    )
+        : chunk_idx(chunk_idx)
+        , rect(rect)
+        , texture(texture)
+        , mesh({0}) {
+        int n_tiles = srcs.size();
+        this->mesh.vertexCount = 4 * n_tiles;
+        this->mesh.triangleCount = 2 * n_tiles;
+        this->mesh.vertices = (float *)MemAlloc(3 * 4 * n_tiles * sizeof(float));
+        this->mesh.texcoords = (float *)MemAlloc(2 * 4 * n_tiles * sizeof(float));
+        this->mesh.indices = (unsigned short *)MemAlloc(
+            6 * n_tiles * sizeof(unsigned short)
+        );
+
+        for (int i = 0; i < n_tiles; ++i) {
+            Rectangle src = srcs[i];
+            Rectangle dst = dsts[i];
+            float u0 = src.x;
+            float v0 = src.y;
+            float u1 = src.x + src.width;
+            float v1 = src.y + src.height;
+
+            // left top, left bot, right bot, right top
+            float x0 = dst.x;
+            float y0 = dst.y;
+            float x1 = dst.x + dst.width;
+            float y1 = dst.y + dst.height;
+            float vertices[12] = {x0, y0, 0.0, x0, y1, 0.0, x1, y1, 0.0, x1, y0, 0.0};
+            float texcoords[8] = {u0, v0, u0, v1, u1, v1, u1, v0};
+
+            unsigned short v = 4 * i;
+            unsigned short indices[6] = {
+                v,
+                (unsigned short)(v + 1),
+                (unsigned short)(v + 2),
+                v,
+                (unsigned short)(v + 2),
+                (unsigned short)(v + 3)};
+
+            std::copy(vertices, vertices + 12, this->mesh.vertices + 12 * i);
+            std::copy(texcoords, texcoords + 8, this->mesh.texcoords + 8 * i);
+            std::copy(indices, indices + 6, this->mesh.indices + 6 * i);
+        }
+    }
+
+    // uploaded mesh keeps no cpu copy of the vertices
+    void upload() {
+        for (int i = 0; i < 2 * this->mesh.vertexCount; i += 2) {
+            this->mesh.texcoords[i] /= this->texture->width;
+            this->mesh.texcoords[i + 1] /= this->texture->height;
+        }
+
+        UploadMesh(&this->mesh, false);
+        MemFree(this->mesh.vertices);
+        MemFree(this->mesh.texcoords);
+        MemFree(this->mesh.indices);
+        this->mesh.vertices = nullptr;
+        this->mesh.texcoords = nullptr;
+        this->mesh.indices = nullptr;
+    }
+
+    void draw() {
+        rlActiveTextureSlot(0);
+        rlEnableTexture(this->texture->id);
+        rlEnableVertexArray(this->mesh.vaoId);
+        rlDrawVertexArrayElements(0, 3 * this->mesh.triangleCount, 0);
+        rlDisableVertexArray();
+    }
+
+    // works for the not uploaded mesh as well
+    void unload() {
+        UnloadMesh(this->mesh);
+    }
+};
+
+// level is streamed by regions, the cells of the chunks grid. A region
+// holds the chunks of all the layers and the objects inside it
+class LevelRegion {
+  public:
+    Rectangle rect;
+    std::vector<int> chunk_ids;  // in the layers order
+    std::vector<int> object_ids;  // in the file order
+};
+
+class TiledLevel {
+  private:
+    MappedFile file;
+    const BakedChunk *baked_chunks = nullptr;
+    const uint32_t *tile_ids = nullptr;
+    const char *strings = nullptr;
+
+    // aligned with the baked tile sheets
+    std::vector<TileSheet> tile_sheets;
+
+    TileSheet *get_tile_sheet(int tile_id, int *idx) {
+        for (TileSheet &tile_sheet : this->tile_sheets) {
+            if (tile_id < tile_sheet.first_tile_id) continue;
+
+            int tile_last_id = tile_sheet.n_tiles + tile_sheet.first_tile_id - 1;
+            if (tile_id > tile_last_id) continue;
+
+            *idx = tile_id - tile_sheet.first_tile_id;
+            return &tile_sheet;
+        }
+
+        return nullptr;
+    }
+
+    Rectangle get_chunk_rect(const BakedChunk &chunk) {
+        float tile_width = this->header->tile_width;
+        float tile_height = this->header->tile_height;
+        return {
+            .x = tile_width * chunk.x,
+            .y = tile_height * chunk.y,
+            .width = tile_width * chunk.width,
+            .height = tile_height * chunk.height};
+    }
+
+    LevelRegion &get_region(int64_t key) {
+        auto it = this->regions.find(key);
+        if (it != this->regions.end()) return it->second;
+
+        LevelRegion &region = this->regions[key];
+        region.rect = this->get_region_rect(key);
+        return region;
+    }
+
+  public:
+    const BakedLevelHeader *header = nullptr;
+    const BakedObject *objects = nullptr;
+
+    // Tiled chunks of a map have the same size, so they form a grid
+    float region_width = 0.0;
+    float region_height = 0.0;
+    std::unordered_map<int64_t, LevelRegion> regions;
+
+    TiledLevel() {}
+
+    TiledLevel(
+        std::string dir_path,
+        std::string name,
+        TextureAtlas &atlas,
+        TextureCache &textures
+    )
+        : file(fs::path(dir_path) / fs::path(name + ".bin")) {
+        this->header = this->file.get_header<BakedLevelHeader>(BAKED_LEVEL_MAGIC);
+        const BakedLevelHeader &header = *this->header;
+        auto baked_tile_sheets = this->file.get_table<BakedTileSheet>(
+            header.tile_sheets_offset, header.n_tile_sheets
+        );
+        this->baked_chunks = this->file.get_table<BakedChunk>(
+            header.chunks_offset, header.n_chunks
+        );
+        this->objects = this->file.get_table<BakedObject>(
+            header.objects_offset, header.n_objects
+        );
+        this->tile_ids = this->file.get_table<uint32_t>(
+            header.tile_ids_offset, header.n_tile_ids
+        );
+        this->strings = this->file.get_strings(
+            header.strings_offset, header.strings_size
+        );
+
+        // a map without chunks still needs a grid for its objects
+        BakedChunk region_chunk = {.width = 16, .height = 16};
+        if (header.n_chunks > 0) region_chunk = this->baked_chunks[0];
+        Rectangle region_rect = this->get_chunk_rect(region_chunk);
+        this->region_width = region_rect.width;
+        this->region_height = region_rect.height;
+        this->file.check(this->region_width > 0.0 && this->region_height > 0.0);
+
+        for (int i = 0; i < header.n_chunks; ++i) {
+            const BakedChunk &chunk = this->baked_chunks[i];
+            this->file.check(
+                chunk.width == region_chunk.width && chunk.height == region_chunk.height
+                && chunk.x % chunk.width == 0 && chunk.y % chunk.height == 0
+                && chunk.first_tile_id_idx <= header.n_tile_ids
+                && (uint64_t)chunk.width * chunk.height
+                       <= header.n_tile_ids - chunk.first_tile_id_idx
+            );
+
+            Rectangle rect = this->get_chunk_rect(chunk);
+            int64_t key = this->get_region_key({rect.x, rect.y});
+            this->get_region(key).chunk_ids.push_back(i);
+        }
+        for (int i = 0; i < header.n_objects; ++i) {
+            const BakedObject &object = this->objects[i];
+            this->file.check(
+                object.type_offset < header.strings_size
+                && object.tag_offset < header.strings_size
+                && object.destination_idx < (int)header.n_objects
+            );
+
+            int64_t key = this->get_region_key({object.x, object.y});
+            this->get_region(key).object_ids.push_back(i);
+        }
+
+        for (int i = 0; i < header.n_tile_sheets; ++i) {
+            const BakedTileSheet &baked = baked_tile_sheets[i];
+            this->file.check(baked.image_offset < header.strings_size);
+            std::string texture_file_path = fs::path(dir_path)
+                                            / (this->strings + baked.image_offset);
+            this->tile_sheets.push_back(
+                TileSheet(baked, atlas.get_image(texture_file_path, textures))
+            );
+        }
+    }
+
+    const char *get_string(uint32_t offset) {
+        return this->strings + offset;
+    }
+
+    bool is_outdated() {
+        return this->file.is_outdated();
+    }
+
+    int64_t get_region_key(Vector2 position) {
+        int64_t ix = std::floor(position.x / this->region_width);
+        int64_t iy = std::floor(position.y / this->region_height);
+        return (ix << 32) | (uint32_t)iy;
+    }
+
+    // the region may not exist, if there are no chunks or objects in it
+    Rectangle get_region_rect(int64_t key) {
+        int ix = key >> 32;
+        int iy = (int32_t)key;
+        return {
+            .x = ix * this->region_width,
+            .y = iy * this->region_height,
+            .width = this->region_width,
+            .height = this->region_height};
+    }
+
+    // keys of the existing regions which are closer than the radius
+    void get_region_keys(Vector2 center, float radius, std::vector<int64_t> &keys) {
+        keys.clear();
+        int64_t ix0 = std::floor((center.x - radius) / this->region_width);
+        int64_t ix1 = std::floor((center.x + radius) / this->region_width);
+        int64_t iy0 = std::floor((center.y - radius) / this->region_height);
+        int64_t iy1 = std::floor((center.y + radius) / this->region_height);
+        for (int64_t ix = ix0; ix <= ix1; ++ix) {
+            for (int64_t iy = iy0; iy <= iy1; ++iy) {
+                int64_t key = (ix << 32) | (uint32_t)iy;
+                LevelRegion *region = HASHMAP_GET_OR_NULL(this->regions, key);
+                if (!region || get_point_rect_dist(center, region->rect) > radius) {
+                    continue;
+                }
+                keys.push_back(key);
+            }
+        }
+    }
+
+    // reads only the immutable level data, so regions can be baked off
+    // the main thread
+    void bake_region(const LevelRegion &region, std::vector<TileChunkMesh> &meshes) {
+        int tile_width = this->header->tile_width;
+        int tile_height = this->header->tile_height;
+
+        std::vector<const Texture2D *> chunk_textures;
+        std::unordered_map<const Texture2D *, std::vector<Rectangle>> srcs;
+        std::unordered_map<const Texture2D *, std::vector<Rectangle>> dsts;
+        for (int i_chunk : region.chunk_ids) {
+            const BakedChunk &chunk = this->baked_chunks[i_chunk];
+            int chunk_width = chunk.width;
+            int chunk_height = chunk.height;
+            int chunk_x = chunk.x;
+            int chunk_y = chunk.y;
+            Rectangle chunk_rect = this->get_chunk_rect(chunk);
+
+            chunk_textures.clear();
+            srcs.clear();
+            dsts.clear();
+
+            const uint32_t *tile_ids = this->tile_ids + chunk.first_tile_id_idx;
+            for (int i = 0; i < chunk_width * chunk_height; ++i) {
+                int tile_id = tile_ids[i];
+                if (tile_id == 0) continue;
+
+                int idx;
+                TileSheet *tile_sheet = this->get_tile_sheet(tile_id, &idx);
+                if (!tile_sheet) continue;
+
+                int i_row = i / chunk_width;
+                int i_col = i % chunk_width;
+                float x = tile_width * (chunk_x + i_col);
+                float y = tile_height * (chunk_y + i_row);
+
+                Rectangle src = tile_sheet->get_src(idx);
+                Rectangle dst = {
+                    .x = x, .y = y, .width = src.width, .height = src.height};
+
+                // tile sheets baked into the atlas share its texture
+                const Texture2D *texture = tile_sheet->get_texture();
+                if (!HASHMAP_GET_OR_NULL(srcs, texture)) {
+                    chunk_textures.push_back(texture);
+                }
+                srcs[texture].push_back(src);
+                dsts[texture].push_back(dst);
+            }
+
+            for (const Texture2D *texture : chunk_textures) {
+                meshes.push_back(TileChunkMesh(
+                    i_chunk,
+                    chunk_rect,
+                    texture,
+                    srcs[texture],
+                    dsts[texture]
+                ));
+            }
+        }
+    }
+};
+
+// -----------------------------------------------------------------------
+// game camera
+class GameCamera {
+  public:
+    float view_width;
+    float aspect;
+    Vector2 target;
+
+    GameCamera() = default;
+    GameCamera(float view_width, float aspect)
+        : view_width(view_width)
+        , aspect(aspect) {}
+
+    Rectangle get_screen_rect() {
+        float view_height = this->view_width / this->aspect;
+        Vector2 top_left = {
+            this->target.x - 0.5f * this->view_width,
+            this->target.y - 0.5f * view_height};
+        Vector2 top_right = {top_left.x + this->view_width, top_left.y};
+        Vector2 bot_right = {top_right.x, top_right.y + view_height};
+
+        return {
+            top_left.x, top_left.y, top_right.x - top_left.x, bot_right.y - top_right.y};
+    }
+
+    RectDetailed get_screen_rect_detailed() {
+        return get_rect_detailed(this->get_screen_rect());
+    }
+
+    CameraBlock get_block() {
+        return {
+            .view_width = this->view_width, .aspect = this->aspect, .target = this->target};
+    }
+};
+
+// -----------------------------------------------------------------------
+// creatures
+enum class CreatureState {
+    IDLE,
+    MOVING,
+    JUMPING,
+    FALLING,
+    LANDING,
+    DASHING,
+    BLOCKING,
+    ATTACK_0,
+    ATTACK_1,
+    ATTACK_2,
+    DEATH,
+    DELETE,
+};
+
+#define N_CREATURE_TYPES 8
+
+enum class CreatureType {
+    NONE,
+    RIGID_COLLIDER,
+    SPRITE,
+    PLATFORM,
+    PLAYER,
+    BAT,
+    WOLF,
+    GOLEM,
+};
+
+class Light {
+  public:
+    float intensity = 0.0;
+    Vector2 position;
+    Vector3 color;
+    Vector3 attenuation;
+
+    bool is_off = true;
+
+    // set in runtime for sorting
+    float _dist;
+
+    // shadow atlas slot, -1 if the light doesn't cast shadows this frame
+    int _shadow_slot = -1;
+
+    Light() = default;
+    Light(float intensity, Vector2 position, Vector3 color, Vector3 attenuation)
+        : intensity(intensity)
+        , position(position)
+        , color(color)
+        , attenuation(attenuation)
+        , is_off(false) {}
+
+    // distance at which the light contribution drops to LIGHT_MIN_INTENSITY,
+    // e.g solve intensity / (c + l * d + q * d^2) = LIGHT_MIN_INTENSITY
+    float get_radius() {
+        float c = this->attenuation.x - this->intensity / LIGHT_MIN_INTENSITY;
+        float l = this->attenuation.y;
+        float q = this->attenuation.z;
+        if (c >= 0.0) return 0.0;
+        if (q <= EPSILON) return l > EPSILON ? -c / l : INFINITY;
+        return (-l + sqrtf(l * l - 4.0f * q * c)) / (2.0f * q);
+    }
+};
+
+// attack is the attacker with the count of its animation, both are known
+// without any shared counter. Null attacker is not an attack
+class AttackId {
+  public:
+    Handle attacker;
+    uint32_t animation_id = 0;
+
+    bool operator==(const AttackId &other) const {
+        return this->attacker == other.attacker
+               && this->animation_id == other.animation_id;
+    }
+};
+
+// an attack lives at most one play of the attacker animation, so a
+// received id is kept, inline, until that time has passed. Only expired
+// entries are overwritten, the still live ids which don't fit go to the
+// overflow, which is empty unless a crowd attacks at once
+#define N_RECENT_ATTACK_IDS 16
+
+class RecentAttackIds {
+  private:
+    class Entry {
+      public:
+        AttackId id;
+        int expire_tick = 0;
+    };
+
+    Entry entries[N_RECENT_ATTACK_IDS];
+    std::vector<Entry> overflow;
+
+  public:
+    // null attack is never inserted
+    bool contains(AttackId id) const {
+        for (const Entry &entry : this->entries) {
+            if (entry.id == id) return true;
+        }
+        for (const Entry &entry : this->overflow) {
+            if (entry.id == id) return true;
+        }
+        return false;
+    }
+
+    void insert(AttackId id, int tick, int expire_tick) {
+        if (this->contains(id)) return;
+
+        auto is_expired = [&](const Entry &entry) { return entry.expire_tick < tick; };
+        this->overflow.erase(
+            std::remove_if(this->overflow.begin(), this->overflow.end(), is_expired),
+            this->overflow.end()
+        );
+        for (Entry &entry : this->entries) {
+            if (entry.expire_tick < tick) {
+                entry = {id, expire_tick};
+                return;
+            }
+        }
+        this->overflow.push_back({id, expire_tick});
+    }
+
+    int size() const {
+        int n_ids = this->overflow.size();
+        for (const Entry &entry : this->entries) n_ids += entry.expire_tick > 0;
+        return n_ids;
+    }
+
+    uint64_t get_hash(uint64_t hash) const {
+        hash = get_fnv_hash(this->entries, sizeof(this->entries), hash);
+        return get_fnv_hash(
+            this->overflow.data(), this->overflow.size() * sizeof(Entry), hash
+        );
+    }
+};
+
+// line of sight to the player. The static rects part is reused while both
+// ends of the view line and the static rects stay the same
+class SightCache {
+  public:
+    Vector2 start = {0.0, 0.0};
+    Vector2 end = {0.0, 0.0};
+    int static_version = -1;
+    bool is_static_clear = false;
+    bool is_clear = false;
+    int next_tick = 0;  // when the far creature tests it again
+};
+
+class Creature {
+  private:
+    PivotType sprite_pivot_type = PivotType::CENTER_BOTTOM;
+
+  public:
+    CreatureType type;
+    CreatureState state;
+    SpriteSheetAnimator animator;
+    Light light;
+
+    float move_speed = 0.0;
+    float jump_speed = 0.0;
+    float max_health = 0.0;
+    float health = 0.0;
+    float damage = 0.0;
+    float attack_distance = 0.0;
+    bool can_view_vertically = false;
+
+    Vector2 position = {0.0, 0.0};
+    Vector2 velocity = {0.0, 0.0};
+
+    // position at the start of the last tick, for the render interpolation
+    Vector2 prev_position = {0.0, 0.0};
+
+    bool is_hflip = false;
+    bool is_grounded = false;
+    bool is_flying = false;
+    // sweeps the fast steps against the static colliders (see CCD_MIN_STEP)
+    bool use_ccd = false;
+    bool can_see_player = false;
+    bool can_attack_player = false;
+    float landed_at_speed = 0.0;
+    float last_received_damage_time = -1.0;
+    RecentAttackIds received_attack_ids;
+    SightCache sight;
+
+    // RIGID_COLLIDER
+    Rectangle rigid_collider_rect;
+
+    // PLATFORM
+    // a few riders at most, the vector keeps its capacity between ticks
+    std::vector<Handle> creatures_on_platform;
+    std::string platform_tag;
+    Vector2 platform_start;
+    Vector2 platform_end;
+    float platform_speed;
+
+    Creature() {}
+
+    Creature(
+        CreatureType type,
+        CreatureState state,
+        SpriteSheetAnimator animator,
+        Light light,
+        float move_speed,
+        float jump_speed,
+        float max_health,
+        float damage,
+        float attack_distance,
+        bool can_view_vertically,
+        Vector2 position
+    )
+        : type(type)
+        , state(state)
+        , animator(animator)
+        , light(light)
+        , move_speed(move_speed)
+        , jump_speed(jump_speed)
+        , max_health(max_health)
+        , damage(damage)
+        , attack_distance(attack_distance)
+        , can_view_vertically(can_view_vertically)
+        , position(position)
+        , health(max_health) {}
+
+    static Creature create_sprite(
+        SpriteSheetAnimator animator,
+        Vector2 position,
+        bool is_hflip,
+        PivotType sprite_pivot_type
+    ) {
+        Creature sprite;
+        sprite.type = CreatureType::SPRITE;
+        sprite.state = CreatureState::IDLE;
+        sprite.animator = animator;
+        sprite.position = position;
+        sprite.is_hflip = is_hflip;
+        sprite.sprite_pivot_type = sprite_pivot_type;
+        sprite.is_flying = true;
+
+        return sprite;
+    }
+
+    static Creature create_platform(
+        SpriteSheetAnimator animator,
+        std::string tag,
+        float speed,
+        Vector2 start,
+        Vector2 end
+    ) {
+        Creature platform;
+        platform.type = CreatureType::PLATFORM;
+        platform.state = CreatureState::IDLE;
+        platform.animator = animator;
+        platform.platform_tag = tag;
+        platform.platform_speed = speed;
+        platform.position = start;
+        platform.platform_start = start;
+        platform.platform_end = end;
+        platform.is_flying = true;
+
+        return platform;
+    }
+
+    static Creature create_rigid_collider(Rectangle rect) {
+        Creature rigid_collider;
+        rigid_collider.type = CreatureType::RIGID_COLLIDER;
+        rigid_collider.state = CreatureState::IDLE;
+        rigid_collider.rigid_collider_rect = rect;
+        rigid_collider.is_flying = true;
+
+        return rigid_collider;
+    }
+
+    int get_view_dir() {
+        return this->is_hflip ? -1 : 1;
+    }
+
+    Pivot get_pivot() {
+        return Pivot(this->sprite_pivot_type, this->position);
+    }
+
+    Sprite get_sprite() {
+        Sprite sprite = this->animator.get_sprite(this->get_pivot(), this->is_hflip);
+        return sprite;
+    }
+
+    // position between the last two ticks, alpha is in [0, 1]
+    Vector2 get_render_position(float alpha) {
+        return Vector2Lerp(this->prev_position, this->position, alpha);
+    }
+
+    Sprite get_render_sprite(float alpha) {
+        Pivot pivot(this->sprite_pivot_type, this->get_render_position(alpha));
+        return this->animator.get_sprite(pivot, this->is_hflip);
+    }
+
+    Collider get_rigid_collider() {
+        Collider collider = this->animator.get_collider(
+            MaskType::RIGID, this->get_pivot(), is_hflip
+        );
+        return collider;
+    }
+
+    Collider get_attack_collider() {
+        Collider collider = this->animator.get_collider(
+            MaskType::ATTACK, this->get_pivot(), is_hflip
+        );
+        return collider;
+    }
+
+    Collider get_block_collider() {
+        Collider collider = this->animator.get_collider(
+            MaskType::BLOCK, this->get_pivot(), is_hflip
+        );
+        return collider;
+    }
+
+    Rectangle get_rigid_rect() {
+        Rectangle rect = {0.0, 0.0, 0.0, 0.0};
+        switch (this->type) {
+            case (CreatureType::RIGID_COLLIDER): rect = this->rigid_collider_rect; break;
+            case (CreatureType::PLATFORM): rect = this->get_rigid_collider().mask; break;
+            default: break;
+        }
+        return rect;
+    }
+
+    Light get_light() {
+        Light light = this->light;
+        light.position = Vector2Add(light.position, this->position);
+        return light;
+    }
+};
+
+// creature colliders snapshot, computed once per frame after the
+// creatures are moved and shared by all collision passes
+class CreatureColliders {
+  public:
+    Collider rigid;
+    Collider attack;
+    Collider block;
+
+    // rect which blocks other creatures (see Creature::get_rigid_rect)
+    Rectangle rigid_rect;
+
+    CreatureColliders() = default;
+
+    CreatureColliders(Creature &creature)
+        : rigid(creature.get_rigid_collider())
+        , attack(creature.get_attack_collider())
+        , block(creature.get_block_collider())
+        , rigid_rect(creature.get_rigid_rect()) {}
+
+    void move(Vector2 step) {
+        for (Rectangle *rect : {&rigid.mask, &attack.mask, &block.mask, &rigid_rect}) {
+            rect->x += step.x;
+            rect->y += step.y;
+        }
+    }
+};
+
+// -----------------------------------------------------------------------
+// creature bodies
+#define BODY_FLYING (1 << 0)
+#define BODY_GROUNDED (1 << 1)
+#define BODY_HFLIP (1 << 2)
+#define BODY_DORMANT (1 << 3)
+#define BODY_CCD (1 << 4)
+
+// Hot physics state of the creatures in packed arrays, index-aligned with
+// creatures and valid only within update(). Bodies are gathered by the
+// behaviour pass and scattered back by the perception pass, both of which
+// touch the creatures anyway. Integration, mtv and knockback in between
+// run on the bodies only and don't pull the wide Creature objects into cache
+class CreatureBodies {
+  public:
+    std::vector<Vector2> positions;
+    std::vector<Vector2> velocities;
+    std::vector<Vector2> steps;  // immediate position steps from the behaviour
+    std::vector<float> landed_at_speeds;
+    std::vector<uint8_t> flags;
+
+    int size() {
+        return this->positions.size();
+    }
+
+    void resize(int size) {
+        this->positions.resize(size);
+        this->velocities.resize(size);
+        this->steps.resize(size);
+        this->landed_at_speeds.resize(size);
+        this->flags.resize(size);
+    }
+
+    void gather(Creature &creature, int idx, Vector2 step) {
+        uint8_t flags = 0;
+        if (creature.is_flying) flags |= BODY_FLYING;
+        if (creature.is_grounded) flags |= BODY_GROUNDED;
+        if (creature.is_hflip) flags |= BODY_HFLIP;
+        if (creature.use_ccd) flags |= BODY_CCD;
+
+        this->positions[idx] = creature.position;
+        this->velocities[idx] = creature.velocity;
+        this->steps[idx] = step;
+        this->landed_at_speeds[idx] = creature.landed_at_speed;
+        this->flags[idx] = flags;
+    }
+
+    void scatter(Creature &creature, int idx) {
+        creature.position = this->positions[idx];
+        creature.velocity = this->velocities[idx];
+        creature.landed_at_speed = this->landed_at_speeds[idx];
+        creature.is_grounded = this->flags[idx] & BODY_GROUNDED;
+        creature.is_hflip = this->flags[idx] & BODY_HFLIP;
+    }
+
+    // applies gravity and x friction, then moves the bodies by their
+    // immediate steps and velocities. Dormant bodies stay as they are
+    void integrate(float dt) {
+        for (int i = 0; i < this->size(); ++i) {
+            uint8_t flags = this->flags[i];
+            if (flags & BODY_DORMANT) continue;
+
+            Vector2 velocity = this->velocities[i];
+            Vector2 step = this->steps[i];
+
+            velocity.y += dt * GRAVITY;
+            if (flags & BODY_FLYING) {
+                velocity = Vector2Zero();
+            } else if (fabs(velocity.x) < dt * X_FRICTION) {
+                velocity.x = 0.0;
+            } else if (velocity.x > 0.0) {
+                velocity.x -= dt * X_FRICTION;
+            } else {
+                velocity.x += dt * X_FRICTION;
+            }
+
+            // don't apply immediate position step if creature is under
+            // some velocity effect
+            if (fabs(velocity.y) > EPSILON) step.y = 0.0;
+            if (fabs(velocity.x) > EPSILON) step.x = 0.0;
+
+            // flip creature only if step.x != 0
+            if (fabs(step.x) > EPSILON) {
+                flags = step.x < 0.0 ? flags | BODY_HFLIP : flags & ~BODY_HFLIP;
+            }
+
+            this->positions[i].x += step.x + velocity.x * dt;
+            this->positions[i].y += step.y + velocity.y * dt;
+            this->velocities[i] = velocity;
+            this->flags[i] = flags;
+        }
+    }
+};
+
+// -----------------------------------------------------------------------
+// effects
+// one-shot animations (block sparks) are not creatures: they live in a
+// fixed pool, never collide and don't grow the creatures list. A new
+// effect is dropped if the pool is full
+#define MAX_N_EFFECTS 256
+#define N_BLOCK_EFFECTS 3
+
+class Effect {
+  public:
+    Vector2 position;
+    float progress;
+    float duration;  // of the whole animation
+    int16_t animation_idx;
+    uint8_t n_frames;
+    uint8_t pivot_type;
+    bool is_hflip;
+};
+
+class EffectPool {
+  private:
+    SpriteSheet *sprite_sheet = nullptr;
+    std::array<Effect, MAX_N_EFFECTS> effects;
+
+  public:
+    int n_effects = 0;
+
+    EffectPool() = default;
+    EffectPool(SpriteSheet *sprite_sheet)
+        : sprite_sheet(sprite_sheet) {}
+
+    void clear() {
+        this->n_effects = 0;
+    }
+
+    void spawn(
+        int animation_idx,
+        float frame_duration,
+        Vector2 position,
+        PivotType pivot_type,
+        bool is_hflip
+    ) {
+        int n_frames = this->sprite_sheet->count_frames(animation_idx);
+        if (n_frames == 0 || this->n_effects == MAX_N_EFFECTS) return;
+
+        this->effects[this->n_effects++] = {
+            .position = position,
+            .progress = 0.0,
+            .duration = n_frames * frame_duration,
+            .animation_idx = (int16_t)animation_idx,
+            .n_frames = (uint8_t)std::min(n_frames, 255),
+            .pivot_type = (uint8_t)pivot_type,
+            .is_hflip = is_hflip};
+    }
+
+    // finished effects are removed, the rest keep their spawn order
+    void update(float dt) {
+        int n_alive = 0;
+        for (int i = 0; i < this->n_effects; ++i) {
+            Effect &effect = this->effects[i];
+            effect.progress = std::fmin(effect.progress + dt / effect.duration, 1.0);
+            if (effect.progress < 1.0) this->effects[n_alive++] = effect;
+        }
+        this->n_effects = n_alive;
+    }
+
+    Sprite get_sprite(int idx) {
+        const Effect &effect = this->effects[idx];
+        int frame_idx = std::round(effect.progress * (effect.n_frames - 1.0));
+        Pivot pivot((PivotType)effect.pivot_type, effect.position);
+        return this->sprite_sheet->get_sprite(
+            effect.animation_idx, frame_idx, pivot, effect.is_hflip
+        );
+    }
+};
+
+// -----------------------------------------------------------------------
+// visibility
+// Everything which can affect the current frame image, collected once per
+// frame from the camera view rect and shared by all draw passes
+class Visibility {
+  public:
+    Rectangle view_rect = {0.0, 0.0, 0.0, 0.0};
+
+    // frame arena vectors, recreated for each frame
+    FrameVector<TileChunkMesh *> chunks;
+    FrameVector<Sprite> creature_sprites;
+    FrameVector<int> creature_ids;  // aligned with creature_sprites
+    FrameVector<Sprite> effect_sprites;
+    FrameVector<Rectangle> shadow_casters;  // moving ones, static are cached
+    FrameVector<Light> lights;
+
+    int n_culled_chunks = 0;
+    int n_culled_creatures = 0;
+    int n_culled_shadow_casters = 0;
+    int n_culled_lights = 0;
+
+    void clear(FrameArena *arena) {
+        this->chunks = FrameVector<TileChunkMesh *>(arena);
+        this->creature_sprites = FrameVector<Sprite>(arena);
+        this->creature_ids = FrameVector<int>(arena);
+        this->effect_sprites = FrameVector<Sprite>(arena);
+        this->shadow_casters = FrameVector<Rectangle>(arena);
+        this->lights = FrameVector<Light>(arena);
+
+        this->n_culled_chunks = 0;
+        this->n_culled_creatures = 0;
+        this->n_culled_shadow_casters = 0;
+        this->n_culled_lights = 0;
+    }
+};
+
+// static shadow triangles of the light which owns the shadow atlas slot.
+// Triangles are in world space, so they stay valid while the camera moves
+// inside the shadow rect
+class ShadowCache {
+  public:
+    bool is_valid = false;
+    Vector2 light_position = {0.0, 0.0};
+    Rectangle shadow_rect = {0.0, 0.0, 0.0, 0.0};
+    std::vector<Triangle> triangles;
+};
+
+// -----------------------------------------------------------------------
+// input
+enum class InputKey {
+    MOVE_RIGHT,
+    MOVE_LEFT,
+    JUMP,
+    ATTACK,
+    BLOCK,
+    DASH,
+    RELOAD,
+};
+
+#define N_INPUT_KEYS 7
+
+// keyboard keys, indexed by InputKey
+const int INPUT_KEY_CODES[N_INPUT_KEYS] = {
+    KEY_D, KEY_A, KEY_W, KEY_SPACE, KEY_LEFT_SHIFT, KEY_LEFT_CONTROL, KEY_R};
+
+// input of a single tick. Presses are accumulated until the next tick
+// consumes them, so they are neither lost nor repeated when a frame runs
+// zero or several ticks
+class Input {
+  public:
+    uint32_t down = 0;
+    uint32_t pressed = 0;
+
+    bool is_down(InputKey key) {
+        return this->down & (1u << (int)key);
+    }
+
+    bool is_pressed(InputKey key) {
+        return this->pressed & (1u << (int)key);
+    }
+
+    void set_down(InputKey key) {
+        this->down |= 1u << (int)key;
+    }
+
+    void press(InputKey key) {
+        this->pressed |= 1u << (int)key;
+    }
+
+    // returns the input of the next tick and clears the presses
+    Input consume() {
+        Input input = *this;
+        this->pressed = 0;
+        return input;
+    }
+};
+
+// deterministic input for the headless runs: walks back and forth,
+// jumps, attacks, blocks and dashes, each with its own period
+Input get_scripted_input(int tick) {
+    Input input;
+    int walk_period = 4 * TICK_RATE;
+    if (tick % walk_period < walk_period / 2) {
+        input.set_down(InputKey::MOVE_RIGHT);
+    } else {
+        input.set_down(InputKey::MOVE_LEFT);
+    }
+
+    if (tick % 90 == 0) input.press(InputKey::JUMP);
+    if (tick % 40 == 20) input.press(InputKey::ATTACK);
+    if (tick % 150 == 75) input.press(InputKey::BLOCK);
+    if (tick % 110 == 55) input.press(InputKey::DASH);
+
+    return input;
+}
+
+// -----------------------------------------------------------------------
+// replay
+// fixed ticks make the simulation depend on nothing but its input and the
+// rng seed, so the recorded input of each tick reproduces the run exactly.
+// Replay file is the header followed by an Input per tick
+#define REPLAY_MAGIC "NDRP"
+#define REPLAY_VERSION 1
+#define DEFAULT_RNG_SEED 0
+
+typedef struct ReplayHeader {
+    char magic[4];
+    uint32_t version;
+    uint64_t seed;
+} ReplayHeader;
+
+static_assert(sizeof(Input) == 2 * sizeof(uint32_t));
+
+class ReplayRecorder {
+  private:
+    std::ofstream file;
+
+  public:
+    ReplayRecorder(const std::string &file_path, uint64_t seed)
+        : file(file_path, std::ios::binary) {
+        if (!this->file) throw std::runtime_error("Failed to open file: " + file_path);
+
+        ReplayHeader header = {.version = REPLAY_VERSION, .seed = seed};
+        std::memcpy(header.magic, REPLAY_MAGIC, 4);
+        this->file.write((const char *)&header, sizeof(header));
+    }
+
+    void record(const Input &input) {
+        this->file.write((const char *)&input, sizeof(input));
+    }
+};
+
+class Replay {
+  public:
+    uint64_t seed = DEFAULT_RNG_SEED;
+    std::vector<Input> inputs;
+
+    Replay() = default;
+
+    Replay(const std::string &file_path) {
+        std::ifstream file(file_path, std::ios::binary);
+        if (!file) throw std::runtime_error("Failed to open file: " + file_path);
+
+        ReplayHeader header;
+        file.read((char *)&header, sizeof(header));
+        if (!file || std::memcmp(header.magic, REPLAY_MAGIC, 4) != 0
+            || header.version != REPLAY_VERSION) {
+            throw std::runtime_error("Not a replay file: " + file_path);
+        }
+        this->seed = header.seed;
+
+        Input input;
+        while (file.read((char *)&input, sizeof(input))) {
+            this->inputs.push_back(input);
+        }
+    }
+};
+
+// -----------------------------------------------------------------------
+// run options
+// parsed from the command line, n_ticks < 0 means the mode's default
+class RunOptions {
+  public:
+    bool is_headless = false;
+    bool is_bench = false;
+    bool is_attack_check = false;
+    int n_ticks = -1;
+    int n_workers = -1;
+    int low_res_scale = 0;
+    uint64_t seed = DEFAULT_RNG_SEED;
+    std::string level_dir = LEVELS_DIR;
+    std::string level_name = LEVEL;
+    std::string record_file_path;
+    std::string replay_file_path;
+};
+
+// -----------------------------------------------------------------------
+// profiler
+// Frame profiler of the PROFILER build (make profile): scoped cpu zones,
+// gpu timer queries and counters, kept for the last frames in a ring
+// buffer. Without PROFILER the macros expand to nothing. Zones are timed
+// only on the main thread
+
+// update phases go first and in the UpdatePhase order, so the phase laps
+// are profiled as they are
+enum class ProfileZone {
+    BEHAVIOUR,
+    INTEGRATE,
+    COLLIDERS,
+    RESOLVE_RIGID,
+    RESOLVE_ATTACK,
+    PERCEPTION,
+    CLEANUP,
+    FRAME,
+    UPDATE,
+    DRAW,
+    VISIBILITY,
+    SPRITE_COLLECTION,
+    SHADOW_ATLAS,
+    UPDATE_LIGHTS,
+    DRAW_TILES,
+    DRAW_SPRITES,
+};
+
+#define N_PROFILE_ZONES 16
+
+const char *PROFILE_ZONE_NAMES[N_PROFILE_ZONES] = {
+    "behaviour",
+    "integrate",
+    "colliders",
+    "resolve_rigid",
+    "resolve_attack",
+    "perception",
+    "cleanup",
+    "frame",
+    "update",
+    "draw",
+    "visibility",
+    "sprite_collection",
+    "shadow_atlas",
+    "update_lights",
+    "draw_tiles",
+    "draw_sprites"};
+
+// gl time elapsed queries can't be nested, so the gpu zones are disjoint
+enum class ProfileGpuZone {
+    SHADOW_ATLAS,
+    SCENE,
+};
+
+#define N_PROFILE_GPU_ZONES 2
+
+const char *PROFILE_GPU_ZONE_NAMES[N_PROFILE_GPU_ZONES] = {
+    "gpu_shadow_atlas", "gpu_scene"};
+
+enum class ProfileCounter {
+    ENTITIES,
+    TILES,
+    DRAW_CALLS,
+    SHADOW_TRIANGLES,
+    LIGHTS,
+    ARENA_BYTES,
+    HEAP_ALLOCATIONS,
+};
+
+#define N_PROFILE_COUNTERS 7
+
+const char *PROFILE_COUNTER_NAMES[N_PROFILE_COUNTERS] = {
+    "entities",
+    "tiles",
+    "draw_calls",
+    "shadow_triangles",
+    "lights",
+    "arena_bytes",
+    "heap_allocations"};
+
+#define PROFILER_N_FRAMES 240
+#define PROFILER_N_EVENTS 65536
+#define PROFILER_N_OVERLAY_FRAMES 60
+#define PROFILER_DUMP_FILE_PATH_PREFIX "./profile"
+
+// gpu results are read this many frames later, when they are surely ready,
+// so reading them doesn't stall the pipeline
+#define PROFILER_N_GPU_LATENCY_FRAMES 3
+
+#ifdef PROFILER
+
+#define GL_TIME_ELAPSED 0x88BF
+#define GL_QUERY_RESULT 0x8866
+extern "C" void (*glad_glGenQueries)(int n, unsigned int *ids);
+extern "C" void (*glad_glDeleteQueries)(int n, const unsigned int *ids);
+extern "C" void (*glad_glBeginQuery)(unsigned int target, unsigned int id);
+extern "C" void (*glad_glEndQuery)(unsigned int target);
+extern "C" void (*glad_glGetQueryObjectui64v)(
+    unsigned int id, unsigned int pname, uint64_t *params
+);
+
+// every operator new of the profiled build is counted, on any thread.
+// Allocations of raylib itself (malloc) are not seen here
+std::atomic<int64_t> profile_n_heap_allocations(0);
+
+void *operator new(size_t size) {
+    profile_n_heap_allocations.fetch_add(1, std::memory_order_relaxed);
+    void *data = std::malloc(size ? size : 1);
+    if (!data) throw std::bad_alloc();
+    return data;
+}
+
+void operator delete(void *data) noexcept {
+    std::free(data);
+}
+
+void operator delete(void *data, size_t) noexcept {
+    std::free(data);
+}
+
+class ProfileFrame {
+  public:
+    double start = 0.0;  // us since the profiler start
+    double zone_times[N_PROFILE_ZONES] = {0.0};  // ms
+    double gpu_times[N_PROFILE_GPU_ZONES] = {0.0};  // ms
+    int counters[N_PROFILE_COUNTERS] = {0};
+};
+
+class ProfileEvent {
+  public:
+    ProfileZone zone;
+    double start;  // us since the profiler start
+    double duration;  // us
+};
+
+class Profiler {
+  private:
+    using Clock = std::chrono::steady_clock;
+    Clock::time_point start_time = Clock::now();
+
+    std::vector<ProfileFrame> frames = std::vector<ProfileFrame>(PROFILER_N_FRAMES);
+    std::vector<ProfileEvent> events = std::vector<ProfileEvent>(PROFILER_N_EVENTS);
+    int64_t n_frames = 0;
+    int64_t n_events = 0;
+    int64_t n_frame_start_heap_allocations = 0;
+
+    // a query set per frame in flight, each set has a query per gpu zone
+    bool is_gpu_loaded = false;
+    unsigned int gpu_queries[PROFILER_N_GPU_LATENCY_FRAMES][N_PROFILE_GPU_ZONES];
+    int64_t gpu_query_frames[PROFILER_N_GPU_LATENCY_FRAMES];
+    uint32_t gpu_query_zones[PROFILER_N_GPU_LATENCY_FRAMES];  // issued zone bits
+
+    ProfileFrame &get_frame(int64_t frame_idx) {
+        return this->frames[frame_idx % PROFILER_N_FRAMES];
+    }
+
+    void read_gpu_queries(int set_idx) {
+        int64_t frame_idx = this->gpu_query_frames[set_idx];
+        bool is_frame_kept = this->n_frames - frame_idx < PROFILER_N_FRAMES;
+        for (int i = 0; i < N_PROFILE_GPU_ZONES; ++i) {
+            if (!(this->gpu_query_zones[set_idx] & (1 << i))) continue;
+
+            uint64_t elapsed = 0;
+            glad_glGetQueryObjectui64v(
+                this->gpu_queries[set_idx][i], GL_QUERY_RESULT, &elapsed
+            );
+            if (is_frame_kept) this->get_frame(frame_idx).gpu_times[i] += 1e-6 * elapsed;
+        }
+        this->gpu_query_zones[set_idx] = 0;
+    }
+
+  public:
+    double get_time() {
+        std::chrono::duration<double, std::micro> elapsed = Clock::now()
+                                                            - this->start_time;
+        return elapsed.count();
+    }
+
+    double get_time(Clock::time_point time_point) {
+        std::chrono::duration<double, std::micro> elapsed = time_point - this->start_time;
+        return elapsed.count();
+    }
+
+    void begin_frame() {
+        int64_t n_heap_allocations = profile_n_heap_allocations.load();
+        this->get_frame(this->n_frames).counters[(int)ProfileCounter::HEAP_ALLOCATIONS]
+            += n_heap_allocations - this->n_frame_start_heap_allocations;
+        this->n_frame_start_heap_allocations = n_heap_allocations;
+
+        this->n_frames += 1;
+        ProfileFrame &frame = this->get_frame(this->n_frames);
+        frame = ProfileFrame();
+        frame.start = this->get_time();
+
+        if (!this->is_gpu_loaded) return;
+        int set_idx = this->n_frames % PROFILER_N_GPU_LATENCY_FRAMES;
+        this->read_gpu_queries(set_idx);
+        this->gpu_query_frames[set_idx] = this->n_frames;
+    }
+
+    void add_event(ProfileZone zone, double start, double end) {
+        this->get_frame(this->n_frames).zone_times[(int)zone] += 1e-3 * (end - start);
+        this->events[this->n_events++ % PROFILER_N_EVENTS] = {
+            .zone = zone, .start = start, .duration = end - start};
+    }
+
+    void count(ProfileCounter counter, int value) {
+        this->get_frame(this->n_frames).counters[(int)counter] += value;
+    }
+
+    // queries need the gl context, headless profiler has only cpu zones
+    void load_gpu() {
+        glad_glGenQueries(
+            PROFILER_N_GPU_LATENCY_FRAMES * N_PROFILE_GPU_ZONES, &this->gpu_queries[0][0]
+        );
+        std::fill_n(this->gpu_query_zones, PROFILER_N_GPU_LATENCY_FRAMES, 0);
+        this->is_gpu_loaded = true;
+    }
+
+    void unload_gpu() {
+        if (!this->is_gpu_loaded) return;
+        glad_glDeleteQueries(
+            PROFILER_N_GPU_LATENCY_FRAMES * N_PROFILE_GPU_ZONES, &this->gpu_queries[0][0]
+        );
+        this->is_gpu_loaded = false;
+    }
+
+    void begin_gpu(ProfileGpuZone zone) {
+        if (!this->is_gpu_loaded) return;
+        int set_idx = this->n_frames % PROFILER_N_GPU_LATENCY_FRAMES;
+        this->gpu_query_zones[set_idx] |= 1 << (int)zone;
+        glad_glBeginQuery(GL_TIME_ELAPSED, this->gpu_queries[set_idx][(int)zone]);
+    }
+
+    void end_gpu() {
+        if (!this->is_gpu_loaded) return;
+        glad_glEndQuery(GL_TIME_ELAPSED);
+    }
+
+    // over the last finished frames, which have their gpu times already
+    ProfileFrame get_average_frame(int n_last_frames) {
+        int64_t last = this->n_frames - PROFILER_N_GPU_LATENCY_FRAMES;
+        int64_t first = std::max(last - n_last_frames + 1, (int64_t)1);
+        ProfileFrame average;
+        if (last < first) return average;
+
+        int n = last - first + 1;
+        int64_t counter_totals[N_PROFILE_COUNTERS] = {0};
+        for (int64_t i = first; i <= last; ++i) {
+            ProfileFrame &frame = this->get_frame(i);
+            for (int j = 0; j < N_PROFILE_ZONES; ++j) {
+                average.zone_times[j] += frame.zone_times[j] / n;
+            }
+            for (int j = 0; j < N_PROFILE_GPU_ZONES; ++j) {
+                average.gpu_times[j] += frame.gpu_times[j] / n;
+            }
+            for (int j = 0; j < N_PROFILE_COUNTERS; ++j) {
+                counter_totals[j] += frame.counters[j];
+            }
+        }
+        for (int j = 0; j < N_PROFILE_COUNTERS; ++j) {
+            average.counters[j] = counter_totals[j] / n;
+        }
+
+        return average;
+    }
+
+    // chrome://tracing (or perfetto) events of the kept cpu zones plus the
+    // per-frame counters, and a csv with a row per kept frame
+    void dump(const std::string &file_path_prefix) {
+        int64_t first_frame = std::max(this->n_frames - PROFILER_N_FRAMES, (int64_t)0)
+                              + 1;
+        int64_t first_event = std::max(this->n_events - PROFILER_N_EVENTS, (int64_t)0);
+
+        std::ofstream trace_file(file_path_prefix + ".json");
+        trace_file << "{\"traceEvents\":[\n";
+        for (int64_t i = first_event; i < this->n_events; ++i) {
+            ProfileEvent &event = this->events[i % PROFILER_N_EVENTS];
+            trace_file << "{\"name\":\"" << PROFILE_ZONE_NAMES[(int)event.zone]
+                       << "\",\"ph\":\"X\",\"pid\":0,\"tid\":0,\"ts\":" << event.start
+                       << ",\"dur\":" << event.duration << "},\n";
+        }
+        for (int64_t i = first_frame; i <= this->n_frames; ++i) {
+            ProfileFrame &frame = this->get_frame(i);
+            trace_file << "{\"name\":\"counters\",\"ph\":\"C\",\"pid\":0,\"ts\":"
+                       << frame.start << ",\"args\":{";
+            for (int j = 0; j < N_PROFILE_COUNTERS; ++j) {
+                trace_file << (j ? "," : "") << "\"" << PROFILE_COUNTER_NAMES[j]
+                           << "\":" << frame.counters[j];
+            }
+            trace_file << "}}" << (i < this->n_frames ? ",\n" : "\n");
+        }
+        trace_file << "]}\n";
+
+        std::ofstream csv_file(file_path_prefix + ".csv");
+        csv_file << "frame";
+        for (const char *name : PROFILE_ZONE_NAMES) csv_file << "," << name;
+        for (const char *name : PROFILE_GPU_ZONE_NAMES) csv_file << "," << name;
+        for (const char *name : PROFILE_COUNTER_NAMES) csv_file << "," << name;
+        csv_file << "\n";
+        for (int64_t i = first_frame; i <= this->n_frames; ++i) {
+            ProfileFrame &frame = this->get_frame(i);
+            csv_file << i;
+            for (double time : frame.zone_times) csv_file << "," << time;
+            for (double time : frame.gpu_times) csv_file << "," << time;
+            for (int value : frame.counters) csv_file << "," << value;
+            csv_file << "\n";
+        }
+    }
+};
+
+Profiler profiler;
+
+class ProfileScope {
+  private:
+    ProfileZone zone;
+    double start;
+
+  public:
+    ProfileScope(ProfileZone zone)
+        : zone(zone)
+        , start(profiler.get_time()) {}
+
+    ~ProfileScope() {
+        profiler.add_event(this->zone, this->start, profiler.get_time());
+    }
+};
+
+class ProfileGpuScope {
+  public:
+    ProfileGpuScope(ProfileGpuZone zone) {
+        profiler.begin_gpu(zone);
+    }
+
+    ~ProfileGpuScope() {
+        profiler.end_gpu();
+    }
+};
+
+#define PROFILE_CONCAT_(a, b) a##b
+#define PROFILE_CONCAT(a, b) PROFILE_CONCAT_(a, b)
+#define PROFILE_SCOPE(zone) \
+    ProfileScope PROFILE_CONCAT(profile_scope_, __LINE__)(ProfileZone::zone)
+#define PROFILE_GPU_SCOPE(zone) \
+    ProfileGpuScope PROFILE_CONCAT(profile_gpu_scope_, __LINE__)(ProfileGpuZone::zone)
+#define PROFILE_EVENT(zone, start, end) \
+    profiler.add_event(zone, profiler.get_time(start), profiler.get_time(end))
+#define PROFILE_COUNT(counter, value) profiler.count(ProfileCounter::counter, value)
+
+#else
+
+#define PROFILE_SCOPE(zone)
+#define PROFILE_GPU_SCOPE(zone)
+#define PROFILE_EVENT(zone, start, end)
+// the value is still used, so locals kept only for the counters don't warn
+#define PROFILE_COUNT(counter, value) ((void)(value))
+
+#endif
+
+// -----------------------------------------------------------------------
+// timings
+enum class UpdatePhase {
+    BEHAVIOUR,
+    INTEGRATE,
+    COLLIDERS,
+    RESOLVE_RIGID,
+    RESOLVE_ATTACK,
+    PERCEPTION,
+    CLEANUP,
+};
+
+#define N_UPDATE_PHASES 7
+
+const char *UPDATE_PHASE_NAMES[N_UPDATE_PHASES] = {
+    "behaviour",
+    "integrate",
+    "colliders",
+    "resolve_rigid",
+    "resolve_attack",
+    "perception",
+    "cleanup"};
+
+// wall time of the update phases, accumulated over all ticks
+class PhaseTimings {
+  private:
+    std::chrono::steady_clock::time_point phase_start;
+
+  public:
+    double totals[N_UPDATE_PHASES] = {0.0};  // seconds
+
+    void start() {
+        this->phase_start = std::chrono::steady_clock::now();
+    }
+
+    // finishes the phase and starts the next one
+    void lap(UpdatePhase phase) {
+        auto now = std::chrono::steady_clock::now();
+        std::chrono::duration<double> elapsed = now - this->phase_start;
+        this->totals[(int)phase] += elapsed.count();
+        PROFILE_EVENT((ProfileZone)phase, this->phase_start, now);
+        this->phase_start = now;
+    }
+};
+
+// -----------------------------------------------------------------------
+// level streaming
+// keeps the chunk meshes of the regions around the camera. The background
+// thread bakes the meshes, the main thread uploads them, since gl can be
+// called only there. Memory is bounded by the streaming radius
+#define STREAMING_RADIUS 1024.0
+#define STREAMING_EVICTION_MARGIN 256.0
+
+// objects of the regions this much further than the spawn radius are
+// decoded ahead, so the spawn rarely waits for the background thread
+#define STREAMING_PREFETCH_MARGIN 512.0
+
+// creatures of a region's level objects, in the file order. Colliders and
+// the other objects are spawned at different radii (see Game::stream_objects)
+class RegionObjects {
+  public:
+    int64_t key;
+    bool is_colliders;
+    std::vector<std::pair<int, Creature>> creatures;  // (object idx, creature)
+};
+
+class ChunkStreamer {
+  private:
+    class StreamedRegion {
+      public:
+        bool is_ready = false;
+        Rectangle rect;
+        std::vector<TileChunkMesh> meshes;
+    };
+
+    TiledLevel *level;
+    SpriteSheet *sprite_sheet;
+    std::thread thread;
+
+    // guarded by the mutex. Object requests go first, the simulation may
+    // wait for them
+    std::mutex mutex;
+    std::condition_variable has_requests;
+    std::condition_variable is_baked;
+    std::deque<int64_t> requests;
+    std::vector<std::pair<int64_t, std::vector<TileChunkMesh>>> baked;
+    std::deque<RegionObjects> object_requests;
+    std::vector<RegionObjects> decoded_objects;
+    bool is_baking = false;
+    bool is_stopped = false;
+
+    // main thread only
+    std::unordered_map<int64_t, StreamedRegion> regions;
+    std::vector<std::pair<int64_t, std::vector<TileChunkMesh>>> ready;
+    std::vector<int64_t> keys;
+
+    void run() {
+        std::unique_lock<std::mutex> lock(this->mutex);
+        while (true) {
+            this->has_requests.wait(lock, [this] {
+                return this->is_stopped || !this->requests.empty()
+                       || !this->object_requests.empty();
+            });
+            if (this->is_stopped) return;
+
+            if (!this->object_requests.empty()) {
+                RegionObjects objects = std::move(this->object_requests.front());
+                this->object_requests.pop_front();
+                this->is_baking = true;
+                lock.unlock();
+
+                this->decode_objects(objects);
+
+                lock.lock();
+                this->decoded_objects.push_back(std::move(objects));
+                this->is_baking = false;
+                this->is_baked.notify_all();
+                continue;
+            }
+
+            int64_t key = this->requests.front();
+            this->requests.pop_front();
+            this->is_baking = true;
+            lock.unlock();
+
+            std::vector<TileChunkMesh> meshes;
+            this->level->bake_region(this->level->regions.at(key), meshes);
+
+            lock.lock();
+            this->baked.push_back({key, std::move(meshes)});
+            this->is_baking = false;
+            this->is_baked.notify_all();
+        }
+    }
+
+    void start() {
+        if (!this->thread.joinable()) {
+            this->thread = std::thread(&ChunkStreamer::run, this);
+        }
+    }
+
+    void unload_meshes(std::vector<TileChunkMesh> &meshes) {
+        for (TileChunkMesh &mesh : meshes) {
+            mesh.unload();
+        }
+    }
+
+    // reads only the immutable level data and the sprite sheet, the
+    // creature isn't in the game yet
+    void decode_objects(RegionObjects &objects) {
+        for (int i : this->level->regions.at(objects.key).object_ids) {
+            Creature creature;
+            if (!this->decode_object(i, objects.is_colliders, creature)) continue;
+
+            creature.prev_position = creature.position;
+            objects.creatures.push_back({i, std::move(creature)});
+        }
+    }
+
+    // false if the object isn't of the requested kind or isn't a creature
+    bool decode_object(int idx, bool is_colliders, Creature &creature) {
+        const BakedObject *objects = this->level->objects;
+        const BakedObject &object = objects[idx];
+        Vector2 object_position = {.x = object.x, .y = object.y};
+        std::string object_type = this->level->get_string(object.type_offset);
+        std::string object_tag = this->level->get_string(object.tag_offset);
+
+        if ((object_type == "rigid_collider") != is_colliders) {
+            return false;
+        } else if (object_type == "rigid_collider") {
+            creature = Creature::create_rigid_collider(
+                {.x = object.x,
+                 .y = object.y,
+                 .width = object.width,
+                 .height = object.height}
+            );
+        } else if (object_type == "player") {
+            creature = Creature(
+                CreatureType::PLAYER,
+                CreatureState::IDLE,
+                SpriteSheetAnimator(this->sprite_sheet, "knight"),
+                Light(30.0, {0.0, -16.0}, {1.0, 0.9, 0.8}, {25.0, 0.2, 0.007}),
+                100.0,
+                250.0,
+                1000.0,
+                50.0,
+                0.0,
+                true,
+                object_position
+            );
+            creature.use_ccd = true;
+        } else if (object_type == "bat") {
+            creature = Creature(
+                CreatureType::BAT,
+                CreatureState::IDLE,
+                SpriteSheetAnimator(this->sprite_sheet, "bat"),
+                Light(),
+                50.0,
+                0.0,
+                300.0,
+                50.0,
+                25.0,
+                true,
+                object_position
+            );
+        } else if (object_type == "wolf") {
+            creature = Creature(
+                CreatureType::WOLF,
+                CreatureState::IDLE,
+                SpriteSheetAnimator(this->sprite_sheet, "wolf"),
+                Light(),
+                80.0,
+                0.0,
+                300.0,
+                50.0,
+                35.0,
+                false,
+                object_position
+            );
+        } else if (object_type == "golem") {
+            creature = Creature(
+                CreatureType::GOLEM,
+                CreatureState::IDLE,
+                SpriteSheetAnimator(this->sprite_sheet, "golem"),
+                Light(30.0, {0.0, -32.0}, {1.0, 0.2, 0.1}, {25.0, 0.5, 0.1}),
+                60.0,
+                0.0,
+                400.0,
+                50.0,
+                35.0,
+                false,
+                object_position
+            );
+        } else if (object_type == "platform" && object.destination_idx != -1) {
+            const BakedObject &dest = objects[object.destination_idx];
+            std::string base_name = "platform_" + object_tag;
+            creature = Creature::create_platform(
+                SpriteSheetAnimator(this->sprite_sheet, base_name),
+                object_tag,
+                PLATFORM_SPEED,
+                object_position,
+                {.x = dest.x, .y = dest.y}
+            );
+        } else if (object_type == "light") {
+            std::string base_name = "light_" + object_tag;
+            PivotType pivot_type = PivotType::CENTER_BOTTOM;
+            Light light(100.0, {0.0, 16.0}, {1.0, 0.7, 0.2}, {25.0, 0.5, 0.1});
+            if (object_tag == "0") {
+                pivot_type = PivotType::CENTER_TOP;
+            }
+            creature = Creature::create_sprite(
+                SpriteSheetAnimator(this->sprite_sheet, base_name),
+                object_position,
+                false,
+                pivot_type
+            );
+            creature.light = light;
+            creature.animator.play(0.2, true);
+        } else {
+            return false;
+        }
+
+        return true;
+    }
+
+  public:
+    int n_meshes = 0;
+
+    ChunkStreamer(TiledLevel *level, SpriteSheet *sprite_sheet)
+        : level(level)
+        , sprite_sheet(sprite_sheet) {}
+
+    // the level and the sprite sheet may be changed by the main thread
+    void reset_objects() {
+        std::unique_lock<std::mutex> lock(this->mutex);
+        this->object_requests.clear();
+        this->is_baked.wait(lock, [this] { return !this->is_baking; });
+        this->decoded_objects.clear();
+    }
+
+    void request_objects(int64_t key, bool is_colliders) {
+        this->start();
+        {
+            std::lock_guard<std::mutex> lock(this->mutex);
+            this->object_requests.push_back({.key = key, .is_colliders = is_colliders});
+        }
+        this->has_requests.notify_one();
+    }
+
+    // waits until the requested objects are decoded
+    RegionObjects get_objects(int64_t key, bool is_colliders) {
+        std::unique_lock<std::mutex> lock(this->mutex);
+        std::vector<RegionObjects> &decoded = this->decoded_objects;
+        auto it = decoded.end();
+        this->is_baked.wait(lock, [&] {
+            it = std::find_if(
+                decoded.begin(),
+                decoded.end(),
+                [&](const RegionObjects &objects) {
+                    return objects.key == key && objects.is_colliders == is_colliders;
+                }
+            );
+            return it != decoded.end();
+        });
+
+        RegionObjects objects = std::move(*it);
+        decoded.erase(it);
+        return objects;
+    }
+
+    // the level is in sync with the main thread again
+    void reset() {
+        this->reset_objects();
+
+        std::unique_lock<std::mutex> lock(this->mutex);
+        this->requests.clear();
+        this->is_baked.wait(lock, [this] { return !this->is_baking; });
+        for (auto &pair : this->baked) {
+            this->unload_meshes(pair.second);
+        }
+        this->baked.clear();
+        lock.unlock();
+
+        for (auto &pair : this->regions) {
+            this->unload_meshes(pair.second.meshes);
+        }
+        this->regions.clear();
+        this->n_meshes = 0;
+    }
+
+    void update(Vector2 center) {
+        this->start();
+
+        // upload the baked regions
+        {
+            std::lock_guard<std::mutex> lock(this->mutex);
+            std::swap(this->ready, this->baked);
+        }
+        for (auto &pair : this->ready) {
+            StreamedRegion *region = HASHMAP_GET_OR_NULL(this->regions, pair.first);
+            if (!region) {
+                this->unload_meshes(pair.second);
+                continue;
+            }
+
+            for (TileChunkMesh &mesh : pair.second) {
+                mesh.upload();
+            }
+            region->meshes = std::move(pair.second);
+            region->is_ready = true;
+            this->n_meshes += region->meshes.size();
+        }
+        this->ready.clear();
+
+        // request the new regions
+        this->level->get_region_keys(center, STREAMING_RADIUS, this->keys);
+        {
+            std::lock_guard<std::mutex> lock(this->mutex);
+            for (int64_t key : this->keys) {
+                if (HASHMAP_GET_OR_NULL(this->regions, key)) continue;
+
+                StreamedRegion &region = this->regions[key];
+                region.rect = this->level->regions.at(key).rect;
+                this->requests.push_back(key);
+            }
+        }
+        this->has_requests.notify_one();
+
+        // evict the far ones, the margin keeps the regions on the border
+        // from being reloaded back and forth
+        float eviction_radius = STREAMING_RADIUS + STREAMING_EVICTION_MARGIN;
+        for (auto it = this->regions.begin(); it != this->regions.end();) {
+            StreamedRegion &region = it->second;
+            if (!region.is_ready
+                || get_point_rect_dist(center, region.rect) <= eviction_radius) {
+                ++it;
+                continue;
+            }
+
+            this->unload_meshes(region.meshes);
+            this->n_meshes -= region.meshes.size();
+            it = this->regions.erase(it);
+        }
+    }
+
+    // in the layers order
+    void get_meshes(Rectangle rect, FrameVector<TileChunkMesh *> &meshes) {
+        meshes.clear();
+        for (auto &pair : this->regions) {
+            if (!CheckCollisionRecs(pair.second.rect, rect)) continue;
+
+            for (TileChunkMesh &mesh : pair.second.meshes) {
+                if (CheckCollisionRecs(mesh.rect, rect)) meshes.push_back(&mesh);
+            }
+        }
+
+        std::sort(
+            meshes.begin(),
+            meshes.end(),
+            [](const TileChunkMesh *a, const TileChunkMesh *b) {
+                return a->chunk_idx < b->chunk_idx;
+            }
+        );
+    }
+
+    void unload() {
+        this->reset();
+        if (!this->thread.joinable()) return;
+
+        {
+            std::lock_guard<std::mutex> lock(this->mutex);
+            this->is_stopped = true;
+        }
+        this->has_requests.notify_one();
+        this->thread.join();
+    }
+};
+
+// -----------------------------------------------------------------------
+// game
+// entities right after the level is loaded, the level reset restores them
+// and keeps all the loaded assets
+class LevelSnapshot {
+  public:
+    SlotMap<Creature> creatures;
+    Handle player;
+    Vector2 camera_target;
+
+    std::unordered_set<int64_t> spawned_regions;
+    std::unordered_set<int64_t> spawned_collider_regions;
+    int64_t player_region_key;
+};
+
+class Game {
+  public:
+    // tiles and sprites go into the scene target if the low-res scale is
+    // set, otherwise straight into the window
+    int low_res_scale = 0;
+    RenderTexture2D scene_target;
+
+    RenderTexture2D shadow_atlas;
+    std::array<ShadowCache, MAX_N_SHADOW_LIGHTS> shadow_caches;
+    TriangleBuffer shadow_buffer;
+    std::vector<Vector3> shadow_vertices;
+    int n_shadow_slots = 0;
+    int n_rebuilt_shadow_caches = 0;
+
+    ShaderManager shader_manager;
+    std::unordered_map<std::string, Shader> shaders;
+
+    // scene shader permutations, indexed by whether any light of the view
+    // casts shadows. The unshadowed one doesn't sample the shadow atlas
+    std::unordered_map<std::string, std::array<Shader, 2>> scene_shaders;
+    UniformBuffer camera_buffer;
+    UniformBuffer lights_buffer;
+    LightsBlock lights_block;
+    StorageBuffer light_tiles_buffer;
+    std::vector<uint32_t> light_tiles_block;
+
+    TextureCache textures;
+    TextureAtlas atlas;
+    SpriteBatch sprite_batch;
+    std::unordered_map<std::string, SpriteSheet> sprite_sheets;
+    std::string level_dir;
+    std::string level_name;
+    TiledLevel tiled_level;
+    ChunkStreamer chunk_streamer;
+
+    SlotMap<Creature> creatures;
+    LevelSnapshot level_snapshot;
+
+    // level objects are decoded by the chunk streamer and spawned by
+    // regions once the player comes close. Creatures of the regions which
+    // went far are saved by the region they are in, until the player
+    // comes back. Ordered maps keep the restore order deterministic
+    std::unordered_set<int64_t> spawned_regions;
+    std::unordered_set<int64_t> spawned_collider_regions;
+    std::unordered_set<int64_t> requested_regions;
+    std::unordered_set<int64_t> requested_collider_regions;
+    std::map<int64_t, std::vector<Creature>> evicted_regions;
+    std::map<int64_t, std::vector<Creature>> evicted_collider_regions;
+    int64_t player_region_key;
+    std::vector<int64_t> region_keys;
+    std::vector<std::pair<int, Creature>> streamed_objects;
+    EffectPool effects;
+    std::array<int, N_BLOCK_EFFECTS> block_effect_animation_idxs;
+
+    // creature indices by CreatureType, rebuilt every tick
+    std::array<std::vector<int>, N_CREATURE_TYPES> type_groups;
+
+    // platforms steps of their riders, applied to the bodies after all
+    // of them are gathered
+    std::vector<std::pair<Handle, Vector2>> rider_steps;
+
+    // index-aligned with creatures, valid only within update()
+    CreatureBodies bodies;
+    std::vector<CreatureColliders> colliders;
+
+    // RIGID_COLLIDER rects never move, so they are gridded once per level.
+    // Other grids are refilled every frame from the colliders snapshot
+    std::vector<Rectangle> static_rigid_rects;
+    SpatialGrid static_rigid_grid;
+    int static_rigid_version = 0;  // bumped on every change of the static rects
+    SpatialGrid rigid_grid;
+    SpatialGrid attack_grid;
+    std::vector<int> candidates;
+
+    // per-creature phases run on the jobs, each thread queries the grids
+    // into its own scratch
+    JobSystem jobs;
+    std::vector<QueryScratch> thread_scratches;
+    std::vector<Vector2> candidate_mtvs;
+
+    // transient data of the frame being drawn
+    FrameArena frame_arena;
+    Visibility visibility;
+    bool show_debug_info = false;
+    bool show_profiler = true;
+
+    GameCamera camera;
+
+    Handle player;
+    float dt = TICK_DT;
+    float time = 0.0;
+    int n_ticks = 0;
+
+    Rng rng;
+
+    // input accumulates between ticks, tick_input is the consumed one
+    Input input;
+    Input tick_input;
+    PhaseTimings timings;
+
+    // headless game has no window and no gpu resources, it can only update
+    bool is_headless = false;
+
+    Game(const RunOptions &options)
+        : low_res_scale(options.low_res_scale)
+        , textures(options.is_headless)
+        , level_dir(options.level_dir)
+        , level_name(options.level_name)
+        , chunk_streamer(&this->tiled_level, &this->sprite_sheets["0"])
+        , jobs(options.n_workers)
+        , rng(options.seed)
+        , is_headless(options.is_headless) {
+        this->thread_scratches.resize(this->jobs.get_n_threads());
+
+        if (this->is_headless) {
+            this->load_sprite_sheets();
+            this->load_level(this->level_dir, this->level_name);
+            return;
+        }
+
+        // scene edges are pixel art sharp after the upscale anyway
+        if (this->low_res_scale == 0) SetConfigFlags(FLAG_MSAA_4X_HINT);
+        SetTargetFPS(60);
+        InitWindow(SCREEN_WIDTH, SCREEN_HEIGHT, "Game");
+#ifdef PROFILER
+        profiler.load_gpu();
+#endif
+
+        rlDisableBackfaceCulling();
+
+        this->camera = GameCamera(500.0, (float)SCREEN_WIDTH / SCREEN_HEIGHT);
+        if (this->low_res_scale > 0) {
+            int width = std::round(this->low_res_scale * this->camera.view_width);
+            int height = std::round(width / this->camera.aspect);
+            this->scene_target = LoadRenderTexture(width, height);
+
+            // upscale.frag needs the bilinear filter for its sharp sampling
+            SetTextureFilter(this->scene_target.texture, TEXTURE_FILTER_BILINEAR);
+            SetTextureWrap(this->scene_target.texture, TEXTURE_WRAP_CLAMP);
+        }
+        this->shadow_atlas = LoadRenderTexture(
+            SHADOW_ATLAS_N_COLS * SHADOW_MAP_WIDTH,
+            SHADOW_ATLAS_N_ROWS * SHADOW_MAP_HEIGHT
+        );
+        SetTextureWrap(this->shadow_atlas.texture, TEXTURE_WRAP_CLAMP);
+        this->shadow_buffer = TriangleBuffer(4096);
+
+        this->sprite_batch = SpriteBatch(SPRITE_BATCH_CAPACITY);
+
+        ShaderManager &manager = this->shader_manager;
+        manager.load();
+        this->shaders["shadow"] = manager.get("shadow.vert", "shadow.frag");
+        this->shaders["upscale"] = manager.get("upscale.vert", "upscale.frag");
+        this->scene_shaders["sprite"] = {
+            manager.get("base.vert", "sprite.frag"),
+            manager.get("base.vert", "sprite.frag", {"SHADOWS"})};
+        this->scene_shaders["sprite_batch"] = {
+            manager.get("sprite_batch.vert", "sprite.frag"),
+            manager.get("sprite_batch.vert", "sprite.frag", {"SHADOWS"})};
+        TraceLog(
+            LOG_INFO,
+            "SHADER: %d programs loaded from the cache, %d compiled",
+            manager.n_cached,
+            manager.n_compiled
+        );
+
+        // samplers are set once, the scene draws bind the textures to
+        // these slots
+        for (auto &pair : this->scene_shaders) {
+            for (Shader shader : pair.second) {
+                int texture_slot = SCENE_TEXTURE_SLOT;
+                int shadow_atlas_slot = SCENE_SHADOW_ATLAS_SLOT;
+                int shadow_atlas_loc = GetShaderLocation(shader, "shadow_atlas");
+                SetShaderValue(
+                    shader,
+                    shader.locs[SHADER_LOC_MAP_DIFFUSE],
+                    &texture_slot,
+                    SHADER_UNIFORM_INT
+                );
+                SetShaderValue(
+                    shader, shadow_atlas_loc, &shadow_atlas_slot, SHADER_UNIFORM_INT
+                );
+            }
+        }
+
+        this->camera_buffer = UniformBuffer(sizeof(CameraBlock), CAMERA_BLOCK_BINDING);
+        this->lights_buffer = UniformBuffer(sizeof(LightsBlock), LIGHTS_BLOCK_BINDING);
+        this->light_tiles_buffer = StorageBuffer(
+            LIGHT_TILES_BLOCK_MAX_SIZE, LIGHT_TILES_BLOCK_BINDING
+        );
+        this->load_sprite_sheets();
+        this->load_level(this->level_dir, this->level_name);
+    }
+
+    ~Game() {
+        // headless game streams the level objects too
+        this->chunk_streamer.unload();
+        if (this->is_headless) return;
+
+        this->sprite_batch.unload();
+        if (this->low_res_scale > 0) UnloadRenderTexture(this->scene_target);
+        UnloadRenderTexture(this->shadow_atlas);
+        this->shadow_buffer.unload();
+        this->camera_buffer.unload();
+        this->lights_buffer.unload();
+        this->light_tiles_buffer.unload();
+
+        this->shader_manager.unload();
+        this->textures.unload();
+#ifdef PROFILER
+        profiler.unload_gpu();
+#endif
+
+        CloseWindow();
+    }
+
+    void load_sprite_sheets() {
+        this->atlas = TextureAtlas(ATLAS_FILE_PATH, this->textures);
+        this->sprite_sheets["0"] = SpriteSheet(
+            SPRITE_SHEETS_DIR, "0", this->atlas, this->textures
+        );
+        this->resolve_effect_animations();
+    }
+
+    // effects keep the animation indices, so they are resolved on every
+    // sprite sheet load
+    void resolve_effect_animations() {
+        SpriteSheet &sprite_sheet = this->sprite_sheets["0"];
+        this->effects = EffectPool(&sprite_sheet);
+        for (int i = 0; i < N_BLOCK_EFFECTS; ++i) {
+            std::string name = "block_effect_" + std::to_string(i);
+            this->block_effect_animation_idxs[i] = sprite_sheet.get_animation_idx(name);
+        }
+    }
+
+    void load_level(std::string dir_path, std::string name) {
+        // the streamer thread must not read the old level anymore
+        this->chunk_streamer.reset();
+        this->tiled_level = TiledLevel(dir_path, name, this->atlas, this->textures);
+        this->invalidate_static_caches();
+
+        float cell_size = this->get_cell_size();
+        this->rigid_grid = SpatialGrid(cell_size);
+        this->attack_grid = SpatialGrid(cell_size);
+
+        this->spawn_creatures();
+    }
+
+    // shadow casters and sight lines are cached against the static rects
+    void invalidate_static_caches() {
+        for (ShadowCache &cache : this->shadow_caches) {
+            cache.is_valid = false;
+        }
+        this->static_rigid_version += 1;
+    }
+
+    float get_cell_size() {
+        return BROADPHASE_CELL_N_TILES * this->tiled_level.header->tile_width;
+    }
+
+    // creates the entities from the level objects around the player and
+    // snapshots them
+    void spawn_creatures() {
+        this->creatures.clear();
+        this->effects.clear();
+        this->static_rigid_rects.clear();
+        this->static_rigid_grid = SpatialGrid(this->get_cell_size());
+        this->chunk_streamer.reset_objects();
+        this->spawned_regions.clear();
+        this->spawned_collider_regions.clear();
+        this->requested_regions.clear();
+        this->requested_collider_regions.clear();
+        this->evicted_regions.clear();
+        this->evicted_collider_regions.clear();
+
+        // the level is streamed around the player, so it's found first
+        Vector2 player_position = Vector2Zero();
+        const BakedObject *objects = this->tiled_level.objects;
+        for (int i = 0; i < this->tiled_level.header->n_objects; ++i) {
+            const char *type = this->tiled_level.get_string(objects[i].type_offset);
+            if (std::strcmp(type, "player") != 0) continue;
+
+            player_position = {.x = objects[i].x, .y = objects[i].y};
+            break;
+        }
+        this->stream_objects(player_position);
+
+        // the snapshot is restored as is, so the level reset keeps the
+        // player too
+        if (!this->get_player()) {
+            throw std::runtime_error("Level has no player: " + this->level_name);
+        }
+
+        this->level_snapshot = {
+            .creatures = this->creatures,
+            .player = this->player,
+            .camera_target = this->camera.target,
+            .spawned_regions = this->spawned_regions,
+            .spawned_collider_regions = this->spawned_collider_regions,
+            .player_region_key = this->player_region_key};
+    }
+
+    // spawns the objects of the regions which came closer than the
+    // streaming radius and evicts the creatures of the ones which went
+    // further than it and the margin. Colliders are streamed one region
+    // further, so the creatures on the edge still stand on the ground
+    void stream_objects(Vector2 center) {
+        TiledLevel &level = this->tiled_level;
+        this->player_region_key = level.get_region_key(center);
+
+        int n_static_rigid_rects = this->static_rigid_rects.size();
+        float collider_radius = STREAMING_RADIUS
+                                + std::fmax(level.region_width, level.region_height);
+        bool is_colliders_evicted = this->evict_creatures(center, collider_radius, true);
+        this->evict_creatures(center, STREAMING_RADIUS, false);
+        if (is_colliders_evicted) this->rebuild_static_rigid_grid();
+
+        this->restore_creatures(center, collider_radius, true);
+        this->restore_creatures(center, STREAMING_RADIUS, false);
+
+        this->streamed_objects.clear();
+        this->decode_objects(center, collider_radius, true);
+        this->decode_objects(center, STREAMING_RADIUS, false);
+
+        // in the file order, as if the whole level was spawned at once
+        std::sort(
+            this->streamed_objects.begin(),
+            this->streamed_objects.end(),
+            [](const std::pair<int, Creature> &a, const std::pair<int, Creature> &b) {
+                return a.first < b.first;
+            }
+        );
+        for (auto &pair : this->streamed_objects) {
+            this->spawn_creature(std::move(pair.second));
+        }
+        this->streamed_objects.clear();
+
+        if (is_colliders_evicted
+            || this->static_rigid_rects.size() != n_static_rigid_rects) {
+            this->invalidate_static_caches();
+        }
+    }
+
+    // collects the decoded objects of the regions within the radius which
+    // aren't spawned yet. The ones within the prefetch margin are requested
+    // ahead, after the ones which are spawned right away
+    void decode_objects(Vector2 center, float radius, bool is_colliders) {
+        TiledLevel &level = this->tiled_level;
+        std::unordered_set<int64_t> &spawned = is_colliders
+                                                   ? this->spawned_collider_regions
+                                                   : this->spawned_regions;
+        std::unordered_set<int64_t> &requested = is_colliders
+                                                     ? this->requested_collider_regions
+                                                     : this->requested_regions;
+
+        level.get_region_keys(center, radius, this->region_keys);
+        for (int64_t key : this->region_keys) {
+            if (!requested.insert(key).second) continue;
+            this->chunk_streamer.request_objects(key, is_colliders);
+        }
+        float prefetch_radius = radius + STREAMING_PREFETCH_MARGIN;
+        level.get_region_keys(center, prefetch_radius, this->region_keys);
+        for (int64_t key : this->region_keys) {
+            if (!requested.insert(key).second) continue;
+            this->chunk_streamer.request_objects(key, is_colliders);
+        }
+
+        level.get_region_keys(center, radius, this->region_keys);
+        for (int64_t key : this->region_keys) {
+            if (!spawned.insert(key).second) continue;
+
+            RegionObjects objects = this->chunk_streamer.get_objects(key, is_colliders);
+            for (auto &pair : objects.creatures) {
+                this->streamed_objects.push_back(std::move(pair));
+            }
+        }
+    }
+
+    // colliders are keyed by their rect, it doesn't move
+    int64_t get_creature_region_key(Creature &creature) {
+        Vector2 position = creature.position;
+        if (creature.type == CreatureType::RIGID_COLLIDER) {
+            position = {creature.rigid_collider_rect.x, creature.rigid_collider_rect.y};
+        }
+        return this->tiled_level.get_region_key(position);
+    }
+
+    // saves the creatures of the regions further than the radius and the
+    // margin, the margin keeps the creatures on the border from being
+    // evicted back and forth. The player always stays. Returns whether
+    // any creature was evicted
+    bool evict_creatures(Vector2 center, float radius, bool is_colliders) {
+        std::map<int64_t, std::vector<Creature>> &evicted
+            = is_colliders ? this->evicted_collider_regions : this->evicted_regions;
+        float eviction_radius = radius + STREAMING_EVICTION_MARGIN;
+
+        bool is_evicted = false;
+        for (int i = 0; i < this->creatures.size();) {
+            Creature &creature = this->creatures[i];
+            int64_t key = this->get_creature_region_key(creature);
+            Rectangle rect = this->tiled_level.get_region_rect(key);
+            if (creature.type == CreatureType::PLAYER
+                || (creature.type == CreatureType::RIGID_COLLIDER) != is_colliders
+                || get_point_rect_dist(center, rect) <= eviction_radius) {
+                ++i;
+                continue;
+            }
+
+            evicted[key].push_back(std::move(creature));
+            this->creatures.remove(this->creatures.get_handle(i));
+            is_evicted = true;
+        }
+
+        return is_evicted;
+    }
+
+    // respawns the saved creatures of the regions within the radius
+    void restore_creatures(Vector2 center, float radius, bool is_colliders) {
+        std::map<int64_t, std::vector<Creature>> &evicted
+            = is_colliders ? this->evicted_collider_regions : this->evicted_regions;
+
+        for (auto it = evicted.begin(); it != evicted.end();) {
+            Rectangle rect = this->tiled_level.get_region_rect(it->first);
+            if (get_point_rect_dist(center, rect) > radius) {
+                ++it;
+                continue;
+            }
+
+            for (Creature &creature : it->second) {
+                this->spawn_creature(std::move(creature));
+            }
+            it = evicted.erase(it);
+        }
+    }
+
+    // objects are streamed in once the player crosses into another region
+    void update_streaming() {
+        Creature *player = this->get_player();
+        int64_t key = this->tiled_level.get_region_key(player->position);
+        if (key != this->player_region_key) this->stream_objects(player->position);
+    }
+
+    void spawn_creature(Creature creature) {
+        Handle handle = this->creatures.insert(std::move(creature));
+        Creature &spawned = *this->creatures.get(handle);
+        if (spawned.type == CreatureType::PLAYER) {
+            this->player = handle;
+            this->camera.target = spawned.position;
+        } else if (spawned.type == CreatureType::RIGID_COLLIDER) {
+            Rectangle rect = spawned.get_rigid_rect();
+            this->static_rigid_grid.insert(this->static_rigid_rects.size(), rect);
+            this->static_rigid_rects.push_back(rect);
+        }
+    }
+
+    // static rects are only appended on spawn, removed ones are regridded
+    // from the colliders which are left
+    void rebuild_static_rigid_grid() {
+        this->static_rigid_rects.clear();
+        this->static_rigid_grid = SpatialGrid(this->get_cell_size());
+        for (Creature &creature : this->creatures) {
+            if (creature.type != CreatureType::RIGID_COLLIDER) continue;
+
+            Rectangle rect = creature.get_rigid_rect();
+            this->static_rigid_grid.insert(this->static_rigid_rects.size(), rect);
+            this->static_rigid_rects.push_back(rect);
+        }
+    }
+
+    void restore_level_snapshot() {
+        const LevelSnapshot &snapshot = this->level_snapshot;
+        this->creatures = snapshot.creatures;
+        this->effects.clear();
+        this->player = snapshot.player;
+        this->camera.target = snapshot.camera_target;
+        this->spawned_regions = snapshot.spawned_regions;
+        this->spawned_collider_regions = snapshot.spawned_collider_regions;
+        this->player_region_key = snapshot.player_region_key;
+
+        // the prefetched objects and the evicted creatures are dropped,
+        // the regions which aren't spawned are decoded again
+        this->chunk_streamer.reset_objects();
+        this->requested_regions = snapshot.spawned_regions;
+        this->requested_collider_regions = snapshot.spawned_collider_regions;
+        this->evicted_regions.clear();
+        this->evicted_collider_regions.clear();
+
+        this->rebuild_static_rigid_grid();
+        this->invalidate_static_caches();
+    }
+
+    // reloads only the assets changed on disk, the unchanged level is just
+    // reset from the snapshot
+    void reload_level() {
+        // the streamer thread must not decode with the old sprite sheets
+        this->chunk_streamer.reset_objects();
+        bool is_textures_resized = this->textures.reload_changed();
+
+        // sprite and tile sheets keep the image origins of the old atlas
+        if (this->atlas.is_outdated()) {
+            this->load_sprite_sheets();
+            this->load_level(this->level_dir, this->level_name);
+            return;
+        }
+
+        // animators of the creatures hold the animation indices of the old
+        // sprite sheet, so the creatures are respawned
+        bool is_sprite_sheets_changed = false;
+        for (auto &pair : this->sprite_sheets) {
+            if (!pair.second.is_outdated()) continue;
+            pair.second = SpriteSheet(
+                SPRITE_SHEETS_DIR, pair.first, this->atlas, this->textures
+            );
+            this->resolve_effect_animations();
+            is_sprite_sheets_changed = true;
+        }
+
+        if (this->tiled_level.is_outdated()) {
+            this->load_level(this->level_dir, this->level_name);
+            return;
+        }
+
+        // meshes are normalized by the texture size on upload
+        if (is_textures_resized) this->chunk_streamer.reset();
+        if (is_sprite_sheets_changed) {
+            this->spawn_creatures();
+        } else {
+            this->restore_level_snapshot();
+        }
+    }
+
+    // accumulates the keyboard input of the frame for the next tick
+    void poll_input() {
+        this->input.down = 0;
+        for (int i = 0; i < N_INPUT_KEYS; ++i) {
+            if (IsKeyDown(INPUT_KEY_CODES[i])) this->input.set_down((InputKey)i);
+            if (IsKeyPressed(INPUT_KEY_CODES[i])) this->input.press((InputKey)i);
+        }
+    }
+
+    // fnv-1a over the simulation state, a replay of the same recording must
+    // end with the same hash
+    uint64_t get_state_hash() {
+        uint64_t hash = get_fnv_hash(nullptr, 0);
+        auto mix = [&](const void *data, size_t size) {
+            hash = get_fnv_hash(data, size, hash);
+        };
+
+        uint64_t rng_state = this->rng.get_state();
+        mix(&this->n_ticks, sizeof(this->n_ticks));
+        mix(&rng_state, sizeof(rng_state));
+        for (Creature &creature : this->creatures) {
+            mix(&creature.type, sizeof(creature.type));
+            mix(&creature.state, sizeof(creature.state));
+            mix(&creature.position, sizeof(creature.position));
+            mix(&creature.velocity, sizeof(creature.velocity));
+            mix(&creature.health, sizeof(creature.health));
+
+            // attack ids are set by the parallel behaviours
+            uint32_t animation_id = creature.animator.get_animation_id();
+            mix(&animation_id, sizeof(animation_id));
+            hash = creature.received_attack_ids.get_hash(hash);
+        }
+
+        return hash;
+    }
+
+    // advances the simulation by a single fixed tick
+    void update() {
+        PROFILE_SCOPE(UPDATE);
+        this->tick_input = this->input.consume();
+        if (this->tick_input.is_pressed(InputKey::RELOAD)) {
+            this->reload_level();
+            return;
+        }
+
+        this->timings.start();
+
+        this->update_streaming();
+
+        this->n_ticks += 1;
+        this->time += this->dt;
+
+        // group creatures by type, so each behaviour runs as a homogeneous batch
+        for (std::vector<int> &group : this->type_groups) {
+            group.clear();
+        }
+        for (int i = 0; i < this->creatures.size(); ++i) {
+            this->type_groups[(int)this->creatures[i].type].push_back(i);
+        }
+
+        this->rider_steps.clear();
+        this->bodies.resize(this->creatures.size());
+        // PLAYER consumes the input and PLATFORM pushes rider steps, they
+        // stay on this thread. Other behaviours touch only their creature
+        this->update_group<&Game::update_player, false>(CreatureType::PLAYER);
+        this->update_group<&Game::update_bat, true, true>(CreatureType::BAT);
+        this->update_group<&Game::update_wolf, true, true>(CreatureType::WOLF);
+        this->update_group<&Game::update_golem, true, true>(CreatureType::GOLEM);
+        this->update_group<&Game::update_sprite, true>(CreatureType::SPRITE);
+        this->update_group<&Game::update_platform, false>(CreatureType::PLATFORM);
+        this->update_group<&Game::update_inert, true>(CreatureType::RIGID_COLLIDER);
+        this->update_group<&Game::update_inert, true>(CreatureType::NONE);
+
+        // riders are carried by the platform step, but not through the
+        // static colliders
+        for (auto [handle, step] : this->rider_steps) {
+            int idx = this->creatures.get_dense_idx(handle);
+            if (idx == -1) continue;
+            Collider collider = this->creatures[idx].get_rigid_collider();
+            if (collider.id) step = this->clip_static_step(collider.mask, step);
+            Vector2 &position = this->bodies.positions[idx];
+            position = Vector2Add(position, step);
+        }
+        this->effects.update(this->dt);
+
+        this->timings.lap(UpdatePhase::BEHAVIOUR);
+
+        // -----------------------------------------------------------
+        // integrate bodies
+        this->bodies.integrate(this->dt);
+
+        // continuous collision of the fast bodies, the not yet scattered
+        // creature is still at the tick start. Axes are swept one by one,
+        // so the ground under the body doesn't stop its horizontal step
+        for (int i = 0; i < this->bodies.size(); ++i) {
+            if (!(this->bodies.flags[i] & BODY_CCD)) continue;
+
+            Creature &creature = this->creatures[i];
+            Vector2 &position = this->bodies.positions[i];
+            Vector2 step = Vector2Subtract(position, creature.position);
+            if (fabs(step.x) <= CCD_MIN_STEP && fabs(step.y) <= CCD_MIN_STEP) continue;
+
+            Collider collider = creature.get_rigid_collider();
+            if (!collider.id) continue;
+
+            Rectangle rect = collider.mask;
+            if (fabs(step.x) > CCD_MIN_STEP) {
+                step.x = this->clip_static_step(rect, {step.x, 0.0}).x;
+            }
+            rect.x += step.x;
+            if (fabs(step.y) > CCD_MIN_STEP) {
+                step.y = this->clip_static_step(rect, {0.0, step.y}).y;
+            }
+            position = Vector2Add(creature.position, step);
+        }
+        this->timings.lap(UpdatePhase::INTEGRATE);
+
+        // -----------------------------------------------------------
+        // compute colliders
+        this->colliders.clear();
+        this->rigid_grid.clear();
+        this->attack_grid.clear();
+        for (int i = 0; i < this->creatures.size(); ++i) {
+            // colliders follow the integrated bodies
+            Creature &creature = this->creatures[i];
+            this->bodies.scatter(creature, i);
+            CreatureColliders colliders(creature);
+
+            bool is_static = creature.type == CreatureType::RIGID_COLLIDER;
+            if (!is_static && colliders.rigid_rect.width > 0.0) {
+                this->rigid_grid.insert(i, colliders.rigid_rect);
+            }
+            if (colliders.attack.id) {
+                this->attack_grid.insert(i, colliders.attack.mask);
+            }
+
+            // platforms riders are collected again in the resolve pass
+            if (creature.type == CreatureType::PLATFORM) {
+                creature.creatures_on_platform.clear();
+            }
+
+            this->colliders.push_back(colliders);
+        }
+        this->timings.lap(UpdatePhase::COLLIDERS);
+
+        // -----------------------------------------------------------
+        // resolve rigid colliders, only on the bodies
+        CreatureBodies &bodies = this->bodies;
+        for (int i = 0; i < this->creatures.size(); ++i) {
+            // platforms are kinematic, they push but are never pushed
+            Creature &creature = this->creatures[i];
+            CreatureColliders &rigid_colliders = this->colliders[i];
+            Collider rigid_collider = rigid_colliders.rigid;
+            if (!rigid_collider.id || creature.type == CreatureType::PLATFORM) continue;
+            Vector2 step = Vector2Subtract(creature.position, creature.prev_position);
+
+            // compute mtv
+            float mtv_neg_x = 0.0;
+            float mtv_pos_x = 0.0;
+            float mtv_neg_y = 0.0;
+            float mtv_pos_y = 0.0;
+            auto push_mtv = [&](Vector2 collider_mtv) {
+                mtv_neg_x = std::min(mtv_neg_x, collider_mtv.x);
+                mtv_pos_x = std::max(mtv_pos_x, collider_mtv.x);
+                mtv_neg_y = std::min(mtv_neg_y, collider_mtv.y);
+                mtv_pos_y = std::max(mtv_pos_y, collider_mtv.y);
+            };
+
+            // static colliders
+            this->static_rigid_grid.query_rect(rigid_collider.mask, this->candidates);
+            get_aabb_mtvs(
+                rigid_collider.mask,
+                this->static_rigid_rects,
+                this->candidates,
+                this->candidate_mtvs
+            );
+            for (Vector2 collider_mtv : this->candidate_mtvs) {
+                push_mtv(collider_mtv);
+            }
+
+            // moving colliders (platforms), the creature rides only one of
+            // the overlapped platforms, so it isn't carried a few times
+            bool is_riding = false;
+            this->rigid_grid.query_rect(rigid_collider.mask, this->candidates);
+            for (int j : this->candidates) {
+                if (i == j) continue;
+
+                // resolved relative to the platform motion, the fast one
+                // catches the riders instead of passing through them
+                Creature &collider_creature = this->creatures[j];
+                Rectangle rect = this->colliders[j].rigid_rect;
+                Vector2 collider_step = Vector2Subtract(
+                    collider_creature.position, collider_creature.prev_position
+                );
+                Vector2 collider_mtv = get_swept_aabb_mtv(
+                    rigid_collider.mask, step, rect, collider_step
+                );
+                push_mtv(collider_mtv);
+
+                if (collider_creature.type == CreatureType::PLATFORM
+                    && collider_mtv.y < 0.0 && !is_riding) {
+                    // put creature on the platform
+                    is_riding = true;
+                    std::vector<Handle> &riders = collider_creature.creatures_on_platform;
+                    Handle handle = this->creatures.get_handle(i);
+                    if (std::find(riders.begin(), riders.end(), handle) == riders.end()) {
+                        riders.push_back(handle);
+                    }
+                }
+            }
+
+            // resolve mtv
+            Vector2 mtv = {mtv_neg_x, mtv_neg_y};
+            if (fabs(mtv_pos_x) > fabs(mtv_neg_x)) mtv.x = mtv_pos_x;
+            if (fabs(mtv_pos_y) > fabs(mtv_neg_y)) mtv.y = mtv_pos_y;
+
+            // vertical smash
+            if (fabs(mtv_pos_y) > EPSILON && fabs(mtv_neg_y) > EPSILON) {
+                // when smashed vertically, set mtv.y to the negative one,
+                // e.g resolve only floor collision
+                mtv.y = mtv_neg_y;
+                this->receive_damage(this->creatures[i], this->creatures[i].health);
+            }
+            // horizontal smash
+            if (fabs(mtv_pos_x) > EPSILON && fabs(mtv_neg_x) > EPSILON) {
+                mtv.x = 0.0;
+                this->receive_damage(this->creatures[i], this->creatures[i].health);
+            }
+
+            bodies.positions[i] = Vector2Add(bodies.positions[i], mtv);
+            rigid_colliders.move(mtv);
+
+            Vector2 &velocity = bodies.velocities[i];
+            if (mtv.y < -EPSILON && velocity.y > EPSILON) {
+                // hit the ground
+                bodies.landed_at_speeds[i] = velocity.y;
+                velocity = Vector2Zero();
+                bodies.flags[i] |= BODY_GROUNDED;
+            } else if (mtv.y > EPSILON && velocity.y < -EPSILON) {
+                // hit the ceil
+                velocity.y = 0.0;
+            } else {
+                bodies.flags[i] &= ~BODY_GROUNDED;
+            }
+        }
+
+        this->timings.lap(UpdatePhase::RESOLVE_RIGID);
+
+        // -----------------------------------------------------------
+        // resolve attack colliders, after all bodies are resolved
+        for (int i = 0; i < this->creatures.size(); ++i) {
+            Creature &rigid_creature = this->creatures[i];
+            CreatureColliders &rigid_colliders = this->colliders[i];
+            Collider rigid_collider = rigid_colliders.rigid;
+            if (!rigid_collider.id) continue;
+
+            Collider block_collider = rigid_colliders.block;
+            Rectangle target_rect = rigid_collider.mask;
+            if (block_collider.id) {
+                target_rect = get_rects_bound(target_rect, block_collider.mask);
+            }
+
+            this->attack_grid.query_rect(target_rect, this->candidates);
+            for (int j : this->candidates) {
+                Creature &attacker_creature = this->creatures[j];
+                Collider attack_collider = this->colliders[j].attack;
+                AttackId attack_id = {this->creatures.get_handle(j), attack_collider.id};
+
+                // creature can't attack itself
+                if (i == j) continue;
+
+                // creature is already dead
+                if (rigid_creature.health <= 0.0) continue;
+
+                // one of the creatures must be the PLAYER
+                if (rigid_creature.type != CreatureType::PLAYER
+                    && attacker_creature.type != CreatureType::PLAYER)
+                    continue;
+
+                // ignore already received attack
+                if (rigid_creature.received_attack_ids.contains(attack_id)) {
+                    continue;
+                }
 
-    Creature *player;
-    float dt = 0.0;
-    float time = 0.0;
+                // the attack can't outlive the attacker animation
+                float duration = attacker_creature.animator.get_duration();
+                int expire_tick = this->n_ticks + 1 + std::ceil(duration * TICK_RATE);
 
-    Game() {
-        SetConfigFlags(FLAG_MSAA_4X_HINT);
-        SetTargetFPS(60);
-        InitWindow(SCREEN_WIDTH, SCREEN_HEIGHT, "Game");
+                if (block_collider.id
+                    && CheckCollisionRecs(attack_collider.mask, block_collider.mask)) {
+                    // if block is successful, apply damage to the attacker
+                    int effect_idx = this->rng.next_int(N_BLOCK_EFFECTS);
+                    this->effects.spawn(
+                        this->block_effect_animation_idxs[effect_idx],
+                        0.02,
+                        get_rect_center(block_collider.mask),
+                        PivotType::CENTER_CENTER,
+                        rigid_creature.is_hflip
+                    );
 
-        rlDisableBackfaceCulling();
+                    rigid_creature.received_attack_ids.insert(
+                        attack_id, this->n_ticks, expire_tick
+                    );
+                    attacker_creature.received_attack_ids.insert(
+                        attack_id, this->n_ticks, expire_tick
+                    );
 
-        this->camera = GameCamera(500.0, (float)SCREEN_WIDTH / SCREEN_HEIGHT);
-        this->shadow_map = LoadRenderTexture(SHADOW_MAP_WIDTH, SHADOW_MAP_HEIGHT);
-        SetTextureWrap(this->shadow_map.texture, TEXTURE_WRAP_CLAMP);
+                    this->receive_damage(attacker_creature, rigid_creature.damage);
+                    bodies.velocities[j] = {
+                        .x = rigid_creature.get_view_dir() * 75.0f, .y = -75.0f};
+                } else if (CheckCollisionRecs(
+                               rigid_collider.mask, attack_collider.mask
+                           )) {
+                    // else if attack is successful, apply damage to the target
+                    rigid_creature.received_attack_ids.insert(
+                        attack_id, this->n_ticks, expire_tick
+                    );
 
-        this->shaders["sprite"] = load_shader("base.vert", "sprite.frag");
-        this->shaders["shadow"] = load_shader("base.vert", "shadow.frag");
-        this->sprite_sheets["0"] = SpriteSheet("./resources/sprite_sheets/", "0");
-        this->load_level(LEVELS_DIR, LEVEL);
-    }
+                    this->receive_damage(rigid_creature, attacker_creature.damage);
+                    bodies.velocities[i] = {
+                        .x = attacker_creature.get_view_dir() * 75.0f, .y = -75.0f};
+                }
+            }
+        }
 
-    ~Game() {
-        this->tiled_level.unload();
+        this->timings.lap(UpdatePhase::RESOLVE_ATTACK);
 
-        UnloadRenderTexture(this->shadow_map);
+        // -----------------------------------------------------------
+        // update can_see_player, can_attack_player.
+        // creatures only read the resolved snapshot and write themselves.
+        // bodies are scattered back here, so the player position is taken
+        // from its body
+        Creature *player = this->get_player();
+        int player_idx = this->creatures.get_dense_idx(this->player);
+        Vector2 player_position = bodies.positions[player_idx];
+        auto update_perception = [&](int thread_idx, int begin, int end) {
+            QueryScratch &scratch = this->thread_scratches[thread_idx];
+            for (int i = begin; i < end; ++i) {
+                Creature &creature = this->creatures[i];
+                this->bodies.scatter(creature, i);
+                creature.can_see_player = false;
+                creature.can_attack_player = false;
+
+                // can't see and can't attack the dead player or if dead itself
+                if (player->health <= 0.0) continue;
+                if (creature.health <= 0.0) continue;
+
+                Vector2 view_line_start = creature.position;
+                Vector2 view_line_end = player_position;
+                float dist = Vector2Distance(view_line_start, view_line_end);
+
+                // PLAYER can't see or attack himself
+                if (creature.type == CreatureType::PLAYER) continue;
+
+                // creature can't see or attack the PLAYER if its allowed view
+                // angle is restricted (can_view_vertically = false) and the
+                // actual view angle is too large
+                if (!creature.can_view_vertically
+                    && get_line_angle(view_line_start, view_line_end)
+                           > CREATURE_MAX_VIEW_ANGLE) {
+                    continue;
+                }
 
-        for (auto &pair : this->shaders)
-            UnloadShader(pair.second);
-        for (auto &pair : this->sprite_sheets)
-            pair.second.unload();
+                // creature can't see the PLAYER if the PLAYER is too far away
+                if (dist > CREATURE_VIEW_DISTANCE) continue;
+
+                // creatures positions usually touches the ground, so
+                // I offset them to prevent the view ray always collid with
+                // the ground.
+                // TODO: I could compute the middle point of the colliders,
+                // but they may be not present. Or I can factor out this
+                // offset into a separate creature parameter (e.g eyes_offset).
+                view_line_start.y += VIEW_LINE_Y_OFFSET;
+                view_line_end.y += VIEW_LINE_Y_OFFSET;
+
+                // can_see_player
+                SightCache &sight = creature.sight;
+                if (dist < PERCEPTION_NEAR_DISTANCE || this->n_ticks >= sight.next_tick) {
+                    this->update_sight(sight, i, view_line_start, view_line_end, scratch);
+                    sight.next_tick = this->n_ticks + PERCEPTION_FAR_N_TICKS;
+                }
+                creature.can_see_player = sight.is_clear;
 
-        CloseWindow();
-    }
+                // can_attack_player
+                if (creature.can_see_player) {
+                    creature.can_attack_player = dist < creature.attack_distance;
+                }
+            }
+        };
+        this->jobs.parallel_for(this->creatures.size(), update_perception);
 
-    void load_level(std::string dir_path, std::string name) {
-        this->tiled_level.unload();
-        this->creatures.clear();
+        this->timings.lap(UpdatePhase::PERCEPTION);
 
-        this->tiled_level = TiledLevel(dir_path, name);
-
-        // get all objects for the map
-        std::unordered_map<int, json> objects;
-        for (auto layer_json : this->tiled_level.meta["layers"]) {
-            for (auto object : layer_json["objects"]) {
-                objects[object["id"]] = object;
-            }
-        }
-
-        // iterate over all objects and create game entities
-        for (auto &item : objects) {
-            auto object = item.second;
-            auto object_x = object["x"];
-            auto object_y = object["y"];
-            auto object_name = object["name"];
-            auto object_width = object["width"];
-            auto object_height = object["height"];
-            Vector2 object_position = {.x = object_x, .y = object_y};
-
-            std::string object_type = "";
-            std::string object_tag = "";
-            int destination_object_id = -1;
-            for (auto property : object["properties"]) {
-                std::string name = property["name"];
-                auto value = property["value"];
-                if (name == "type") object_type = value;
-                else if (name == "destination") destination_object_id = value;
-                else if (name == "tag") object_tag = value;
-            }
-
-            if (object_type == "rigid_collider") {
-                this->creatures.push_back(Creature::create_rigid_collider(
-                    {.x = object_x,
-                     .y = object_y,
-                     .width = object_width,
-                     .height = object_height}
-                ));
-            } else if (object_type == "player") {
-                this->creatures.push_back(Creature(
-                    CreatureType::PLAYER,
-                    CreatureState::IDLE,
-                    SpriteSheetAnimator(&this->sprite_sheets["0"], "knight"),
-                    Light(30.0, {0.0, -16.0}, {1.0, 0.9, 0.8}, {25.0, 0.2, 0.007}),
-                    100.0,
-                    250.0,
-                    1000.0,
-                    50.0,
-                    0.0,
-                    true,
-                    object_position
-                ));
-                this->camera.target = object_position;
-            } else if (object_type == "bat") {
-                this->creatures.push_back(Creature(
-                    CreatureType::BAT,
-                    CreatureState::IDLE,
-                    SpriteSheetAnimator(&this->sprite_sheets["0"], "bat"),
-                    Light(),
-                    50.0,
-                    0.0,
-                    300.0,
-                    50.0,
-                    25.0,
-                    true,
-                    object_position
-                ));
-            } else if (object_type == "wolf") {
-                this->creatures.push_back(Creature(
-                    CreatureType::WOLF,
-                    CreatureState::IDLE,
-                    SpriteSheetAnimator(&this->sprite_sheets["0"], "wolf"),
-                    Light(),
-                    80.0,
-                    0.0,
-                    300.0,
-                    50.0,
-                    35.0,
-                    false,
-                    object_position
-                ));
-            } else if (object_type == "golem") {
-                this->creatures.push_back(Creature(
-                    CreatureType::GOLEM,
-                    CreatureState::IDLE,
-                    SpriteSheetAnimator(&this->sprite_sheets["0"], "golem"),
-                    Light(30.0, {0.0, -32.0}, {1.0, 0.2, 0.1}, {25.0, 0.5, 0.1}),
-                    60.0,
-                    0.0,
-                    400.0,
-                    50.0,
-                    35.0,
-                    false,
-                    object_position
-                ));
-            } else if (object_type == "platform") {
-                auto dest = objects[destination_object_id];
-                std::string base_name = "platform_" + object_tag;
-                this->creatures.push_back(Creature::create_platform(
-                    SpriteSheetAnimator(&this->sprite_sheets["0"], base_name),
-                    object_tag,
-                    PLATFORM_SPEED,
-                    object_position,
-                    {.x = dest["x"], .y = dest["y"]}
-                ));
-            } else if (object_type == "light") {
-                std::string base_name = "light_" + object_tag;
-                PivotType pivot_type = PivotType::CENTER_BOTTOM;
-                Light light(100.0, {0.0, 16.0}, {1.0, 0.7, 0.2}, {25.0, 0.5, 0.1});
-                if (object_tag == "0") {
-                    pivot_type = PivotType::CENTER_TOP;
-                }
-                Creature creature = Creature::create_sprite(
-                    SpriteSheetAnimator(&this->sprite_sheets["0"], base_name),
-                    object_position,
-                    false,
-                    pivot_type
-                );
-                creature.light = light;
-                creature.animator.play(0.2, true);
-                this->creatures.push_back(creature);
+        // -----------------------------------------------------------
+        // clean up DELETE creatures.
+        // removal moves the last creature into the freed place, so the same
+        // index is checked again
+        for (int i = 0; i < this->creatures.size();) {
+            if (this->creatures[i].state == CreatureState::DELETE) {
+                this->creatures.remove(this->creatures.get_handle(i));
+            } else {
+                ++i;
             }
         }
+        this->timings.lap(UpdatePhase::CLEANUP);
     }
 
-    void update() {
-        if (IsKeyPressed(KEY_R)) {
-            this->load_level(LEVELS_DIR, LEVEL);
-            return;
+    // step of the rect cut at its first contact with the static colliders.
+    // The rect is shrunk by the skin: resting contacts don't stop it and
+    // the cut step still overlaps the contact, so the mtv resolves it
+    Vector2 clip_static_step(Rectangle rect, Vector2 step) {
+        float skin = CONTACT_SKIN;
+        rect.x += skin;
+        rect.y += skin;
+        rect.width -= 2.0f * skin;
+        rect.height -= 2.0f * skin;
+        Rectangle moved = {rect.x + step.x, rect.y + step.y, rect.width, rect.height};
+        Rectangle swept = get_rects_bound(rect, moved);
+        this->static_rigid_grid.query_rect(swept, this->candidates);
+
+        float toi = 1.0;
+        for (int j : this->candidates) {
+            toi = std::min(toi, get_aabb_toi(rect, step, this->static_rigid_rects[j]));
         }
 
-        // find player
-        for (auto &creature : this->creatures) {
-            if (creature.type == CreatureType::PLAYER) this->player = &creature;
+        return Vector2Scale(step, toi);
+    }
+
+    // moving creatures are tested every time, they are few along the line
+    void update_sight(
+        SightCache &sight, int idx, Vector2 start, Vector2 end, QueryScratch &scratch
+    ) {
+        bool is_moved = start.x != sight.start.x || start.y != sight.start.y
+                        || end.x != sight.end.x || end.y != sight.end.y;
+        if (is_moved || sight.static_version != this->static_rigid_version) {
+            this->static_rigid_grid.query_line(
+                start, end, scratch.candidates, scratch.stamps
+            );
+            int n_hits = check_collision_rects_line(
+                this->static_rigid_rects, scratch.candidates, start, end, scratch.hits
+            );
+            sight.start = start;
+            sight.end = end;
+            sight.static_version = this->static_rigid_version;
+            sight.is_static_clear = n_hits == 0;
         }
 
-        this->dt = GetFrameTime();
-        this->time += this->dt;
-        this->camera.target = player->position;
+        sight.is_clear = sight.is_static_clear;
+        if (!sight.is_clear) return;
 
-        for (auto &creature : this->creatures) {
-            creature.animator.update(this->dt);
+        this->rigid_grid.query_line(start, end, scratch.candidates, scratch.stamps);
+        for (int j : scratch.candidates) {
+            if (j == idx) continue;
 
-            // turn off light if non-player creature is dead
-            if (creature.state == CreatureState::DEATH
-                && creature.type != CreatureType::PLAYER) {
-                creature.light.is_off = true;
+            Rectangle rect = this->colliders[j].rigid_rect;
+            if (check_collision_rect_line(rect, start, end)) {
+                sight.is_clear = false;
+                break;
             }
+        }
+    }
 
-            // clear old received attack ids once in a while
-            if (this->time - creature.last_received_damage_time > 5.0
-                && creature.received_attack_ids.size()) {
-                creature.received_attack_ids.clear();
-            }
+    // -------------------------------------------------------------------
+    // creature behaviours
+    // behaviour is a template argument, so each type group runs its own loop
+    // with the behaviour call resolved at compile time and no per-creature
+    // type dispatch. New creature type is a new behaviour and a new group.
+    // Parallel group must not touch anything but its own creatures. Mobs of
+    // a sleeping group are frozen while they are away from the player
+    template <
+        Vector2 (Game::*update_behaviour)(Creature &),
+        bool is_parallel,
+        bool can_sleep = false>
+    void update_group(CreatureType type) {
+        std::vector<int> &group = this->type_groups[(int)type];
+        Vector2 wake_center = this->get_player()->position;
+        auto update_range = [&](int thread_idx, int begin, int end) {
+            for (int i = begin; i < end; ++i) {
+                int idx = group[i];
+                Creature &creature = this->creatures[idx];
+                creature.prev_position = creature.position;
+
+                if (can_sleep
+                    && Vector2DistanceSqr(creature.position, wake_center)
+                           > WAKE_DISTANCE * WAKE_DISTANCE) {
+                    this->bodies.gather(creature, idx, Vector2Zero());
+                    this->bodies.flags[idx] |= BODY_DORMANT;
+                    continue;
+                }
 
-            // immediate position_step needs to be computed by
-            // the Character update logic (will be applied later)
-            Vector2 position_step = Vector2Zero();
+                creature.animator.update(this->dt);
 
-            // -----------------------------------------------------------
-            // update creature
-            if (creature.type == CreatureType::PLAYER) {
-                // -> DEATH
-                if (creature.state != CreatureState::DEATH && creature.health <= 0.0) {
-                    creature.state = CreatureState::DEATH;
+                // turn off light if non-player creature is dead
+                if (creature.state == CreatureState::DEATH
+                    && creature.type != CreatureType::PLAYER) {
+                    creature.light.is_off = true;
                 }
 
-                switch (creature.state) {
-                    case CreatureState::IDLE:
-                        // -> MOVING, JUMPING, FALLING, BLOCKING, ATTACK_0
-                        creature.animator.play("idle", 0.1, true);
-
-                        // move
-                        if (IsKeyDown(KEY_D))
-                            position_step.x += creature.move_speed * this->dt;
-                        if (IsKeyDown(KEY_A))
-                            position_step.x -= creature.move_speed * this->dt;
-
-                        if (!creature.is_grounded) {
-                            // -> FALLING
-                            creature.state = CreatureState::FALLING;
-                        } else if (IsKeyPressed(KEY_W)) {
-                            // -> JUMPING
-                            creature.velocity.y = -creature.jump_speed;
-                            creature.state = CreatureState::JUMPING;
-                        } else if (IsKeyPressed(KEY_SPACE)) {
-                            // -> ATTACK_0
-                            creature.state = CreatureState::ATTACK_0;
-                        } else if (IsKeyPressed(KEY_LEFT_SHIFT)) {
-                            // -> BLOCKING
-                            creature.state = CreatureState::BLOCKING;
-                        } else if (position_step.x) {
-                            // -> MOVING
-                            creature.state = CreatureState::MOVING;
-                        }
+                // immediate position_step needs to be computed by
+                // the Character update logic (will be applied later)
+                Vector2 position_step = (this->*update_behaviour)(creature);
 
-                        break;
-                    case CreatureState::MOVING:
-                        // -> JUMPING, FALLING, DASHING, ATTACK_0
-                        creature.animator.play("run", 0.1, true);
-
-                        // move
-                        if (IsKeyDown(KEY_D))
-                            position_step.x += creature.move_speed * this->dt;
-                        if (IsKeyDown(KEY_A))
-                            position_step.x -= creature.move_speed * this->dt;
-
-                        if (!creature.is_grounded) {
-                            // -> FALLING
-                            creature.state = CreatureState::FALLING;
-                        } else if (IsKeyPressed(KEY_W)) {
-                            // -> JUMPING
-                            creature.velocity.y = -creature.jump_speed;
-                            creature.state = CreatureState::JUMPING;
-                        } else if (IsKeyPressed(KEY_LEFT_CONTROL)) {
-                            // -> DASHING
-                            creature.state = CreatureState::DASHING;
-                        } else if (IsKeyPressed(KEY_LEFT_SHIFT)) {
-                            // -> BLOCKING
-                            creature.state = CreatureState::BLOCKING;
-                        } else if (IsKeyPressed(KEY_SPACE)) {
-                            // -> ATTACK_0
-                            creature.state = CreatureState::ATTACK_0;
-                        } else if (!position_step.x) {
-                            // -> IDLE
-                            creature.state = CreatureState::IDLE;
-                        }
+                // -----------------------------------------------------------
+                // reset single-frame values
+                creature.landed_at_speed = 0.0;
 
-                        break;
-                    case CreatureState::JUMPING:
-                        // -> IDLE, MOVING, FALLING
-                        creature.animator.play("jump", 0.1, false);
-
-                        // move
-                        if (IsKeyDown(KEY_D))
-                            position_step.x += creature.move_speed * this->dt;
-                        if (IsKeyDown(KEY_A))
-                            position_step.x -= creature.move_speed * this->dt;
-
-                        if (creature.velocity.y > EPSILON) {
-                            // -> FALLING
-                            creature.state = CreatureState::FALLING;
-                        } else if (position_step.x && creature.is_grounded) {
-                            // -> MOVING
-                            creature.state = CreatureState::MOVING;
-                        } else if (creature.is_grounded) {
-                            // -> IDLE
-                            creature.state = CreatureState::IDLE;
-                        }
+                this->bodies.gather(creature, idx, position_step);
+            }
+        };
 
-                        break;
-                    case CreatureState::FALLING:
-                        // -> IDLE, MOVING, DASHING, LANDING
-                        creature.animator.play("fall", 0.1, false);
-
-                        static float dash_pressed_at_y = -INFINITY;
-
-                        // move
-                        if (IsKeyDown(KEY_D))
-                            position_step.x += creature.move_speed * this->dt;
-                        if (IsKeyDown(KEY_A))
-                            position_step.x -= creature.move_speed * this->dt;
-
-                        // check if DASHING is pressed while FALLING
-                        if (IsKeyPressed(KEY_LEFT_CONTROL)
-                            && dash_pressed_at_y == -INFINITY) {
-                            dash_pressed_at_y = creature.position.y;
-                        }
+        if (is_parallel) {
+            this->jobs.parallel_for(group.size(), update_range);
+        } else {
+            update_range(0, 0, group.size());
+        }
+    }
 
-                        // continue FALLING if not landed yet
-                        if (creature.landed_at_speed == 0.0) break;
-
-                        if (creature.landed_at_speed > 0.0
-                            && creature.position.y - dash_pressed_at_y
-                                   < SAFE_DASHING_HEIGHT) {
-                            // -> DASHING
-                            creature.state = CreatureState::DASHING;
-                        } else if (creature.landed_at_speed > LANDING_MIN_SPEED) {
-                            // -> LANDING
-                            creature.health -= LANDING_DAMAGE_FACTOR
-                                               * (creature.landed_at_speed
-                                                  - LANDING_MIN_SPEED);
-                            creature.last_received_damage_time = this->time;
-                            creature.state = CreatureState::LANDING;
-                        } else if (position_step.x) {
-                            // -> MOVING
-                            creature.state = CreatureState::MOVING;
-                        } else {
-                            // -> IDLE
-                            creature.state = CreatureState::IDLE;
-                        }
+    Vector2 update_player(Creature &creature) {
+        Vector2 position_step = Vector2Zero();
 
-                        // reset dash pressing event after finishing FALLING
-                        dash_pressed_at_y = -INFINITY;
+        // -> DEATH
+        if (creature.state != CreatureState::DEATH && creature.health <= 0.0) {
+            creature.state = CreatureState::DEATH;
+        }
 
-                        break;
-                    case CreatureState::LANDING:
-                        // -> IDLE
-                        creature.animator.play("landing", 0.1, false);
+        switch (creature.state) {
+            case CreatureState::IDLE:
+                // -> MOVING, JUMPING, FALLING, BLOCKING, ATTACK_0
+                creature.animator.play("idle", 0.1, true);
 
-                        // -> IDLE
-                        if (creature.animator.is_finished()) {
-                            creature.state = CreatureState::IDLE;
-                        }
+                // move
+                if (this->tick_input.is_down(InputKey::MOVE_RIGHT))
+                    position_step.x += creature.move_speed * this->dt;
+                if (this->tick_input.is_down(InputKey::MOVE_LEFT))
+                    position_step.x -= creature.move_speed * this->dt;
 
-                        break;
-                    case CreatureState::DASHING:
-                        // -> IDLE, FALLING, ATTACK_0
-                        creature.animator.play("roll", 0.1, false);
+                if (!creature.is_grounded) {
+                    // -> FALLING
+                    creature.state = CreatureState::FALLING;
+                } else if (this->tick_input.is_pressed(InputKey::JUMP)) {
+                    // -> JUMPING
+                    creature.velocity.y = -creature.jump_speed;
+                    creature.state = CreatureState::JUMPING;
+                } else if (this->tick_input.is_pressed(InputKey::ATTACK)) {
+                    // -> ATTACK_0
+                    creature.state = CreatureState::ATTACK_0;
+                } else if (this->tick_input.is_pressed(InputKey::BLOCK)) {
+                    // -> BLOCKING
+                    creature.state = CreatureState::BLOCKING;
+                } else if (position_step.x) {
+                    // -> MOVING
+                    creature.state = CreatureState::MOVING;
+                }
 
-                        static float attack_0_pressed_at_progress = -INFINITY;
+                break;
+            case CreatureState::MOVING:
+                // -> JUMPING, FALLING, DASHING, ATTACK_0
+                creature.animator.play("run", 0.1, true);
+
+                // move
+                if (this->tick_input.is_down(InputKey::MOVE_RIGHT))
+                    position_step.x += creature.move_speed * this->dt;
+                if (this->tick_input.is_down(InputKey::MOVE_LEFT))
+                    position_step.x -= creature.move_speed * this->dt;
+
+                if (!creature.is_grounded) {
+                    // -> FALLING
+                    creature.state = CreatureState::FALLING;
+                } else if (this->tick_input.is_pressed(InputKey::JUMP)) {
+                    // -> JUMPING
+                    creature.velocity.y = -creature.jump_speed;
+                    creature.state = CreatureState::JUMPING;
+                } else if (this->tick_input.is_pressed(InputKey::DASH)) {
+                    // -> DASHING
+                    creature.state = CreatureState::DASHING;
+                } else if (this->tick_input.is_pressed(InputKey::BLOCK)) {
+                    // -> BLOCKING
+                    creature.state = CreatureState::BLOCKING;
+                } else if (this->tick_input.is_pressed(InputKey::ATTACK)) {
+                    // -> ATTACK_0
+                    creature.state = CreatureState::ATTACK_0;
+                } else if (!position_step.x) {
+                    // -> IDLE
+                    creature.state = CreatureState::IDLE;
+                }
 
-                        // check if ATTACK_0 is pressed while DASHING
-                        if (IsKeyPressed(KEY_SPACE)
-                            && attack_0_pressed_at_progress == -INFINITY) {
-                            attack_0_pressed_at_progress = creature.animator.progress;
-                        }
+                break;
+            case CreatureState::JUMPING:
+                // -> IDLE, MOVING, FALLING
+                creature.animator.play("jump", 0.1, false);
+
+                // move
+                if (this->tick_input.is_down(InputKey::MOVE_RIGHT))
+                    position_step.x += creature.move_speed * this->dt;
+                if (this->tick_input.is_down(InputKey::MOVE_LEFT))
+                    position_step.x -= creature.move_speed * this->dt;
+
+                if (creature.velocity.y > EPSILON) {
+                    // -> FALLING
+                    creature.state = CreatureState::FALLING;
+                } else if (position_step.x && creature.is_grounded) {
+                    // -> MOVING
+                    creature.state = CreatureState::MOVING;
+                } else if (creature.is_grounded) {
+                    // -> IDLE
+                    creature.state = CreatureState::IDLE;
+                }
 
-                        if (!creature.animator.is_finished()) {
-                            position_step.x += creature.get_view_dir()
-                                               * creature.move_speed * this->dt;
+                break;
+            case CreatureState::FALLING:
+                // -> IDLE, MOVING, DASHING, LANDING
+                creature.animator.play("fall", 0.1, false);
+
+                static float dash_pressed_at_y = -INFINITY;
+
+                // move
+                if (this->tick_input.is_down(InputKey::MOVE_RIGHT))
+                    position_step.x += creature.move_speed * this->dt;
+                if (this->tick_input.is_down(InputKey::MOVE_LEFT))
+                    position_step.x -= creature.move_speed * this->dt;
+
+                // check if DASHING is pressed while FALLING
+                if (this->tick_input.is_pressed(InputKey::DASH)
+                    && dash_pressed_at_y == -INFINITY) {
+                    dash_pressed_at_y = creature.position.y;
+                }
 
-                            // continue DASHING if the animation is not finished yet
-                            break;
-                        }
+                // continue FALLING if not landed yet
+                if (creature.landed_at_speed == 0.0) break;
+
+                if (creature.landed_at_speed > 0.0
+                    && creature.position.y - dash_pressed_at_y < SAFE_DASHING_HEIGHT) {
+                    // -> DASHING
+                    creature.state = CreatureState::DASHING;
+                } else if (creature.landed_at_speed > LANDING_MIN_SPEED) {
+                    // -> LANDING
+                    creature.health -= LANDING_DAMAGE_FACTOR
+                                       * (creature.landed_at_speed - LANDING_MIN_SPEED);
+                    creature.last_received_damage_time = this->time;
+                    creature.state = CreatureState::LANDING;
+                } else if (position_step.x) {
+                    // -> MOVING
+                    creature.state = CreatureState::MOVING;
+                } else {
+                    // -> IDLE
+                    creature.state = CreatureState::IDLE;
+                }
 
-                        if (!creature.is_grounded) {
-                            // -> FALLING
-                            creature.state = CreatureState::FALLING;
-                        } else if (attack_0_pressed_at_progress >= ATTACK_0_AFTER_DASH_MIN_PROGRESS) {
-                            // -> ATTACK_0
-                            creature.state = CreatureState::ATTACK_0;
-                        } else {
-                            // -> IDLE
-                            creature.state = CreatureState::IDLE;
-                        }
+                // reset dash pressing event after finishing FALLING
+                dash_pressed_at_y = -INFINITY;
 
-                        // reset attack_0 pressing event after finishing DASHING
-                        attack_0_pressed_at_progress = -INFINITY;
+                break;
+            case CreatureState::LANDING:
+                // -> IDLE
+                creature.animator.play("landing", 0.1, false);
 
-                        break;
-                    case CreatureState::BLOCKING:
-                        // -> IDLE
-                        creature.animator.play("block", 0.05, false);
+                // -> IDLE
+                if (creature.animator.is_finished()) {
+                    creature.state = CreatureState::IDLE;
+                }
 
-                        if (creature.animator.is_finished()) {
-                            // -> IDLE
-                            creature.state = CreatureState::IDLE;
-                        }
+                break;
+            case CreatureState::DASHING:
+                // -> IDLE, FALLING, ATTACK_0
+                creature.animator.play("roll", 0.1, false);
 
-                        break;
-                    case CreatureState::ATTACK_0:
-                        // -> IDLE, FALLING, ATTACK_1
-                        creature.animator.play(
-                            "attack_0", ATTACK_0_FRAME_DURATION, false
-                        );
-
-                        static float attack_1_pressed_at_progress = -INFINITY;
-
-                        // check if ATTACK_1 is pressed while ATTACK_0
-                        if (IsKeyPressed(KEY_SPACE)
-                            && attack_1_pressed_at_progress == -INFINITY) {
-                            attack_1_pressed_at_progress = creature.animator.progress;
-                        }
+                static float attack_0_pressed_at_progress = -INFINITY;
 
-                        // continue ATTACK_0 if the animation is not finished yet
-                        if (!creature.animator.is_finished()) break;
+                // check if ATTACK_0 is pressed while DASHING
+                if (this->tick_input.is_pressed(InputKey::ATTACK)
+                    && attack_0_pressed_at_progress == -INFINITY) {
+                    attack_0_pressed_at_progress = creature.animator.progress;
+                }
 
-                        if (attack_1_pressed_at_progress
-                            >= ATTACK_1_AFTER_ATTACK_0_MIN_PROGRESS) {
-                            // -> ATTACK_1
-                            creature.state = CreatureState::ATTACK_1;
-                        } else if (!creature.is_grounded) {
-                            // -> FALLING
-                            creature.state = CreatureState::FALLING;
-                        } else {
-                            // -> IDLE
-                            creature.state = CreatureState::IDLE;
-                        }
+                if (!creature.animator.is_finished()) {
+                    position_step.x += creature.get_view_dir()
+                                       * creature.move_speed * this->dt;
 
-                        // reset attack_1 pressing event after finishing ATTACK_0
-                        attack_1_pressed_at_progress = -INFINITY;
+                    // continue DASHING if the animation is not finished yet
+                    break;
+                }
 
-                        break;
-                    case CreatureState::ATTACK_1:
-                        // -> IDLE, FALLING, ATTACK_2
-                        creature.animator.play(
-                            "attack_1", ATTACK_1_FRAME_DURATION, false
-                        );
-
-                        static float attack_2_pressed_at_progress = -INFINITY;
-
-                        // check if ATTACK_2 is pressed while ATTACK_1
-                        if (IsKeyPressed(KEY_SPACE)
-                            && attack_2_pressed_at_progress == -INFINITY) {
-                            attack_2_pressed_at_progress = creature.animator.progress;
-                        }
+                if (!creature.is_grounded) {
+                    // -> FALLING
+                    creature.state = CreatureState::FALLING;
+                } else if (attack_0_pressed_at_progress >= ATTACK_0_AFTER_DASH_MIN_PROGRESS) {
+                    // -> ATTACK_0
+                    creature.state = CreatureState::ATTACK_0;
+                } else {
+                    // -> IDLE
+                    creature.state = CreatureState::IDLE;
+                }
 
-                        // continue ATTACK_1 if the animation is not finished yet
-                        if (!creature.animator.is_finished()) break;
+                // reset attack_0 pressing event after finishing DASHING
+                attack_0_pressed_at_progress = -INFINITY;
 
-                        if (attack_2_pressed_at_progress
-                            >= ATTACK_2_AFTER_ATTACK_1_MIN_PROGRESS) {
-                            // -> ATTACK_2
-                            creature.state = CreatureState::ATTACK_2;
-                        } else if (!creature.is_grounded) {
-                            // -> FALLING
-                            creature.state = CreatureState::FALLING;
-                        } else {
-                            // -> IDLE
-                            creature.state = CreatureState::IDLE;
-                        }
+                break;
+            case CreatureState::BLOCKING:
+                // -> IDLE
+                creature.animator.play("block", 0.05, false);
 
-                        // reset attack_2 pressing event after finishing ATTACK_1
-                        attack_2_pressed_at_progress = -INFINITY;
+                if (creature.animator.is_finished()) {
+                    // -> IDLE
+                    creature.state = CreatureState::IDLE;
+                }
 
-                        break;
-                    case CreatureState::ATTACK_2:
-                        // -> IDLE, FALLING
-                        creature.animator.play(
-                            "attack_2", ATTACK_2_FRAME_DURATION, false
-                        );
-
-                        // continue ATTACK_2 if the animation is not finished yet
-                        if (!creature.animator.is_finished()) break;
-
-                        if (!creature.is_grounded) {
-                            // -> FALLING
-                            creature.state = CreatureState::FALLING;
-                        } else {
-                            // -> IDLE
-                            creature.state = CreatureState::IDLE;
-                        }
+                break;
+            case CreatureState::ATTACK_0:
+                // -> IDLE, FALLING, ATTACK_1
+                creature.animator.play("attack_0", ATTACK_0_FRAME_DURATION, false);
 
-                        break;
-                    case CreatureState::DEATH:
-                        creature.animator.play("death", 0.1, false);
+                static float attack_1_pressed_at_progress = -INFINITY;
 
-                        break;
-                    default: break;
+                // check if ATTACK_1 is pressed while ATTACK_0
+                if (this->tick_input.is_pressed(InputKey::ATTACK)
+                    && attack_1_pressed_at_progress == -INFINITY) {
+                    attack_1_pressed_at_progress = creature.animator.progress;
                 }
-            } else if (creature.type == CreatureType::BAT) {
-                creature.is_flying = creature.health > EPSILON
-                                     && fabs(creature.velocity.x) < EPSILON;
 
-                // -> FALLING (if not dead, always falls if gravity should be applied)
-                if (creature.state != CreatureState::DEATH && !creature.is_flying) {
+                // continue ATTACK_0 if the animation is not finished yet
+                if (!creature.animator.is_finished()) break;
+
+                if (attack_1_pressed_at_progress
+                    >= ATTACK_1_AFTER_ATTACK_0_MIN_PROGRESS) {
+                    // -> ATTACK_1
+                    creature.state = CreatureState::ATTACK_1;
+                } else if (!creature.is_grounded) {
+                    // -> FALLING
                     creature.state = CreatureState::FALLING;
+                } else {
+                    // -> IDLE
+                    creature.state = CreatureState::IDLE;
                 }
 
-                switch (creature.state) {
-                    case CreatureState::IDLE:
-                        // -> MOVING, ATTACK_0
-                        creature.animator.play("flight", 0.04, true);
-
-                        if (creature.can_attack_player) {
-                            // -> ATTACK_0
-                            creature.state = CreatureState::ATTACK_0;
-                        } else if (creature.can_see_player) {
-                            // -> MOVING
-                            creature.state = CreatureState::MOVING;
-                        }
+                // reset attack_1 pressing event after finishing ATTACK_0
+                attack_1_pressed_at_progress = -INFINITY;
 
-                        break;
-                    case CreatureState::MOVING:
-                        // -> IDLE, ATTACK_0
-                        creature.animator.play("flight", 0.04, true);
-
-                        if (creature.can_attack_player) {
-                            // -> ATTACK_0
-                            creature.state = CreatureState::ATTACK_0;
-                        } else if (creature.can_see_player) {
-                            position_step = this->get_step_towards_player(creature);
-                        } else {
-                            creature.state = CreatureState::IDLE;
-                        };
+                break;
+            case CreatureState::ATTACK_1:
+                // -> IDLE, FALLING, ATTACK_2
+                creature.animator.play("attack_1", ATTACK_1_FRAME_DURATION, false);
 
-                        break;
-                    case CreatureState::ATTACK_0:
-                        // -> IDLE, MOVING
-                        creature.animator.play("attack", 0.1, true);
-
-                        if (!creature.can_see_player) {
-                            // -> IDLE
-                            creature.state = CreatureState::IDLE;
-                        } else if (!creature.can_attack_player && creature.animator.progress < 0.3) {
-                            // -> MOVING
-                            creature.state = CreatureState::MOVING;
-                        }
+                static float attack_2_pressed_at_progress = -INFINITY;
 
-                        break;
-                    case CreatureState::FALLING:
-                        // -> IDLE, DEATH
-                        creature.animator.play("fall", 0.1, false);
-
-                        if (creature.health <= 0.0 && creature.animator.is_finished()
-                            && creature.is_grounded) {
-                            creature.state = CreatureState::DEATH;
-                        } else if (creature.is_flying) {
-                            creature.state = CreatureState::IDLE;
-                        }
+                // check if ATTACK_2 is pressed while ATTACK_1
+                if (this->tick_input.is_pressed(InputKey::ATTACK)
+                    && attack_2_pressed_at_progress == -INFINITY) {
+                    attack_2_pressed_at_progress = creature.animator.progress;
+                }
 
-                        break;
-                    case CreatureState::DEATH:
-                        creature.animator.play("death", 0.1, false);
+                // continue ATTACK_1 if the animation is not finished yet
+                if (!creature.animator.is_finished()) break;
 
-                        break;
-                    default: break;
-                }
-            } else if (creature.type == CreatureType::WOLF) {
-                // -> DEATH
-                if (creature.state != CreatureState::DEATH && creature.health <= 0.0) {
-                    creature.state = CreatureState::DEATH;
+                if (attack_2_pressed_at_progress
+                    >= ATTACK_2_AFTER_ATTACK_1_MIN_PROGRESS) {
+                    // -> ATTACK_2
+                    creature.state = CreatureState::ATTACK_2;
+                } else if (!creature.is_grounded) {
+                    // -> FALLING
+                    creature.state = CreatureState::FALLING;
+                } else {
+                    // -> IDLE
+                    creature.state = CreatureState::IDLE;
                 }
 
-                switch (creature.state) {
-                    case CreatureState::IDLE:
-                        // -> MOVING, ATTACK_0
-                        creature.animator.play("idle", 0.1, true);
-
-                        if (creature.can_attack_player) {
-                            // -> ATTACK_0
-                            creature.state = CreatureState::ATTACK_0;
-                        } else if (creature.can_see_player) {
-                            // -> MOVING
-                            creature.state = CreatureState::MOVING;
-                        }
-
-                        break;
-                    case CreatureState::MOVING:
-                        // -> IDLE, ATTACK_0
-                        creature.animator.play("run", 0.1, true);
-
-                        if (creature.can_attack_player) {
-                            // -> ATTACK_0
-                            creature.state = CreatureState::ATTACK_0;
-                        } else if (creature.can_see_player) {
-                            position_step = this->get_step_towards_player(creature);
-                        } else {
-                            creature.state = CreatureState::IDLE;
-                        };
+                // reset attack_2 pressing event after finishing ATTACK_1
+                attack_2_pressed_at_progress = -INFINITY;
 
-                        break;
-                    case CreatureState::ATTACK_0:
-                        // -> IDLE, MOVING
-                        creature.animator.play("attack", 0.1, true);
-
-                        if (!creature.can_see_player) {
-                            // -> IDLE
-                            creature.state = CreatureState::IDLE;
-                        } else if (!creature.can_attack_player && creature.animator.progress < 0.3) {
-                            // -> MOVING
-                            creature.state = CreatureState::MOVING;
-                        }
+                break;
+            case CreatureState::ATTACK_2:
+                // -> IDLE, FALLING
+                creature.animator.play("attack_2", ATTACK_2_FRAME_DURATION, false);
 
-                        break;
-                    case CreatureState::DEATH:
-                        creature.animator.play("death", 0.1, false);
+                // continue ATTACK_2 if the animation is not finished yet
+                if (!creature.animator.is_finished()) break;
 
-                        break;
-                    default: break;
-                }
-            } else if (creature.type == CreatureType::GOLEM) {
-                // -> DEATH
-                if (creature.state != CreatureState::DEATH && creature.health <= 0.0) {
-                    creature.state = CreatureState::DEATH;
+                if (!creature.is_grounded) {
+                    // -> FALLING
+                    creature.state = CreatureState::FALLING;
+                } else {
+                    // -> IDLE
+                    creature.state = CreatureState::IDLE;
                 }
 
-                switch (creature.state) {
-                    case CreatureState::IDLE:
-                        // -> MOVING, ATTACK_0
-                        creature.animator.play("idle", 0.1, true);
-
-                        if (creature.can_attack_player) {
-                            // -> ATTACK_0
-                            creature.state = CreatureState::ATTACK_0;
-                        } else if (creature.can_see_player) {
-                            // -> MOVING
-                            creature.state = CreatureState::MOVING;
-                        }
+                break;
+            case CreatureState::DEATH:
+                creature.animator.play("death", 0.1, false);
 
-                        break;
-                    case CreatureState::MOVING:
-                        // -> IDLE, ATTACK_0
-                        creature.animator.play("run", 0.1, true);
-
-                        if (creature.can_attack_player) {
-                            // -> ATTACK_0
-                            creature.state = CreatureState::ATTACK_0;
-                        } else if (creature.can_see_player) {
-                            position_step = this->get_step_towards_player(creature);
-                        } else {
-                            creature.state = CreatureState::IDLE;
-                        };
+                break;
+            default: break;
+        }
 
-                        break;
-                    case CreatureState::ATTACK_0:
-                        // -> IDLE, MOVING
-                        creature.animator.play("attack", 0.1, true);
-
-                        if (!creature.can_see_player) {
-                            // -> IDLE
-                            creature.state = CreatureState::IDLE;
-                        } else if (!creature.can_attack_player && creature.animator.progress < 0.3) {
-                            // -> MOVING
-                            creature.state = CreatureState::MOVING;
-                        }
+        return position_step;
+    }
 
-                        break;
-                    case CreatureState::DEATH:
-                        creature.animator.play("death", 0.1, false);
+    Vector2 update_bat(Creature &creature) {
+        Vector2 position_step = Vector2Zero();
 
-                        break;
-                    default: break;
-                }
-            } else if (creature.type == CreatureType::SPRITE) {
-                if (creature.animator.is_finished()) {
-                    creature.state = CreatureState::DELETE;
-                }
-            } else if (creature.type == CreatureType::PLATFORM) {
-                // don't care in which state the PLATFORM is, always the same logic
-                creature.animator.play("idle", 0.1, true);
+        creature.is_flying = creature.health > EPSILON
+                             && fabs(creature.velocity.x) < EPSILON;
 
-                // move the platform
-                float speed = creature.platform_speed;
-                Vector2 target = speed > 0.0 ? creature.platform_end
-                                             : creature.platform_start;
-                float dist = Vector2Distance(target, creature.position);
-                Vector2 dir = Vector2Normalize(Vector2Subtract(target, creature.position)
-                );
-                Vector2 step = Vector2Scale(dir, fabs(speed) * this->dt);
-                if (Vector2Length(step) >= dist) {
-                    step = Vector2Scale(dir, dist);
-                    creature.platform_speed *= -1;
-                }
-                creature.position = Vector2Add(creature.position, step);
+        // -> FALLING (if not dead, always falls if gravity should be applied)
+        if (creature.state != CreatureState::DEATH && !creature.is_flying) {
+            creature.state = CreatureState::FALLING;
+        }
 
-                // move creatures on the platform
-                for (Creature *other : creature.creatures_on_platform) {
-                    other->position = Vector2Add(other->position, step);
+        switch (creature.state) {
+            case CreatureState::IDLE:
+                // -> MOVING, ATTACK_0
+                creature.animator.play("flight", 0.04, true);
+
+                if (creature.can_attack_player) {
+                    // -> ATTACK_0
+                    creature.state = CreatureState::ATTACK_0;
+                } else if (creature.can_see_player) {
+                    // -> MOVING
+                    creature.state = CreatureState::MOVING;
                 }
-            }
 
-            // -----------------------------------------------------------
-            // reset single-frame values
-            creature.landed_at_speed = 0.0;
+                break;
+            case CreatureState::MOVING:
+                // -> IDLE, ATTACK_0
+                creature.animator.play("flight", 0.04, true);
+
+                if (creature.can_attack_player) {
+                    // -> ATTACK_0
+                    creature.state = CreatureState::ATTACK_0;
+                } else if (creature.can_see_player) {
+                    position_step = this->get_step_towards_player(creature);
+                } else {
+                    creature.state = CreatureState::IDLE;
+                };
 
-            // -----------------------------------------------------------
-            // apply gravity and x friction
-            creature.velocity.y += this->dt * GRAVITY;
-            if (creature.is_flying) {
-                creature.velocity = Vector2Zero();
-            } else if (fabs(creature.velocity.x) < this->dt * X_FRICTION) {
-                creature.velocity.x = 0.0;
-            } else if (creature.velocity.x > 0.0) {
-                creature.velocity.x -= this->dt * X_FRICTION;
-            } else {
-                creature.velocity.x += this->dt * X_FRICTION;
-            }
+                break;
+            case CreatureState::ATTACK_0:
+                // -> IDLE, MOVING
+                creature.animator.play("attack", 0.1, true);
+
+                if (!creature.can_see_player) {
+                    // -> IDLE
+                    creature.state = CreatureState::IDLE;
+                } else if (!creature.can_attack_player && creature.animator.progress < 0.3) {
+                    // -> MOVING
+                    creature.state = CreatureState::MOVING;
+                }
 
-            // don't apply immediate position step if creature is under
-            // some velocity effect
-            if (fabs(creature.velocity.y) > EPSILON) {
-                position_step.y = 0.0;
-            }
-            if (fabs(creature.velocity.x) > EPSILON) {
-                position_step.x = 0.0;
-            }
+                break;
+            case CreatureState::FALLING:
+                // -> IDLE, DEATH
+                creature.animator.play("fall", 0.1, false);
 
-            // flip creature only if position_step.x != 0
-            if (fabs(position_step.x) > EPSILON) {
-                creature.is_hflip = position_step.x < 0.0;
-            }
+                if (creature.health <= 0.0 && creature.animator.is_finished()
+                    && creature.is_grounded) {
+                    creature.state = CreatureState::DEATH;
+                } else if (creature.is_flying) {
+                    creature.state = CreatureState::IDLE;
+                }
 
-            position_step = Vector2Add(
-                position_step, Vector2Scale(creature.velocity, this->dt)
-            );
-            creature.position = Vector2Add(creature.position, position_step);
-        }
+                break;
+            case CreatureState::DEATH:
+                creature.animator.play("death", 0.1, false);
 
-        // -----------------------------------------------------------
-        // resolve colliders
-        for (Creature &rigid_creature : this->creatures) {
-            Collider rigid_collider = rigid_creature.get_rigid_collider();
-            if (!rigid_collider.id) continue;
+                break;
+            default: break;
+        }
 
-            // compute mtv
-            float mtv_neg_x = 0.0;
-            float mtv_pos_x = 0.0;
-            float mtv_neg_y = 0.0;
-            float mtv_pos_y = 0.0;
-            for (Creature &collider_creature : this->creatures) {
-                if (&rigid_creature == &collider_creature) continue;
+        return position_step;
+    }
 
-                Rectangle rect = collider_creature.get_rigid_rect();
-                if (rect.width <= 0.0) continue;
+    Vector2 update_wolf(Creature &creature) {
+        Vector2 position_step = Vector2Zero();
 
-                Vector2 collider_mtv = get_aabb_mtv(rigid_collider.mask, rect);
+        // -> DEATH
+        if (creature.state != CreatureState::DEATH && creature.health <= 0.0) {
+            creature.state = CreatureState::DEATH;
+        }
 
-                mtv_neg_x = std::min(mtv_neg_x, collider_mtv.x);
-                mtv_pos_x = std::max(mtv_pos_x, collider_mtv.x);
-                mtv_neg_y = std::min(mtv_neg_y, collider_mtv.y);
-                mtv_pos_y = std::max(mtv_pos_y, collider_mtv.y);
+        switch (creature.state) {
+            case CreatureState::IDLE:
+                // -> MOVING, ATTACK_0
+                creature.animator.play("idle", 0.1, true);
 
-                if (collider_creature.type == CreatureType::PLATFORM) {
-                    if (collider_mtv.y < 0.0) {
-                        // put creature on the platform
-                        collider_creature.creatures_on_platform.insert(&rigid_creature);
-                    } else {
-                        // remove creature from the platform
-                        collider_creature.creatures_on_platform.erase(&rigid_creature);
-                    }
+                if (creature.can_attack_player) {
+                    // -> ATTACK_0
+                    creature.state = CreatureState::ATTACK_0;
+                } else if (creature.can_see_player) {
+                    // -> MOVING
+                    creature.state = CreatureState::MOVING;
                 }
-            }
 
-            // resolve mtv
-            Vector2 mtv = {mtv_neg_x, mtv_neg_y};
-            if (fabs(mtv_pos_x) > fabs(mtv_neg_x)) mtv.x = mtv_pos_x;
-            if (fabs(mtv_pos_y) > fabs(mtv_neg_y)) mtv.y = mtv_pos_y;
+                break;
+            case CreatureState::MOVING:
+                // -> IDLE, ATTACK_0
+                creature.animator.play("run", 0.1, true);
+
+                if (creature.can_attack_player) {
+                    // -> ATTACK_0
+                    creature.state = CreatureState::ATTACK_0;
+                } else if (creature.can_see_player) {
+                    position_step = this->get_step_towards_player(creature);
+                } else {
+                    creature.state = CreatureState::IDLE;
+                };
 
-            // vertical smash
-            if (fabs(mtv_pos_y) > EPSILON && fabs(mtv_neg_y) > EPSILON) {
-                // when smashed vertically, set mtv.y to the negative one,
-                // e.g resolve only floor collision
-                mtv.y = mtv_neg_y;
-                this->receive_damage(rigid_creature, rigid_creature.health);
-            }
-            // horizontal smash
-            if (fabs(mtv_pos_x) > EPSILON && fabs(mtv_neg_x) > EPSILON) {
-                mtv.x = 0.0;
-                this->receive_damage(rigid_creature, rigid_creature.health);
-            }
+                break;
+            case CreatureState::ATTACK_0:
+                // -> IDLE, MOVING
+                creature.animator.play("attack", 0.1, true);
+
+                if (!creature.can_see_player) {
+                    // -> IDLE
+                    creature.state = CreatureState::IDLE;
+                } else if (!creature.can_attack_player && creature.animator.progress < 0.3) {
+                    // -> MOVING
+                    creature.state = CreatureState::MOVING;
+                }
 
-            rigid_creature.position = Vector2Add(rigid_creature.position, mtv);
+                break;
+            case CreatureState::DEATH:
+                creature.animator.play("death", 0.1, false);
 
-            if (mtv.y < -EPSILON && rigid_creature.velocity.y > EPSILON) {
-                // hit the ground
-                rigid_creature.landed_at_speed = rigid_creature.velocity.y;
-                rigid_creature.velocity = Vector2Zero();
-                rigid_creature.is_grounded = true;
-            } else if (mtv.y > EPSILON && rigid_creature.velocity.y < -EPSILON) {
-                // hit the ceil
-                rigid_creature.velocity.y = 0.0;
-            } else {
-                rigid_creature.is_grounded = false;
-            }
+                break;
+            default: break;
+        }
 
-            // resolve attack colliders
-            for (Creature &attacker_creature : this->creatures) {
-                Collider attack_collider = attacker_creature.get_attack_collider();
-                Collider block_collider = rigid_creature.get_block_collider();
+        return position_step;
+    }
 
-                if (!attack_collider.id) continue;
+    Vector2 update_golem(Creature &creature) {
+        Vector2 position_step = Vector2Zero();
 
-                // creature can't attack itself
-                if (&attacker_creature == &rigid_creature) continue;
+        // -> DEATH
+        if (creature.state != CreatureState::DEATH && creature.health <= 0.0) {
+            creature.state = CreatureState::DEATH;
+        }
 
-                // creature is already dead
-                if (rigid_creature.health <= 0.0) continue;
+        switch (creature.state) {
+            case CreatureState::IDLE:
+                // -> MOVING, ATTACK_0
+                creature.animator.play("idle", 0.1, true);
 
-                // one of the creatures must be the PLAYER
-                if (rigid_creature.type != CreatureType::PLAYER
-                    && attacker_creature.type != CreatureType::PLAYER)
-                    continue;
+                if (creature.can_attack_player) {
+                    // -> ATTACK_0
+                    creature.state = CreatureState::ATTACK_0;
+                } else if (creature.can_see_player) {
+                    // -> MOVING
+                    creature.state = CreatureState::MOVING;
+                }
 
-                // ignore already received attack
-                if (rigid_creature.received_attack_ids.find(attack_collider.id)
-                    != rigid_creature.received_attack_ids.end()) {
-                    continue;
+                break;
+            case CreatureState::MOVING:
+                // -> IDLE, ATTACK_0
+                creature.animator.play("run", 0.1, true);
+
+                if (creature.can_attack_player) {
+                    // -> ATTACK_0
+                    creature.state = CreatureState::ATTACK_0;
+                } else if (creature.can_see_player) {
+                    position_step = this->get_step_towards_player(creature);
+                } else {
+                    creature.state = CreatureState::IDLE;
+                };
+
+                break;
+            case CreatureState::ATTACK_0:
+                // -> IDLE, MOVING
+                creature.animator.play("attack", 0.1, true);
+
+                if (!creature.can_see_player) {
+                    // -> IDLE
+                    creature.state = CreatureState::IDLE;
+                } else if (!creature.can_attack_player && creature.animator.progress < 0.3) {
+                    // -> MOVING
+                    creature.state = CreatureState::MOVING;
                 }
 
-                if (block_collider.id
-                    && CheckCollisionRecs(attack_collider.mask, block_collider.mask)) {
-                    // if block is successful, apply damage to the attacker
-                    std::string base_name = "block_effect_" + std::to_string(rand() % 3);
-                    Creature block = Creature::create_sprite(
-                        SpriteSheetAnimator(&this->sprite_sheets["0"], base_name),
-                        get_rect_center(block_collider.mask),
-                        rigid_creature.is_hflip,
-                        PivotType::CENTER_CENTER
-                    );
-                    block.animator.play(0.02, false);
-                    this->new_creatures.push_back(block);
+                break;
+            case CreatureState::DEATH:
+                creature.animator.play("death", 0.1, false);
+
+                break;
+            default: break;
+        }
+
+        return position_step;
+    }
 
-                    rigid_creature.received_attack_ids.insert(attack_collider.id);
-                    attacker_creature.received_attack_ids.insert(attack_collider.id);
+    Vector2 update_sprite(Creature &creature) {
+        if (creature.animator.is_finished()) {
+            creature.state = CreatureState::DELETE;
+        }
 
-                    this->receive_damage(attacker_creature, rigid_creature.damage);
-                    attacker_creature.velocity = {
-                        .x = rigid_creature.get_view_dir() * 75.0f, .y = -75.0f};
-                } else if (CheckCollisionRecs(
-                               rigid_collider.mask, attack_collider.mask
-                           )) {
-                    // else if attack is successful, apply damage to the target
-                    rigid_creature.received_attack_ids.insert(attack_collider.id);
+        return Vector2Zero();
+    }
 
-                    this->receive_damage(rigid_creature, attacker_creature.damage);
-                    rigid_creature.velocity = {
-                        .x = attacker_creature.get_view_dir() * 75.0f, .y = -75.0f};
-                }
-            }
+    Vector2 update_platform(Creature &creature) {
+        // don't care in which state the PLATFORM is, always the same logic
+        creature.animator.play("idle", 0.1, true);
+
+        // move the platform
+        float speed = creature.platform_speed;
+        Vector2 target = speed > 0.0 ? creature.platform_end : creature.platform_start;
+        float dist = Vector2Distance(target, creature.position);
+        Vector2 dir = Vector2Normalize(Vector2Subtract(target, creature.position));
+        Vector2 step = Vector2Scale(dir, fabs(speed) * this->dt);
+        if (Vector2Length(step) >= dist) {
+            step = Vector2Scale(dir, dist);
+            creature.platform_speed *= -1;
         }
+        creature.position = Vector2Add(creature.position, step);
 
-        // -----------------------------------------------------------
-        // update can_see_player, can_attack_player
-        for (Creature &creature : this->creatures) {
-            creature.can_see_player = false;
-            creature.can_attack_player = false;
-
-            // can't see and can't attack the dead player or if dead itself
-            if (this->player->health <= 0.0) continue;
-            if (creature.health <= 0.0) continue;
-
-            Vector2 view_line_start = creature.position;
-            Vector2 view_line_end = player->position;
-            float dist = Vector2Distance(view_line_start, view_line_end);
-
-            // PLAYER can't see or attack himself
-            if (creature.type == CreatureType::PLAYER) continue;
-
-            // creature can't see or attack the PLAYER if its allowed view angle
-            // is restricted (can_view_vertically = false) and the actual
-            // view angle is too large
-            if (!creature.can_view_vertically
-                && get_line_angle(view_line_start, view_line_end)
-                       > CREATURE_MAX_VIEW_ANGLE) {
-                continue;
-            }
+        // move creatures on the platform
+        for (Handle handle : creature.creatures_on_platform) {
+            this->rider_steps.push_back({handle, step});
+        }
 
-            // creature can't see the PLAYER if the PLAYER is too far away
-            if (dist > CREATURE_VIEW_DISTANCE) continue;
+        return Vector2Zero();
+    }
 
-            // creatures positions usually touches the ground, so
-            // I offset them to prevent the view ray always collid with
-            // the ground.
-            // TODO: I could compute the middle point of the colliders,
-            // but they may be not present. Or I can factor out this
-            // offset into a separate creature parameter (e.g eyes_offset).
-            view_line_start.y += VIEW_LINE_Y_OFFSET;
-            view_line_end.y += VIEW_LINE_Y_OFFSET;
+    // RIGID_COLLIDER and NONE, only the common part of the update
+    Vector2 update_inert(Creature &creature) {
+        return Vector2Zero();
+    }
 
-            // can_see_player
-            for (Creature &collider_creature : this->creatures) {
-                if (&creature == &collider_creature) continue;
+    // alpha is the fraction of the next tick which has already elapsed,
+    // creatures are drawn interpolated between the last two ticks
+    void draw(float alpha) {
+        PROFILE_SCOPE(DRAW);
+        if (IsKeyPressed(KEY_F1)) this->show_debug_info = !this->show_debug_info;
 
-                Rectangle rect = collider_creature.get_rigid_rect();
-                if (rect.width <= 0.0) continue;
+        this->camera.target = this->get_player()->get_render_position(alpha);
+        this->textures.update();
+        this->chunk_streamer.update(this->camera.target);
+        this->update_visibility(alpha);
 
-                creature.can_see_player = !check_collision_rect_line(
-                    rect, view_line_start, view_line_end
+        // ---------------------------------------------------------------
+        // sort sprite before rendering
+        // creatures, the attacked ones flash on top of the others
+        {
+            PROFILE_SCOPE(SPRITE_COLLECTION);
+            for (int i = 0; i < this->visibility.creature_ids.size(); ++i) {
+                Creature &creature = this->creatures[this->visibility.creature_ids[i]];
+                float t = creature.last_received_damage_time;
+                bool is_flash = t > 0.0 && this->time - t < 0.1;
+                SpriteLayer layer = is_flash ? SpriteLayer::FLASHES
+                                             : SpriteLayer::CREATURES;
+                this->sprite_batch.push(
+                    this->visibility.creature_sprites[i], layer, is_flash
                 );
-                if (!creature.can_see_player) break;
             }
-
-            // can_attack_player
-            if (creature.can_see_player) {
-                creature.can_attack_player = dist < creature.attack_distance;
+            for (const Sprite &sprite : this->visibility.effect_sprites) {
+                this->sprite_batch.push(sprite, SpriteLayer::EFFECTS, false);
             }
         }
+        PROFILE_COUNT(ENTITIES, this->creatures.size());
 
-        // -----------------------------------------------------------
-        // clean up DELETE creatures
-        int free_idx = -1;
-        for (int i = 0; i < this->creatures.size(); ++i) {
-            Creature &creature = this->creatures[i];
-            if (creature.state == CreatureState::DELETE && free_idx == -1) {
-                free_idx = i;
-            } else if (creature.state != CreatureState::DELETE && free_idx != -1) {
-                this->creatures[free_idx++] = creature;
+        // ---------------------------------------------------------------
+        // draw scene
+        CameraBlock camera_block = this->camera.get_block();
+        this->camera_buffer.update(&camera_block, sizeof(CameraBlock));
+
+        this->draw_shadow_atlas();
+        this->update_lights();
+
+        BeginDrawing();
+        if (this->low_res_scale > 0) {
+            BeginTextureMode(this->scene_target);
+            Texture2D texture = this->scene_target.texture;
+            rlViewport(0, 0, texture.width, texture.height);
+        } else {
+            rlViewport(0, 0, SCREEN_WIDTH, SCREEN_HEIGHT);
+        }
+        ClearBackground(BLANK);
+
+        {
+            PROFILE_GPU_SCOPE(SCENE);
+            this->draw_tiles();
+            this->draw_sprites();
+            if (this->low_res_scale > 0) {
+                EndTextureMode();
+                this->draw_scene_target();
             }
         }
-        if (free_idx != -1) {
-            this->creatures.resize(free_idx);
+
+        // healthbar
+        Creature *player = this->get_player();
+        float health_ratio = player->health / player->max_health;
+        int max_bar_width = 300;
+        int bar_width = health_ratio * max_bar_width;
+        DrawRectangle(5, 5, bar_width, 30, RED);
+
+        if (this->show_debug_info) {
+            Visibility &vis = this->visibility;
+            DrawText(
+                TextFormat(
+                    "culled: chunks %d/%d, creatures %d/%d, "
+                    "platform shadow casters %d/%d, lights %d/%d",
+                    vis.n_culled_chunks,
+                    vis.n_culled_chunks + (int)vis.chunks.size(),
+                    vis.n_culled_creatures,
+                    vis.n_culled_creatures + (int)vis.creature_ids.size(),
+                    vis.n_culled_shadow_casters,
+                    vis.n_culled_shadow_casters + (int)vis.shadow_casters.size(),
+                    vis.n_culled_lights,
+                    vis.n_culled_lights + (int)vis.lights.size()
+                ),
+                5,
+                40,
+                20,
+                WHITE
+            );
+            DrawText(
+                TextFormat(
+                    "shadows: slots %d/%d, rebuilt caches %d, triangles %d",
+                    this->n_shadow_slots,
+                    MAX_N_SHADOW_LIGHTS,
+                    this->n_rebuilt_shadow_caches,
+                    (int)this->shadow_vertices.size() / 3
+                ),
+                5,
+                65,
+                20,
+                WHITE
+            );
         }
 
-        // -----------------------------------------------------------
-        // push new creatures
-        this->creatures.insert(
-            this->creatures.end(), this->new_creatures.begin(), this->new_creatures.end()
-        );
-        this->new_creatures.clear();
+#ifdef PROFILER
+        if (IsKeyPressed(KEY_F2)) this->show_profiler = !this->show_profiler;
+        if (IsKeyPressed(KEY_F3)) profiler.dump(PROFILER_DUMP_FILE_PATH_PREFIX);
+        if (this->show_profiler) this->draw_profiler(315, 5);
+#endif
+
+        EndDrawing();
+
+        PROFILE_COUNT(ARENA_BYTES, this->frame_arena.n_bytes);
+        this->frame_arena.reset();
     }
 
-    void draw() {
-        // ---------------------------------------------------------------
-        // sort sprite before rendering
-        static std::vector<Sprite> normal_sprites;
-        static std::vector<Sprite> attacked_sprites;
-        normal_sprites.clear();
-        attacked_sprites.clear();
-
-        // tiled level
-        // TODO: could be done once, maybe factor out into tiled_level object?
-        int tile_width = this->tiled_level.meta["tilewidth"];
-        int tile_height = this->tiled_level.meta["tileheight"];
-        for (auto &layer_json : this->tiled_level.meta["layers"]) {
-            for (auto &chunk_json : layer_json["chunks"]) {
-                int chunk_width = chunk_json["width"];
-                int chunk_height = chunk_json["height"];
-                int chunk_x = chunk_json["x"];
-                int chunk_y = chunk_json["y"];
-
-                auto &tile_ids = chunk_json["data"];
-                for (int i = 0; i < tile_ids.size(); ++i) {
-                    int tile_id = tile_ids[i];
-                    if (tile_id == 0) continue;
-
-                    int i_row = i / chunk_width;
-                    int i_col = i % chunk_width;
-                    float x = tile_width * (chunk_x + i_col);
-                    float y = tile_height * (chunk_y + i_row);
-
-                    Vector2 position = {.x = x, .y = y};
-
-                    Sprite sprite = this->tiled_level.get_sprite(tile_id, position);
-                    normal_sprites.push_back(sprite);
-                }
-            }
+#ifdef PROFILER
+    // three lines of 10px text, they fit next to the health bar
+    void draw_profiler(int x, int y) {
+        ProfileFrame frame = profiler.get_average_frame(PROFILER_N_OVERLAY_FRAMES);
+
+        // fixed buffers, so the overlay doesn't show up in the heap counter
+        char lines[3][512] = {};
+        int sizes[3] = {0};
+        auto append = [&](int i, const char *text) {
+            int size = snprintf(
+                lines[i] + sizes[i], sizeof(lines[i]) - sizes[i], "%s", text
+            );
+            sizes[i] = std::min(sizes[i] + size, (int)sizeof(lines[i]) - 1);
+        };
+
+        append(0, TextFormat(
+            "frame %.2f ms, update %.2f, draw %.2f, gpu shadows %.2f, gpu scene %.2f",
+            frame.zone_times[(int)ProfileZone::FRAME],
+            frame.zone_times[(int)ProfileZone::UPDATE],
+            frame.zone_times[(int)ProfileZone::DRAW],
+            frame.gpu_times[(int)ProfileGpuZone::SHADOW_ATLAS],
+            frame.gpu_times[(int)ProfileGpuZone::SCENE]
+        ));
+        for (int i = 0; i < N_PROFILE_ZONES; ++i) {
+            if (i == (int)ProfileZone::FRAME) continue;
+            if (i == (int)ProfileZone::UPDATE || i == (int)ProfileZone::DRAW) continue;
+
+            // update phases, then draw zones
+            int line = i < (int)ProfileZone::FRAME ? 1 : 2;
+            const char *name = PROFILE_ZONE_NAMES[i];
+            append(line, TextFormat("%s %.2f  ", name, frame.zone_times[i]));
+        }
+        for (int i = 0; i < N_PROFILE_COUNTERS; ++i) {
+            const char *name = PROFILE_COUNTER_NAMES[i];
+            append(0, TextFormat("  %s %d", name, frame.counters[i]));
         }
 
-        // creatures
-        for (Creature &creature : this->creatures) {
-            Sprite sprite = creature.get_sprite();
-            float t = creature.last_received_damage_time;
-            if (t > 0.0 && this->time - t < 0.1) {
-                attacked_sprites.push_back(sprite);
-            } else {
-                normal_sprites.push_back(sprite);
-            }
+        for (int i = 0; i < 3; ++i) {
+            DrawText(lines[i], x, y + 10 * i, 10, WHITE);
         }
+    }
+#endif
 
-        // ---------------------------------------------------------------
-        // draw scene
-        this->draw_shadow_map();
-        this->update_lights();
+    void update_visibility(float alpha) {
+        PROFILE_SCOPE(VISIBILITY);
+        Visibility &vis = this->visibility;
+        vis.clear(&this->frame_arena);
+        vis.view_rect = this->camera.get_screen_rect();
 
-        BeginDrawing();
-        rlViewport(0, 0, SCREEN_WIDTH, SCREEN_HEIGHT);
-        ClearBackground(BLANK);
+        // tile chunks
+        this->chunk_streamer.get_meshes(vis.view_rect, vis.chunks);
+        vis.n_culled_chunks = this->chunk_streamer.n_meshes - vis.chunks.size();
 
-        this->draw_sprites(normal_sprites, BLANK);
-        this->draw_sprites(attacked_sprites, WHITE);
-#if 0
-        // ---------------------------------------------------------------
-        // draw masks
-        for (auto &creature : this->creatures) {
-            DrawCircle(creature.position.x, creature.position.y, 2, RED);
+        for (int i = 0; i < this->effects.n_effects; ++i) {
+            Sprite sprite = this->effects.get_sprite(i);
+            if (CheckCollisionRecs(sprite.get_dst(), vis.view_rect)) {
+                vis.effect_sprites.push_back(sprite);
+            }
         }
 
-        for (auto &creature : this->creatures) {
-            Sprite sprite = creature.get_sprite();
-            Rectangle *mask = sprite.get_mask("rigid");
-            if (mask) {
-                DrawRectangleRec(*mask, ColorAlpha(GREEN, 0.2));
+        // creatures move and animate every tick, so a plain pass over them
+        // is cheaper than keeping them in a grid
+        int n_sprites = 0;
+        int n_casters = 0;
+        int n_lights = 0;
+        for (int i = 0; i < this->creatures.size(); ++i) {
+            Creature &creature = this->creatures[i];
+            if (creature.type == CreatureType::RIGID_COLLIDER) continue;
+
+            // creature sprites
+            Sprite sprite = creature.get_render_sprite(alpha);
+            Vector2 render_offset = Vector2Subtract(
+                creature.get_render_position(alpha), creature.position
+            );
+            Rectangle dst = sprite.get_dst();
+            n_sprites += dst.width > 0.0;
+            if (dst.width > 0.0 && CheckCollisionRecs(dst, vis.view_rect)) {
+                vis.creature_sprites.push_back(sprite);
+                vis.creature_ids.push_back(i);
             }
 
-            mask = sprite.get_mask("attack");
-            if (mask) {
-                DrawRectangleRec(*mask, ColorAlpha(YELLOW, 0.2));
+            // moving shadow casters (platforms). Shadow casting lights are
+            // inside the view rect, so casters outside of it can't throw
+            // shadows into the view
+            Rectangle rect = creature.get_rigid_rect();
+            rect.x += render_offset.x;
+            rect.y += render_offset.y;
+            n_casters += rect.width > 0.0;
+            if (rect.width > 0.0 && CheckCollisionRecs(rect, vis.view_rect)) {
+                vis.shadow_casters.push_back(rect);
             }
-        }
 
-        // ---------------------------------------------------------------
-        // draw colliders
-        for (auto &collider : this->static_rigid_rects) {
-            DrawRectangleRec(collider, ColorAlpha(RED, 0.2));
+            // lights
+            if (!creature.light.is_off) {
+                n_lights += 1;
+                Light light = creature.get_light();
+                light.position = Vector2Add(light.position, render_offset);
+                float radius = light.get_radius();
+                if (CheckCollisionCircleRec(light.position, radius, vis.view_rect)) {
+                    light._dist = Vector2Distance(creature.position, this->camera.target);
+                    vis.lights.push_back(light);
+                }
+            }
         }
-#endif
 
-        // healthbar
-        float health_ratio = this->player->health / this->player->max_health;
-        int max_bar_width = 300;
-        int bar_width = health_ratio * max_bar_width;
-        DrawRectangle(5, 5, bar_width, 30, RED);
+        // keep only the closest lights
+        std::sort(
+            vis.lights.begin(),
+            vis.lights.end(),
+            [](const Light &light1, const Light &light2) {
+                return light1._dist < light2._dist;
+            }
+        );
+        if (vis.lights.size() > MAX_N_LIGHTS) vis.lights.resize(MAX_N_LIGHTS);
 
-        EndDrawing();
+        vis.n_culled_creatures = n_sprites - vis.creature_sprites.size();
+        vis.n_culled_shadow_casters = n_casters - vis.shadow_casters.size();
+        vis.n_culled_lights = n_lights - vis.lights.size();
+    }
+
+    // spawn_creatures throws if the level has no player, and the player is
+    // never removed within the level, so the handle always resolves
+    Creature *get_player() {
+        return this->creatures.get(this->player);
     }
 
     Vector2 get_step_towards_player(Creature &creature) {
-        if (&creature == this->player) return {0.0, 0.0};
+        Creature *player = this->get_player();
+        if (&creature == player) return {0.0, 0.0};
 
         Vector2 start = creature.position;
         Vector2 end = player->position;
@@ -1881,88 +6384,107 @@ class Game {
     }
 
     void update_lights() {
-        // ---------------------------------------------------------------
-        // collect lights
-        Shader sprite_shader = this->shaders["sprite"];
+        PROFILE_SCOPE(UPDATE_LIGHTS);
 
-        static std::vector<Light> lights;
-        lights.clear();
+        // lights are already collected and culled by update_visibility
+        FrameVector<Light> &lights = this->visibility.lights;
 
-        for (Creature &creature : this->creatures) {
-            if (!creature.light.is_off) {
-                Light light = creature.get_light();
-                light._dist = Vector2Distance(creature.position, this->camera.target);
-                lights.push_back(light);
-            }
+        LightsBlock &block = this->lights_block;
+        block.n_lights = lights.size();
+        PROFILE_COUNT(LIGHTS, block.n_lights);
+        for (int i = 0; i < block.n_lights; ++i) {
+            Light &light = lights[i];
+            block.lights[i] = {
+                .position = light.position,
+                .intensity = light.intensity,
+                .color = light.color,
+                .attenuation = light.attenuation,
+                .shadow_slot = light._shadow_slot};
         }
 
-        std::sort(
-            lights.begin(),
-            lights.end(),
-            [](const Light &light1, const Light &light2) {
-                return light1._dist < light2._dist;
-            }
-        );
-        if (lights.size() > MAX_N_LIGHTS) {
-            lights.resize(MAX_N_LIGHTS);
-        }
+        // upload only the used part of the lights array
+        int size = offsetof(LightsBlock, lights) + block.n_lights * sizeof(LightBlock);
+        this->lights_buffer.update(&block, size);
 
         // ---------------------------------------------------------------
-        // set shader values
-        int n_lights = lights.size();
-        SetShaderValue(
-            sprite_shader,
-            GetShaderLocation(sprite_shader, "n_lights"),
-            &n_lights,
-            SHADER_UNIFORM_INT
-        );
+        // bin lights into the view tiles
+        Rectangle view = this->visibility.view_rect;
+        float tile_width = view.width / N_LIGHT_TILES_X;
+        float tile_height = view.height / N_LIGHT_TILES_Y;
 
-        for (int i = 0; i < n_lights; ++i) {
-            Light &light = lights[i];
-            std::string light_name = "lights[" + std::to_string(i) + "]";
+        // light tile ranges of each light, e.g {x0, y0, x1, y1}
+        FrameVector<std::array<int, 4>> light_tile_ranges(&this->frame_arena);
+        light_tile_ranges.resize(lights.size());
 
-            SetShaderValue(
-                sprite_shader,
-                GetShaderLocation(sprite_shader, (light_name + ".intensity").c_str()),
-                &light.intensity,
-                SHADER_UNIFORM_FLOAT
-            );
-            SetShaderValue(
-                sprite_shader,
-                GetShaderLocation(sprite_shader, (light_name + ".position").c_str()),
-                &light.position,
-                SHADER_UNIFORM_VEC2
-            );
-            SetShaderValue(
-                sprite_shader,
-                GetShaderLocation(sprite_shader, (light_name + ".color").c_str()),
-                &light.color,
-                SHADER_UNIFORM_VEC3
-            );
-            SetShaderValue(
-                sprite_shader,
-                GetShaderLocation(sprite_shader, (light_name + ".attenuation").c_str()),
-                &light.attenuation,
-                SHADER_UNIFORM_VEC3
-            );
+        std::vector<uint32_t> &tiles = this->light_tiles_block;
+        tiles.assign(2 * N_LIGHT_TILES, 0);
+
+        // count lights per tile
+        for (int i = 0; i < lights.size(); ++i) {
+            Light &light = lights[i];
+            float radius = light.get_radius();
+            float x0 = (light.position.x - radius - view.x) / tile_width;
+            float y0 = (light.position.y - radius - view.y) / tile_height;
+            float x1 = (light.position.x + radius - view.x) / tile_width;
+            float y1 = (light.position.y + radius - view.y) / tile_height;
+
+            // clamp before the int cast, radius may be infinite. Range is empty
+            // if the light doesn't reach the view
+            x0 = std::clamp(x0, -1.0f, (float)N_LIGHT_TILES_X);
+            y0 = std::clamp(y0, -1.0f, (float)N_LIGHT_TILES_Y);
+            x1 = std::clamp(x1, -1.0f, (float)N_LIGHT_TILES_X);
+            y1 = std::clamp(y1, -1.0f, (float)N_LIGHT_TILES_Y);
+            light_tile_ranges[i] = {
+                std::max(0, (int)std::floor(x0)),
+                std::max(0, (int)std::floor(y0)),
+                std::min(N_LIGHT_TILES_X - 1, (int)std::floor(x1)),
+                std::min(N_LIGHT_TILES_Y - 1, (int)std::floor(y1))};
+
+            auto [tx0, ty0, tx1, ty1] = light_tile_ranges[i];
+            for (int ty = ty0; ty <= ty1; ++ty) {
+                for (int tx = tx0; tx <= tx1; ++tx) {
+                    tiles[2 * (ty * N_LIGHT_TILES_X + tx) + 1] += 1;
+                }
+            }
         }
-    }
 
-    void draw_shadow_map() {
-        static std::vector<Triangle> triangles;
-        triangles.clear();
+        // compute tile offsets
+        uint32_t n_ids = 0;
+        for (int i = 0; i < N_LIGHT_TILES; ++i) {
+            tiles[2 * i] = n_ids;
+            n_ids += tiles[2 * i + 1];
+            tiles[2 * i + 1] = 0;
+        }
 
-        RectDetailed screen = this->camera.get_screen_rect_detailed();
-        float diag = Vector2Distance(screen.lt, screen.rb);
+        // fill light ids, they stay sorted by the distance to the camera
+        tiles.resize(2 * N_LIGHT_TILES + n_ids);
+        for (int i = 0; i < lights.size(); ++i) {
+            auto [tx0, ty0, tx1, ty1] = light_tile_ranges[i];
+            for (int ty = ty0; ty <= ty1; ++ty) {
+                for (int tx = tx0; tx <= tx1; ++tx) {
+                    int tile = ty * N_LIGHT_TILES_X + tx;
+                    uint32_t idx = tiles[2 * tile] + tiles[2 * tile + 1]++;
+                    tiles[2 * N_LIGHT_TILES + idx] = i;
+                }
+            }
+        }
 
-        // TODO: create and use Eyes component instead of light for this
-        Light light = this->player->get_light();
+        this->light_tiles_buffer.update(tiles.data(), tiles.size() * sizeof(uint32_t));
+    }
 
-        // push shadow triangles
-        for (Creature &obstacle : this->creatures) {
-            Rectangle rect = obstacle.get_rigid_rect();
-            if (rect.width <= 0.0) continue;
+    // shadow triangles covering the screen rect, light must be inside of it
+    // triangles go either into a shadow cache or into the frame arena
+    template <typename Triangles>
+    void push_shadow_triangles(
+        Light &light,
+        Rectangle screen_rect,
+        const FrameVector<Rectangle> &casters,
+        Triangles &triangles
+    ) {
+        RectDetailed screen = get_rect_detailed(screen_rect);
+        float diag = Vector2Distance(screen.lt, screen.rb);
 
+        for (const Rectangle &rect : casters) {
             RectDetailed obst = get_rect_detailed(rect);
 
             // get shadow walls
@@ -2051,53 +6573,632 @@ class Game {
                 }
             }
         }
+    }
 
-        // draw shadow triangles into the shadow map
-        Shader shader = this->shaders["shadow"];
-        BeginShaderMode(shader);
-        BeginTextureMode(this->shadow_map);
-        rlViewport(0, 0, SHADOW_MAP_WIDTH, SHADOW_MAP_HEIGHT);
-        ClearBackground(BLANK);
+    void update_shadow_cache(ShadowCache &cache, Light &light, Rectangle shadow_rect) {
+        float shift = Vector2Distance(cache.light_position, light.position);
+        if (cache.is_valid && shift <= SHADOW_CACHE_MAX_LIGHT_SHIFT
+            && check_rects_equal(cache.shadow_rect, shadow_rect)) {
+            return;
+        }
+
+        FrameVector<Rectangle> casters(&this->frame_arena);
+        this->static_rigid_grid.query_rect(shadow_rect, this->candidates);
+        for (int i : this->candidates) {
+            Rectangle rect = this->static_rigid_rects[i];
+            if (CheckCollisionRecs(rect, shadow_rect)) casters.push_back(rect);
+        }
 
-        this->camera.set_shader_values(shader);
-        for (Triangle &triangle : triangles) {
-            DrawTriangle(triangle.a, triangle.b, triangle.c, WHITE);
+        cache.triangles.clear();
+        this->push_shadow_triangles(light, shadow_rect, casters, cache.triangles);
+        cache.light_position = light.position;
+        cache.shadow_rect = shadow_rect;
+        cache.is_valid = true;
+        this->n_rebuilt_shadow_caches += 1;
+    }
+
+    void draw_shadow_atlas() {
+        PROFILE_SCOPE(SHADOW_ATLAS);
+        PROFILE_GPU_SCOPE(SHADOW_ATLAS);
+        FrameVector<Triangle> dynamic_triangles(&this->frame_arena);
+        this->shadow_vertices.clear();
+        this->n_rebuilt_shadow_caches = 0;
+
+        // lights are sorted by the distance to the camera, so the closest
+        // lights inside the view win the slots. The slot index is stored in
+        // the vertex z, shadow.vert places the triangle into its slot
+        Rectangle view = this->visibility.view_rect;
+        Rectangle shadow_rect = snap_rect(view, SHADOW_RECT_SNAP);
+        int n_slots = 0;
+        for (Light &light : this->visibility.lights) {
+            light._shadow_slot = -1;
+            if (n_slots == MAX_N_SHADOW_LIGHTS) continue;
+            if (!CheckCollisionPointRec(light.position, view)) continue;
+
+            int slot = n_slots++;
+            light._shadow_slot = slot;
+
+            ShadowCache &cache = this->shadow_caches[slot];
+            this->update_shadow_cache(cache, light, shadow_rect);
+
+            dynamic_triangles.clear();
+            this->push_shadow_triangles(
+                light, view, this->visibility.shadow_casters, dynamic_triangles
+            );
+
+            auto push_vertices = [&](const auto &triangles) {
+                for (const Triangle &t : triangles) {
+                    this->shadow_vertices.push_back({t.a.x, t.a.y, (float)slot});
+                    this->shadow_vertices.push_back({t.b.x, t.b.y, (float)slot});
+                    this->shadow_vertices.push_back({t.c.x, t.c.y, (float)slot});
+                }
+            };
+            push_vertices(cache.triangles);
+            push_vertices(dynamic_triangles);
         }
 
+        this->n_shadow_slots = n_slots;
+        this->shadow_buffer.update(this->shadow_vertices);
+        PROFILE_COUNT(SHADOW_TRIANGLES, this->shadow_vertices.size() / 3);
+        PROFILE_COUNT(DRAW_CALLS, 1);
+
+        // the whole atlas goes out as one draw call, bypassing the rlgl batch
+        BeginTextureMode(this->shadow_atlas);
+        rlViewport(
+            0,
+            0,
+            SHADOW_ATLAS_N_COLS * SHADOW_MAP_WIDTH,
+            SHADOW_ATLAS_N_ROWS * SHADOW_MAP_HEIGHT
+        );
+        ClearBackground(BLANK);
+
+        rlEnableShader(this->shaders["shadow"].id);
+        this->shadow_buffer.draw();
+        rlDisableShader();
+
         EndTextureMode();
+    }
+
+    // tiles and sprites are drawn immediately, so the scene shader and
+    // its textures are bound directly, bypassing the rlgl batch
+    void begin_scene_shader(const char *name) {
+        Shader shader = this->scene_shaders[name][this->n_shadow_slots > 0];
+        rlDrawRenderBatchActive();
+        rlEnableShader(shader.id);
+        rlActiveTextureSlot(SCENE_SHADOW_ATLAS_SLOT);
+        rlEnableTexture(this->shadow_atlas.texture.id);
+    }
+
+    void end_scene_shader() {
+        rlActiveTextureSlot(SCENE_SHADOW_ATLAS_SLOT);
+        rlDisableTexture();
+        rlActiveTextureSlot(SCENE_TEXTURE_SLOT);
+        rlDisableTexture();
+        rlDisableShader();
+    }
+
+    void draw_scene_target() {
+        Texture2D texture = this->scene_target.texture;
+        ClearBackground(BLANK);
+
+        // render textures are stored upside down
+        Rectangle src = {0.0, 0.0, (float)texture.width, -(float)texture.height};
+        Rectangle dst = {0.0, 0.0, SCREEN_WIDTH, SCREEN_HEIGHT};
+        BeginShaderMode(this->shaders["upscale"]);
+        DrawTexturePro(texture, src, dst, Vector2Zero(), 0.0, WHITE);
         EndShaderMode();
+        PROFILE_COUNT(DRAW_CALLS, 1);
     }
 
-    void draw_sprites(std::vector<Sprite> sprites, Color plain_color) {
-        Shader shader = this->shaders["sprite"];
+    void draw_tiles() {
+        PROFILE_SCOPE(DRAW_TILES);
+        this->begin_scene_shader("sprite");
 
-        BeginShaderMode(shader);
+        for (TileChunkMesh *chunk : this->visibility.chunks) {
+            chunk->draw();
+            PROFILE_COUNT(TILES, chunk->mesh.triangleCount / 2);
+            PROFILE_COUNT(DRAW_CALLS, 1);
+        }
 
-        this->camera.set_shader_values(shader);
+        this->end_scene_shader();
+    }
 
-        Vector4 color = ColorNormalize(plain_color);
-        SetShaderValue(
-            shader, GetShaderLocation(shader, "plain_color"), &color, SHADER_UNIFORM_VEC4
-        );
-        SetShaderValueTexture(
-            shader, GetShaderLocation(shader, "shadow_map"), this->shadow_map.texture
+    void draw_sprites() {
+        PROFILE_SCOPE(DRAW_SPRITES);
+        this->begin_scene_shader("sprite_batch");
+
+        // sprites share the atlas texture, so all of them usually go out
+        // as a single instanced draw call
+        int n_draw_calls = this->sprite_batch.draw();
+        PROFILE_COUNT(DRAW_CALLS, n_draw_calls);
+
+        this->end_scene_shader();
+    }
+};
+
+// -----------------------------------------------------------------------
+// headless run
+// steps the simulation with the scripted or the replayed input as fast as
+// possible and reports the tick rate and the per-phase timings
+int run_headless(RunOptions options) {
+    Replay replay;
+    if (!options.replay_file_path.empty()) {
+        replay = Replay(options.replay_file_path);
+        options.seed = replay.seed;
+    }
+
+    int n_ticks = options.n_ticks;
+    if (n_ticks < 0) {
+        n_ticks = options.replay_file_path.empty() ? HEADLESS_DEFAULT_N_TICKS
+                                                   : replay.inputs.size();
+    }
+
+    std::unique_ptr<ReplayRecorder> recorder;
+    if (!options.record_file_path.empty()) {
+        recorder = std::make_unique<ReplayRecorder>(
+            options.record_file_path, options.seed
         );
+    }
+
+    Game game(options);
 
-        for (Sprite &sprite : sprites) {
-            sprite.draw();
+    auto start = std::chrono::steady_clock::now();
+    for (int tick = 0; tick < n_ticks; ++tick) {
+#ifdef PROFILER
+        profiler.begin_frame();
+#endif
+        if (options.replay_file_path.empty()) {
+            game.input = get_scripted_input(tick);
+        } else {
+            game.input = tick < replay.inputs.size() ? replay.inputs[tick] : Input();
         }
+        if (recorder) recorder->record(game.input);
+        game.update();
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+#ifdef PROFILER
+    profiler.dump(PROFILER_DUMP_FILE_PATH_PREFIX);
+#endif
 
-        EndShaderMode();
+    double total = elapsed.count();
+    printf(
+        "ticks: %d, elapsed: %.3f s, ticks/sec: %.1f\n", n_ticks, total, n_ticks / total
+    );
+    for (int i = 0; i < N_UPDATE_PHASES; ++i) {
+        double phase_total = game.timings.totals[i];
+        printf(
+            "%-15s %10.3f ms %10.3f us/tick %6.1f%%\n",
+            UPDATE_PHASE_NAMES[i],
+            1e3 * phase_total,
+            1e6 * phase_total / n_ticks,
+            100.0 * phase_total / total
+        );
+    }
+    printf("state hash: %016llx\n", (unsigned long long)game.get_state_hash());
+
+    return 0;
+}
+
+// -----------------------------------------------------------------------
+// benchmark
+// runs the level with the scripted input one tick per frame, headless or
+// rendered without the frame limit, and reports the per-phase percentiles
+// of the tick times. The stress levels are generated by
+// tools/generate_stress_level.py, see `make bench`
+#define BENCH_DEFAULT_N_TICKS (20 * TICK_RATE)
+#define BENCH_N_WARMUP_TICKS TICK_RATE
+
+// the update phases are followed by the whole update, draw and frame
+#define N_BENCH_PHASES (N_UPDATE_PHASES + 3)
+#define BENCH_UPDATE_PHASE N_UPDATE_PHASES
+#define BENCH_DRAW_PHASE (N_UPDATE_PHASES + 1)
+#define BENCH_FRAME_PHASE (N_UPDATE_PHASES + 2)
+
+class BenchSamples {
+  public:
+    std::vector<double> phases[N_BENCH_PHASES];  // seconds
+
+    // nearest rank percentile, p in [0, 1]
+    double get_percentile(int phase, double p) {
+        std::vector<double> &samples = this->phases[phase];
+        if (samples.empty()) return 0.0;
+
+        int idx = std::ceil(p * samples.size()) - 1;
+        idx = std::clamp(idx, 0, (int)samples.size() - 1);
+        std::nth_element(samples.begin(), samples.begin() + idx, samples.end());
+        return samples[idx];
     }
 };
 
+int run_bench(RunOptions options) {
+    int n_ticks = options.n_ticks < 0 ? BENCH_DEFAULT_N_TICKS : options.n_ticks;
+    Game game(options);
+    if (!options.is_headless) SetTargetFPS(0);
+
+    BenchSamples samples;
+    for (auto &phase : samples.phases) phase.reserve(n_ticks);
+
+    double prev_totals[N_UPDATE_PHASES] = {0.0};
+    int n_ticks_total = BENCH_N_WARMUP_TICKS + n_ticks;
+    for (int tick = 0; tick < n_ticks_total; ++tick) {
+        if (!options.is_headless && WindowShouldClose()) break;
+#ifdef PROFILER
+        profiler.begin_frame();
+#endif
+        auto frame_start = std::chrono::steady_clock::now();
+        game.input = get_scripted_input(tick);
+        game.update();
+        auto update_end = std::chrono::steady_clock::now();
+        if (!options.is_headless) game.draw(1.0);
+        auto frame_end = std::chrono::steady_clock::now();
+
+        bool is_warmup = tick < BENCH_N_WARMUP_TICKS;
+        for (int i = 0; i < N_UPDATE_PHASES; ++i) {
+            double total = game.timings.totals[i];
+            if (!is_warmup) samples.phases[i].push_back(total - prev_totals[i]);
+            prev_totals[i] = total;
+        }
+        if (is_warmup) continue;
+
+        std::chrono::duration<double> update_time = update_end - frame_start;
+        std::chrono::duration<double> draw_time = frame_end - update_end;
+        std::chrono::duration<double> frame_time = frame_end - frame_start;
+        samples.phases[BENCH_UPDATE_PHASE].push_back(update_time.count());
+        samples.phases[BENCH_DRAW_PHASE].push_back(draw_time.count());
+        samples.phases[BENCH_FRAME_PHASE].push_back(frame_time.count());
+    }
+
+    printf(
+        "level: %s, creatures: %d, ticks: %d, %s\n",
+        (fs::path(options.level_dir) / options.level_name).c_str(),
+        game.creatures.size(),
+        (int)samples.phases[BENCH_FRAME_PHASE].size(),
+        options.is_headless ? "headless" : "rendered"
+    );
+    printf("%-15s %10s %10s\n", "phase", "p50 us", "p99 us");
+    for (int i = 0; i < N_BENCH_PHASES; ++i) {
+        if (i == BENCH_DRAW_PHASE && options.is_headless) continue;
+
+        const char *name = i < N_UPDATE_PHASES ? UPDATE_PHASE_NAMES[i]
+                           : i == BENCH_UPDATE_PHASE ? "update"
+                           : i == BENCH_DRAW_PHASE   ? "draw"
+                                                     : "frame";
+        printf(
+            "%-15s %10.1f %10.1f\n",
+            name,
+            1e6 * samples.get_percentile(i, 0.5),
+            1e6 * samples.get_percentile(i, 0.99)
+        );
+    }
+
+    return 0;
+}
+
+// -----------------------------------------------------------------------
+// collision benchmark
+// times the per-pair narrowphase against the batch kernels on random rects
+// and candidate lists, and checks that both give the same results
+#define COLLISION_BENCH_N_QUERIES 4096
+#define COLLISION_BENCH_N_CANDIDATES 16
+#define COLLISION_BENCH_N_REPEATS 50
+
+// raylib border test which check_collision_rect_line replaces
+bool check_collision_rect_edges(Rectangle rect, Vector2 start, Vector2 end) {
+    Vector2 rect_tl = {rect.x, rect.y};
+    Vector2 rect_tr = {rect.x + rect.width, rect.y};
+    Vector2 rect_br = {rect.x + rect.width, rect.y + rect.height};
+    Vector2 rect_bl = {rect.x, rect.y + rect.height};
+
+    Vector2 point;
+    return CheckCollisionLines(start, end, rect_tl, rect_tr, &point)
+           || CheckCollisionLines(start, end, rect_tr, rect_br, &point)
+           || CheckCollisionLines(start, end, rect_br, rect_bl, &point)
+           || CheckCollisionLines(start, end, rect_bl, rect_tl, &point);
+}
+
+float get_random_float(float min, float max) {
+    return min + (max - min) * ((float)rand() / RAND_MAX);
+}
+
+int run_collision_bench() {
+    srand(0);
+
+    // each query gets its own candidates around it, rects are shuffled, so
+    // the candidates are scattered in memory like the grid ones
+    int n_rects = COLLISION_BENCH_N_QUERIES * COLLISION_BENCH_N_CANDIDATES;
+    std::vector<int> rect_ids(n_rects);
+    for (int i = 0; i < n_rects; ++i) rect_ids[i] = i;
+    for (int i = n_rects - 1; i > 0; --i) {
+        std::swap(rect_ids[i], rect_ids[rand() % (i + 1)]);
+    }
+
+    std::vector<Rectangle> rects(n_rects);
+    std::vector<Rectangle> query_rects;
+    std::vector<Line> query_lines;
+    std::vector<std::vector<int>> query_ids(COLLISION_BENCH_N_QUERIES);
+    for (int i = 0; i < COLLISION_BENCH_N_QUERIES; ++i) {
+        Vector2 start = {get_random_float(0.0, 512.0), get_random_float(0.0, 512.0)};
+        Vector2 end = {
+            start.x + get_random_float(-64.0, 64.0),
+            start.y + get_random_float(-64.0, 64.0)};
+        query_rects.push_back(
+            {.x = start.x, .y = start.y, .width = 16.0, .height = 32.0}
+        );
+        query_lines.push_back({.a = start, .b = end});
+
+        for (int j = 0; j < COLLISION_BENCH_N_CANDIDATES; ++j) {
+            int idx = rect_ids[i * COLLISION_BENCH_N_CANDIDATES + j];
+            rects[idx] = {
+                .x = start.x + get_random_float(-64.0, 32.0),
+                .y = start.y + get_random_float(-64.0, 32.0),
+                .width = get_random_float(8.0, 64.0),
+                .height = get_random_float(8.0, 64.0)};
+            query_ids[i].push_back(idx);
+        }
+    }
+
+    auto time = [](std::function<void()> fn) {
+        auto start = std::chrono::steady_clock::now();
+        for (int i = 0; i < COLLISION_BENCH_N_REPEATS; ++i) fn();
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now()
+                                                - start;
+        int n_tests = COLLISION_BENCH_N_REPEATS * COLLISION_BENCH_N_QUERIES
+                      * COLLISION_BENCH_N_CANDIDATES;
+        return 1e9 * elapsed.count() / n_tests;  // ns per test
+    };
+
+    std::vector<Vector2> pair_mtvs;
+    std::vector<Vector2> batch_mtvs;
+    std::vector<uint8_t> pair_hits;
+    std::vector<uint8_t> edge_hits;
+    std::vector<uint8_t> batch_hits;
+    std::vector<Vector2> mtvs;
+    std::vector<uint8_t> hits;
+    float sink = 0.0;
+
+    double pair_mtv_ns = time([&] {
+        pair_mtvs.clear();
+        for (int i = 0; i < COLLISION_BENCH_N_QUERIES; ++i) {
+            for (int j : query_ids[i]) {
+                pair_mtvs.push_back(get_aabb_mtv(query_rects[i], rects[j]));
+            }
+        }
+    });
+    double batch_mtv_ns = time([&] {
+        batch_mtvs.clear();
+        for (int i = 0; i < COLLISION_BENCH_N_QUERIES; ++i) {
+            get_aabb_mtvs(query_rects[i], rects, query_ids[i], mtvs);
+            batch_mtvs.insert(batch_mtvs.end(), mtvs.begin(), mtvs.end());
+        }
+    });
+
+    double edge_line_ns = time([&] {
+        edge_hits.clear();
+        for (int i = 0; i < COLLISION_BENCH_N_QUERIES; ++i) {
+            Line line = query_lines[i];
+            for (int j : query_ids[i]) {
+                edge_hits.push_back(check_collision_rect_edges(rects[j], line.a, line.b));
+            }
+        }
+    });
+    double pair_line_ns = time([&] {
+        pair_hits.clear();
+        for (int i = 0; i < COLLISION_BENCH_N_QUERIES; ++i) {
+            Line line = query_lines[i];
+            for (int j : query_ids[i]) {
+                pair_hits.push_back(check_collision_rect_line(rects[j], line.a, line.b));
+            }
+        }
+    });
+    double batch_line_ns = time([&] {
+        batch_hits.clear();
+        for (int i = 0; i < COLLISION_BENCH_N_QUERIES; ++i) {
+            Line line = query_lines[i];
+            sink += check_collision_rects_line(rects, query_ids[i], line.a, line.b, hits);
+            batch_hits.insert(batch_hits.end(), hits.begin(), hits.end());
+        }
+    });
+
+    int n_mtv_mismatches = 0;
+    for (int i = 0; i < pair_mtvs.size(); ++i) {
+        Vector2 a = pair_mtvs[i];
+        Vector2 b = batch_mtvs[i];
+        n_mtv_mismatches += a.x != b.x || a.y != b.y;
+    }
+    int n_line_mismatches = 0;
+    int n_edge_mismatches = 0;
+    for (int i = 0; i < pair_hits.size(); ++i) {
+        n_line_mismatches += pair_hits[i] != batch_hits[i];
+        n_edge_mismatches += pair_hits[i] != edge_hits[i];
+    }
+
+#if defined(__SSE2__)
+    printf("kernels: sse2\n");
+#else
+    printf("kernels: scalar\n");
+#endif
+    printf(
+        "aabb mtv:     pair %6.2f ns, batch %6.2f ns, x%.2f, mismatches: %d\n",
+        pair_mtv_ns,
+        batch_mtv_ns,
+        pair_mtv_ns / batch_mtv_ns,
+        n_mtv_mismatches
+    );
+    printf(
+        "rect line:    pair %6.2f ns, batch %6.2f ns, x%.2f, mismatches: %d\n",
+        pair_line_ns,
+        batch_line_ns,
+        pair_line_ns / batch_line_ns,
+        n_line_mismatches
+    );
+    printf(
+        "raylib edges: pair %6.2f ns, x%.2f of batch, mismatches: %d (%.1f%% hits)\n",
+        edge_line_ns,
+        edge_line_ns / batch_line_ns,
+        n_edge_mismatches,
+        100.0 * sink / (COLLISION_BENCH_N_REPEATS * pair_hits.size())
+    );
+
+    return 0;
+}
+
+// -----------------------------------------------------------------------
+// attack check
+// a crowd of golems attacks the idle player at once, so more attacks are
+// live than the inline received ids hold. Each attack must hit only once:
+// the hits are counted by the damage and compared with the distinct
+// attacks which have touched the player
+#define ATTACK_CHECK_N_ATTACKERS (2 * N_RECENT_ATTACK_IDS)
+#define ATTACK_CHECK_N_TICKS (10 * TICK_RATE)
+
+int run_attack_check(RunOptions options) {
+    options.is_headless = true;
+    Game game(options);
+    Vector2 position = game.get_player()->position;
+    for (int i = 0; i < ATTACK_CHECK_N_ATTACKERS; ++i) {
+        game.creatures.insert(Creature(
+            CreatureType::GOLEM,
+            CreatureState::IDLE,
+            SpriteSheetAnimator(&game.sprite_sheets["0"], "golem"),
+            Light(),
+            0.0,
+            0.0,
+            400.0,
+            50.0,
+            35.0,
+            false,
+            position
+        ));
+    }
+
+    Creature *player = game.get_player();
+    player->max_health = player->health = 1e6;
+    float damage = 50.0;
+
+    int n_hits = 0;
+    int max_n_live_ids = 0;
+    std::vector<AttackId> attack_ids;
+    for (int tick = 0; tick < ATTACK_CHECK_N_TICKS; ++tick) {
+        float health = game.get_player()->health;
+        game.input = Input();
+        game.update();
+
+        player = game.get_player();
+        n_hits += std::lround((health - player->health) / damage);
+        max_n_live_ids = std::max(max_n_live_ids, player->received_attack_ids.size());
+
+        int player_idx = game.creatures.get_dense_idx(game.player);
+        Rectangle rigid_mask = game.colliders[player_idx].rigid.mask;
+        for (int i = 0; i < game.creatures.size(); ++i) {
+            Collider attack = game.colliders[i].attack;
+            if (i == player_idx || !attack.id) continue;
+            if (!CheckCollisionRecs(attack.mask, rigid_mask)) continue;
+
+            AttackId id = {game.creatures.get_handle(i), attack.id};
+            if (std::find(attack_ids.begin(), attack_ids.end(), id) == attack_ids.end()) {
+                attack_ids.push_back(id);
+            }
+        }
+    }
+
+    bool is_ok = n_hits == attack_ids.size() && max_n_live_ids > N_RECENT_ATTACK_IDS;
+    printf(
+        "attackers: %d, attacks: %d, hits: %d, max live ids: %d, %s\n",
+        ATTACK_CHECK_N_ATTACKERS,
+        (int)attack_ids.size(),
+        n_hits,
+        max_n_live_ids,
+        is_ok ? "ok" : "FAILED"
+    );
+
+    return is_ok ? 0 : 1;
+}
+
 // -----------------------------------------------------------------------
 // main loop
-int main() {
-    Game game;
+int main(int argc, char **argv) {
+    RunOptions options;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--headless") {
+            options.is_headless = true;
+        } else if (arg == "--ticks" && i + 1 < argc) {
+            options.n_ticks = std::stoi(argv[++i]);
+        } else if (arg == "--workers" && i + 1 < argc) {
+            options.n_workers = std::stoi(argv[++i]);
+        } else if (arg == "--low-res") {
+            options.low_res_scale = DEFAULT_LOW_RES_SCALE;
+            if (i + 1 < argc && std::isdigit(argv[i + 1][0])) {
+                options.low_res_scale = std::max(std::stoi(argv[++i]), 1);
+            }
+        } else if (arg == "--level" && i + 1 < argc) {
+            // path of the level json or bin, the baked bin is loaded
+            fs::path level_file_path = argv[++i];
+            options.level_dir = level_file_path.parent_path();
+            options.level_name = level_file_path.stem();
+        } else if (arg == "--bench") {
+            options.is_bench = true;
+        } else if (arg == "--seed" && i + 1 < argc) {
+            options.seed = std::stoull(argv[++i]);
+        } else if (arg == "--record" && i + 1 < argc) {
+            options.record_file_path = argv[++i];
+        } else if (arg == "--replay" && i + 1 < argc) {
+            options.replay_file_path = argv[++i];
+        } else if (arg == "--bench-collision") {
+            return run_collision_bench();
+        } else if (arg == "--check-attacks") {
+            options.is_attack_check = true;
+        } else {
+            fprintf(
+                stderr,
+                "usage: %s [--workers N] [--low-res [SCALE]] [--headless] [--ticks N] "
+                "[--level FILE] [--seed N] [--record FILE | --replay FILE] [--bench] "
+                "[--bench-collision] [--check-attacks]\n",
+                argv[0]
+            );
+            return 1;
+        }
+    }
+
+    if (options.is_attack_check) return run_attack_check(options);
+    if (options.is_bench) return run_bench(options);
+    if (options.is_headless) return run_headless(options);
+
+    // the replayed input drives the ticks until it runs out, then the
+    // keyboard takes over
+    Replay replay;
+    if (!options.replay_file_path.empty()) {
+        replay = Replay(options.replay_file_path);
+        options.seed = replay.seed;
+    }
 
+    std::unique_ptr<ReplayRecorder> recorder;
+    if (!options.record_file_path.empty()) {
+        recorder = std::make_unique<ReplayRecorder>(
+            options.record_file_path, options.seed
+        );
+    }
+
+    Game game(options);
+
+    int tick = 0;
+    float accumulator = 0.0;
     while (!WindowShouldClose()) {
-        game.update();
-        game.draw();
+#ifdef PROFILER
+        profiler.begin_frame();
+        PROFILE_SCOPE(FRAME);
+#endif
+        if (tick >= replay.inputs.size()) game.poll_input();
+
+        accumulator += std::min(GetFrameTime(), MAX_N_TICKS_PER_FRAME * TICK_DT);
+        while (accumulator >= TICK_DT) {
+            if (tick < replay.inputs.size()) game.input = replay.inputs[tick];
+            game.update();
+            if (recorder) recorder->record(game.tick_input);
+            accumulator -= TICK_DT;
+            tick += 1;
+        }
+
+        game.draw(accumulator / TICK_DT);
     }
 }
@@ -0,0 +1,39 @@
+// uniform blocks shared by all shader stages, their std140 layouts are
+// mirrored in game.cpp (CameraBlock, LightsBlock)
+struct Light {
+    vec2 position;
+    float intensity;
+    vec3 color;
+    vec3 attenuation;
+    int shadow_slot;
+};
+
+layout(std140, binding = CAMERA_BLOCK_BINDING) uniform CameraBlock {
+    float view_width;
+    float aspect;
+    vec2 target;
+} camera;
+
+layout(std140, binding = LIGHTS_BLOCK_BINDING) uniform LightsBlock {
+    int n_lights;
+    Light lights[MAX_N_LIGHTS];
+};
+
+// world position to the normalized device coordinates of the camera view
+vec2 get_view_ndc(vec2 position) {
+    float view_height = camera.view_width / camera.aspect;
+    float x = (position.x - camera.target.x) / (0.5 * camera.view_width);
+    float y = (position.y - camera.target.y) / (-0.5 * view_height);
+    return vec2(x, y);
+}
+
+// pixel art sampling of the bilinear filtered texture: texels stay sharp
+// at any scale, only the texel seams are blended over a pixel
+vec4 texture2DAA(sampler2D tex, vec2 uv) {
+    vec2 texsize = vec2(textureSize(tex,0));
+    vec2 uv_texspace = uv*texsize;
+    vec2 seam = floor(uv_texspace+.5);
+    uv_texspace = (uv_texspace-seam)/fwidth(uv_texspace)+seam;
+    uv_texspace = clamp(uv_texspace, seam-.5, seam+.5);
+    return texture(tex, uv_texspace/texsize);
+}
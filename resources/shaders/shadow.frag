@@ -1,5 +1,13 @@
+in vec2 fragSlotPosition;
+
 out vec4 fs_color;
 
 void main() {
+    // shadow triangles are not clipped by the slot, so they are clipped here
+    if (any(lessThan(fragSlotPosition, vec2(0.0)))
+        || any(greaterThan(fragSlotPosition, vec2(1.0)))) {
+        discard;
+    }
+
     fs_color = vec4(1.0, 1.0, 1.0, 1.0);
 }
@@ -0,0 +1,16 @@
+in vec3 vertexPosition;
+
+out vec2 fragSlotPosition;
+
+void main() {
+    // shadow atlas slot index is stored in z
+    int slot = int(round(vertexPosition.z));
+    vec2 n_slots = vec2(SHADOW_ATLAS_N_COLS, SHADOW_ATLAS_N_ROWS);
+    vec2 slot_origin = vec2(slot % SHADOW_ATLAS_N_COLS, slot / SHADOW_ATLAS_N_COLS);
+
+    // each slot is a shadow mask of the whole view
+    fragSlotPosition = (get_view_ndc(vertexPosition.xy) + 1.0) / 2.0;
+    vec2 atlas_position = (slot_origin + fragSlotPosition) / n_slots;
+
+    gl_Position = vec4(atlas_position * 2.0 - 1.0, 0.0, 1.0);
+}
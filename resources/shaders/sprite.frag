@@ -1,50 +1,63 @@
 in vec2 fragTexCoord;
 in vec3 fragPosition;
 in vec2 fragScreenPosition;
+in vec4 fragPlainColor;
 
 out vec4 fs_color;
 
-struct Light {
-    float intensity;
-    vec2 position;
-    vec3 color;
-    vec3 attenuation;
+// lights which reach the view tile: (offset, count) into light_tile_ids
+layout(std430, binding = LIGHT_TILES_BLOCK_BINDING) readonly buffer LightTilesBlock {
+    uvec2 light_tile_ranges[N_LIGHT_TILES_X * N_LIGHT_TILES_Y];
+    uint light_tile_ids[];
 };
 
-uniform int n_lights;
-uniform Light lights[32];
-
 uniform sampler2D texture0;
-uniform sampler2D shadow_map;
-uniform vec4 plain_color;
-
-vec4 texture2DAA(sampler2D tex, vec2 uv) {
-    vec2 texsize = vec2(textureSize(tex,0));
-    vec2 uv_texspace = uv*texsize;
-    vec2 seam = floor(uv_texspace+.5);
-    uv_texspace = (uv_texspace-seam)/fwidth(uv_texspace)+seam;
-    uv_texspace = clamp(uv_texspace, seam-.5, seam+.5);
-    return texture(tex, uv_texspace/texsize);
+uniform sampler2D shadow_atlas;
+
+// SHADOWS is defined for the views with the shadow casting lights
+float get_shadow(Light light) {
+#ifdef SHADOWS
+    if (light.shadow_slot < 0) return 0.0;
+
+    vec2 n_slots = vec2(SHADOW_ATLAS_N_COLS, SHADOW_ATLAS_N_ROWS);
+    vec2 slot_origin = vec2(
+        light.shadow_slot % SHADOW_ATLAS_N_COLS, light.shadow_slot / SHADOW_ATLAS_N_COLS
+    );
+
+    // keep samples inside the slot, so the neighbour slots don't leak in
+    vec2 half_texel = 0.5 * n_slots / vec2(textureSize(shadow_atlas, 0));
+    vec2 uv = clamp(fragScreenPosition, half_texel, 1.0 - half_texel);
+    return texture(shadow_atlas, (slot_origin + uv) / n_slots).r;
+#else
+    return 0.0;
+#endif
 }
 
 void main() {
     vec4 texture_color = texture2DAA(texture0, fragTexCoord);
     if (texture_color.a < 0.99) discard;
 
-    float shadow = texture(shadow_map, fragScreenPosition).r;
-    float plain_color_weight = plain_color.a;
+    float plain_color_weight = fragPlainColor.a;
     float texture_color_weight = 1.0 - plain_color_weight;
 
+    // find the view tile of the fragment
+    float view_height = camera.view_width / camera.aspect;
+    vec2 view_size = vec2(camera.view_width, view_height);
+    vec2 view_pos = (fragPosition.xy - camera.target) / view_size + 0.5;
+    ivec2 tile_n = ivec2(N_LIGHT_TILES_X, N_LIGHT_TILES_Y);
+    ivec2 tile_xy = clamp(ivec2(floor(view_pos * tile_n)), ivec2(0), tile_n - 1);
+    uvec2 tile_range = light_tile_ranges[tile_xy.y * N_LIGHT_TILES_X + tile_xy.x];
+
     vec3 total_light = vec3(0.0, 0.0, 0.0);
-    for (int i = 0; i < n_lights; ++i) {
-        Light light = lights[i];
+    for (uint i = tile_range.x; i < tile_range.x + tile_range.y; ++i) {
+        Light light = lights[light_tile_ids[i]];
         float dist = distance(light.position, fragPosition.xy);
         float attenuation = 1.0 / dot(light.attenuation, vec3(1.0, dist, dist * dist));
-        float shadow_factor = 1.0 - shadow * 0.8;
+        float shadow_factor = 1.0 - get_shadow(light) * 0.8;
         total_light += light.color * light.intensity * attenuation * shadow_factor;
     }
 
-    vec3 color = plain_color_weight * plain_color.rgb;
+    vec3 color = plain_color_weight * fragPlainColor.rgb;
     color += total_light * texture_color_weight * texture_color.rgb;
 
     fs_color = vec4(color, 1.0);
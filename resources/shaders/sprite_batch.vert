@@ -0,0 +1,29 @@
+// per instance sprite quad, see SpriteInstance in bin/game.cpp
+layout(location = 0) in vec4 instance_dst;
+layout(location = 1) in vec4 instance_uv;
+layout(location = 2) in float instance_is_flash;
+
+out vec2 fragTexCoord;
+out vec3 fragPosition;
+out vec2 fragScreenPosition;
+out vec4 fragPlainColor;
+
+// two triangles of the quad: left top, left bot, right bot, right top
+const vec2 QUAD_CORNERS[6] = vec2[](
+    vec2(0.0, 0.0), vec2(0.0, 1.0), vec2(1.0, 1.0),
+    vec2(0.0, 0.0), vec2(1.0, 1.0), vec2(1.0, 0.0)
+);
+
+void main() {
+    vec2 corner = QUAD_CORNERS[gl_VertexID];
+    vec2 world_position = instance_dst.xy + corner * instance_dst.zw;
+
+    fragTexCoord = instance_uv.xy + corner * instance_uv.zw;
+    fragPosition = vec3(world_position, 0.0);
+    fragPlainColor = instance_is_flash * vec4(1.0);
+
+    vec4 position = vec4(get_view_ndc(world_position), 0.0, 1.0);
+
+    fragScreenPosition = (position.xy + 1.0) / 2.0;
+    gl_Position = position;
+}
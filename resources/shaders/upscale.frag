@@ -0,0 +1,9 @@
+in vec2 fragTexCoord;
+
+out vec4 fs_color;
+
+uniform sampler2D texture0;
+
+void main() {
+    fs_color = texture2DAA(texture0, fragTexCoord);
+}
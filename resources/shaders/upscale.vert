@@ -0,0 +1,12 @@
+// rlgl batch vertex, the scene target is drawn with DrawTexturePro
+in vec3 vertexPosition;
+in vec2 vertexTexCoord;
+
+uniform mat4 mvp;
+
+out vec2 fragTexCoord;
+
+void main() {
+    fragTexCoord = vertexTexCoord;
+    gl_Position = mvp * vec4(vertexPosition, 1.0);
+}
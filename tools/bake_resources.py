@@ -0,0 +1,432 @@
+"""Bakes the json resources into the binary files which the game maps into
+memory and uses in place, without any parsing.
+
+Tiled maps (resources/tiled/**/*.json with "type": "map") and sprite sheet
+metas (resources/sprite_sheets/*.json) are baked into the .bin files next
+to them. The layouts must match the `baked resources` section of
+bin/game.cpp: all values are little-endian 4 byte ints and floats, every
+table is referenced by its byte offset from the file start, strings are
+offsets into the null-terminated string table.
+
+The tile sheet images referenced by the maps and the sprite sheet images
+are packed into a single texture atlas (resources/atlas.png), so the game
+draws all of them from one texture. resources/atlas.bin maps each source
+image path to its rect in the atlas.
+
+The atlas is also baked into a gpu-ready texture (resources/atlas.tex):
+premultiplied RGBA8 without mipmaps, split into bands of rows, each band
+deflated on its own. The game decodes the bands on a loader thread and
+uploads them a few per frame, the png is only a fallback.
+"""
+
+import json
+import os
+import struct
+import zlib
+from pathlib import Path
+
+_THIS_DIR = Path(__file__).parent
+_ROOT_DIR = _THIS_DIR / ".."
+_TILED_DIR = _ROOT_DIR / "resources/tiled"
+_SPRITE_SHEETS_DIR = _ROOT_DIR / "resources/sprite_sheets"
+_ATLAS_FILE_PATH = _ROOT_DIR / "resources/atlas.png"
+
+# bump together with BAKED_VERSION in bin/game.cpp
+_BAKED_VERSION = 1
+_LEVEL_MAGIC = b"NDLV"
+_SPRITE_SHEET_MAGIC = b"NDSS"
+_ATLAS_MAGIC = b"NDAT"
+_TEXTURE_MAGIC = b"NDTX"
+
+_ATLAS_WIDTH = 2048
+# images are separated by their edge pixels repeated this many times, so
+# the filtered samples at the image borders don't bleed into the neighbours
+_ATLAS_PADDING = 2
+
+# BAKED_TEXTURE_* formats in bin/game.cpp. Raw bands are uploaded straight
+# from the mapped file, deflated ones are smaller on disk but decoded first
+_TEXTURE_RAW = 0
+_TEXTURE_DEFLATE = 1
+_TEXTURE_FORMAT = _TEXTURE_DEFLATE
+_TEXTURE_BAND_HEIGHT = 64
+
+# MaskType order in bin/game.cpp
+_MASK_NAMES = ("rigid", "attack", "block")
+
+
+class _Strings:
+    def __init__(self):
+        self._data = bytearray(b"\0")
+        self._offsets = {"": 0}
+
+    def add(self, string: str) -> int:
+        if string not in self._offsets:
+            self._offsets[string] = len(self._data)
+            self._data += string.encode() + b"\0"
+        return self._offsets[string]
+
+    def pack(self) -> bytes:
+        # keep the next table aligned
+        return bytes(self._data) + b"\0" * (-len(self._data) % 4)
+
+
+def _pack_file(
+    magic: bytes, header: list, tables: list, strings: _Strings
+) -> bytes:
+    # header is: magic, version, header values, then the offset of each
+    # table, the strings offset and the strings size
+    header_size = 4 * (2 + len(header) + len(tables) + 2)
+    offsets = []
+    offset = header_size
+    for table in tables:
+        offsets.append(offset)
+        offset += len(table)
+
+    strings_data = strings.pack()
+    out = magic + struct.pack(
+        f"<{1 + len(header) + len(tables) + 2}I",
+        _BAKED_VERSION,
+        *header,
+        *offsets,
+        offset,
+        len(strings_data),
+    )
+    for table in tables:
+        out += table
+
+    return out + strings_data
+
+
+def _get_object_properties(object_: dict) -> dict:
+    return {p["name"]: p["value"] for p in object_.get("properties", [])}
+
+
+def _get_level_images(file_path: Path) -> list:
+    with open(file_path) as f:
+        meta = json.load(f)
+
+    images = []
+    for tileset in meta["tilesets"]:
+        tileset_path = file_path.parent / tileset["source"]
+        with open(tileset_path) as f:
+            images.append(tileset_path.parent / json.load(f)["image"])
+    return images
+
+
+def bake_level(file_path: Path) -> bytes:
+    with open(file_path) as f:
+        meta = json.load(f)
+    if not meta.get("infinite"):
+        raise ValueError(f"{file_path}: only infinite (chunked) maps are baked")
+
+    level_dir = file_path.parent
+    strings = _Strings()
+
+    tile_sheets = bytearray()
+    for tileset in meta["tilesets"]:
+        tileset_path = level_dir / tileset["source"]
+        with open(tileset_path) as f:
+            tileset_meta = json.load(f)
+
+        # image path is stored relative to the level dir
+        image_path = Path(
+            os.path.relpath(tileset_path.parent / tileset_meta["image"], level_dir)
+        )
+        tile_sheets += struct.pack(
+            "<6I",
+            tileset["firstgid"],
+            tileset_meta["tilewidth"],
+            tileset_meta["tileheight"],
+            tileset_meta["tilecount"],
+            tileset_meta["columns"],
+            strings.add(image_path.as_posix()),
+        )
+
+    # chunks in the layers order, so they can be drawn one by one
+    chunks = bytearray()
+    tile_ids = []
+    objects = []
+    for layer in meta["layers"]:
+        for chunk in layer.get("chunks", []):
+            chunks += struct.pack(
+                "<2i3I",
+                chunk["x"],
+                chunk["y"],
+                chunk["width"],
+                chunk["height"],
+                len(tile_ids),
+            )
+            tile_ids.extend(chunk["data"])
+        objects.extend(layer.get("objects", []))
+
+    # destinations are resolved into the object indices
+    object_indices = {object_["id"]: i for i, object_ in enumerate(objects)}
+    objects_table = bytearray()
+    for object_ in objects:
+        properties = _get_object_properties(object_)
+        destination = properties.get("destination")
+        objects_table += struct.pack(
+            "<I4f2Ii",
+            object_["id"],
+            object_["x"],
+            object_["y"],
+            object_["width"],
+            object_["height"],
+            strings.add(properties.get("type", "")),
+            strings.add(properties.get("tag", "")),
+            object_indices[destination] if destination is not None else -1,
+        )
+
+    header = [
+        meta["tilewidth"],
+        meta["tileheight"],
+        len(meta["tilesets"]),
+        len(chunks) // 20,
+        len(objects),
+        len(tile_ids),
+    ]
+    tables = [
+        tile_sheets,
+        chunks,
+        objects_table,
+        struct.pack(f"<{len(tile_ids)}I", *tile_ids),
+    ]
+    return _pack_file(_LEVEL_MAGIC, header, tables, strings)
+
+
+def _pack_rect(rect: dict) -> bytes:
+    return struct.pack("<4f", rect["x"], rect["y"], rect["w"], rect["h"])
+
+
+def bake_sprite_sheet(file_path: Path) -> bytes:
+    with open(file_path) as f:
+        meta = json.load(f)
+
+    strings = _Strings()
+    animations = bytearray()
+    frames = bytearray()
+    n_frames = 0
+
+    # sorted by name, so the game finds animations by binary search
+    for name in sorted(meta["frames"], key=lambda name: name.encode()):
+        animation_frames = meta["frames"][name]
+        animations += struct.pack(
+            "<3i", strings.add(name), n_frames, len(animation_frames)
+        )
+        for frame in animation_frames:
+            frames += _pack_rect(frame["sprite"])
+            for mask_name in _MASK_NAMES:
+                mask = frame["masks"].get(mask_name)
+                if mask:
+                    frames += _pack_rect(mask)
+                else:
+                    frames += struct.pack("<4f", 0, 0, 0, 0)
+            n_frames += 1
+
+    header = [len(meta["frames"]), n_frames]
+    return _pack_file(_SPRITE_SHEET_MAGIC, header, [animations, frames], strings)
+
+
+def _paeth(a: int, b: int, c: int) -> int:
+    p = a + b - c
+    pa = abs(p - a)
+    pb = abs(p - b)
+    pc = abs(p - c)
+    if pa <= pb and pa <= pc:
+        return a
+    return b if pb <= pc else c
+
+
+def _read_png(file_path: Path) -> tuple:
+    """Returns width, height and the RGBA rows of the 8 bit RGB or RGBA
+    non-interlaced png, which are the only ones the resources use.
+    """
+    with open(file_path, "rb") as f:
+        data = f.read()
+    if data[:8] != b"\x89PNG\r\n\x1a\n":
+        raise ValueError(f"{file_path}: not a png")
+
+    pos = 8
+    idat = bytearray()
+    while pos < len(data):
+        size, type_ = struct.unpack(">I4s", data[pos : pos + 8])
+        chunk = data[pos + 8 : pos + 8 + size]
+        if type_ == b"IHDR":
+            width, height, depth, color_type, _, _, interlace = struct.unpack(
+                ">2I5B", chunk
+            )
+        elif type_ == b"IDAT":
+            idat += chunk
+        pos += 12 + size
+    if depth != 8 or color_type not in (2, 6) or interlace:
+        raise ValueError(f"{file_path}: only 8 bit RGB(A) pngs are supported")
+
+    n_channels = 4 if color_type == 6 else 3
+    stride = width * n_channels
+    raw = zlib.decompress(idat)
+    rows = []
+    prev = bytearray(stride)
+    for y in range(height):
+        pos = y * (stride + 1)
+        filter_ = raw[pos]
+        row = bytearray(raw[pos + 1 : pos + 1 + stride])
+        if filter_ == 1:
+            for i in range(n_channels, stride):
+                row[i] = (row[i] + row[i - n_channels]) & 0xFF
+        elif filter_ == 2:
+            row = bytearray((a + b) & 0xFF for a, b in zip(row, prev))
+        elif filter_ == 3:
+            for i in range(stride):
+                left = row[i - n_channels] if i >= n_channels else 0
+                row[i] = (row[i] + ((left + prev[i]) >> 1)) & 0xFF
+        elif filter_ == 4:
+            for i in range(stride):
+                if i >= n_channels:
+                    left = row[i - n_channels]
+                    up_left = prev[i - n_channels]
+                else:
+                    left = up_left = 0
+                row[i] = (row[i] + _paeth(left, prev[i], up_left)) & 0xFF
+        rows.append(row)
+        prev = row
+
+    if n_channels == 3:
+        for y, row in enumerate(rows):
+            rgba = bytearray(b"\xff" * (4 * width))
+            for i in range(3):
+                rgba[i::4] = row[i::3]
+            rows[y] = rgba
+    return width, height, rows
+
+
+def _write_file(file_path: Path, data: bytes):
+    """Writes the data aside and renames it over the file. The running game
+    maps the baked files, so they are never truncated in place: the old
+    inode stays valid until the game remaps it.
+    """
+    tmp_file_path = file_path.with_suffix(file_path.suffix + ".tmp")
+    with open(tmp_file_path, "wb") as f:
+        f.write(data)
+    os.replace(tmp_file_path, file_path)
+
+
+def _write_png(file_path: Path, width: int, height: int, rows: list):
+    def pack_chunk(type_: bytes, data: bytes) -> bytes:
+        crc = zlib.crc32(type_ + data)
+        return struct.pack(">I", len(data)) + type_ + data + struct.pack(">I", crc)
+
+    raw = b"".join(b"\0" + bytes(row) for row in rows)
+    header = struct.pack(">2I5B", width, height, 8, 6, 0, 0, 0)
+    data = (
+        b"\x89PNG\r\n\x1a\n"
+        + pack_chunk(b"IHDR", header)
+        + pack_chunk(b"IDAT", zlib.compress(raw, 9))
+        + pack_chunk(b"IEND", b"")
+    )
+    _write_file(file_path, data)
+
+
+def bake_atlas(image_paths: list) -> tuple:
+    """Packs the images into shelves, the tallest first. Returns the atlas
+    rows and the baked atlas meta.
+    """
+    images = []
+    for file_path in image_paths:
+        width, height, rows = _read_png(file_path)
+        name = Path(os.path.relpath(file_path, _ROOT_DIR)).as_posix()
+        images.append((name, width, height, rows))
+    images.sort(key=lambda image: (-image[2], image[0]))
+
+    rects = []
+    x = y = shelf_height = 0
+    for name, width, height, _ in images:
+        padded_width = width + 2 * _ATLAS_PADDING
+        padded_height = height + 2 * _ATLAS_PADDING
+        if padded_width > _ATLAS_WIDTH:
+            raise ValueError(f"{name}: doesn't fit the atlas width")
+        if x + padded_width > _ATLAS_WIDTH:
+            x = 0
+            y += shelf_height
+            shelf_height = 0
+        rects.append((x + _ATLAS_PADDING, y + _ATLAS_PADDING))
+        x += padded_width
+        shelf_height = max(shelf_height, padded_height)
+
+    atlas_height = 1
+    while atlas_height < y + shelf_height:
+        atlas_height *= 2
+
+    atlas_rows = [bytearray(4 * _ATLAS_WIDTH) for _ in range(atlas_height)]
+    strings = _Strings()
+    images_table = bytearray()
+    for (name, width, height, rows), (x, y) in zip(images, rects):
+        p = _ATLAS_PADDING
+        for i in range(-p, height + p):
+            row = rows[min(max(i, 0), height - 1)]
+            padded_row = row[:4] * p + row + row[-4:] * p
+            atlas_rows[y + i][4 * (x - p) : 4 * (x + width + p)] = padded_row
+        images_table += struct.pack(
+            "<5I", strings.add(name), x, y, width, height
+        )
+
+    header = [_ATLAS_WIDTH, atlas_height, len(images)]
+    data = _pack_file(_ATLAS_MAGIC, header, [images_table], strings)
+    return atlas_rows, data
+
+
+def _premultiply(row: bytearray) -> bytearray:
+    row = bytearray(row)
+    for i in range(3, len(row), 4):
+        alpha = row[i]
+        if alpha == 255:
+            continue
+        for j in range(i - 3, i):
+            row[j] = (row[j] * alpha + 127) // 255
+    return row
+
+
+def bake_texture(width: int, rows: list) -> bytes:
+    bands_table = bytearray()
+    bands_data = bytearray()
+    for y in range(0, len(rows), _TEXTURE_BAND_HEIGHT):
+        band = b"".join(_premultiply(row) for row in rows[y : y + _TEXTURE_BAND_HEIGHT])
+        if _TEXTURE_FORMAT == _TEXTURE_DEFLATE:
+            # raw deflate stream, as raylib's DecompressData expects
+            compressor = zlib.compressobj(9, zlib.DEFLATED, -15)
+            band = compressor.compress(band) + compressor.flush()
+        bands_table += struct.pack("<2I", len(bands_data), len(band))
+        bands_data += band + b"\0" * (-len(band) % 4)
+
+    n_bands = len(bands_table) // 8
+    header = [width, len(rows), _TEXTURE_FORMAT, _TEXTURE_BAND_HEIGHT, n_bands]
+    return _pack_file(_TEXTURE_MAGIC, header, [bands_table, bands_data], _Strings())
+
+
+def _bake(file_path: Path, data: bytes, suffix=".bin"):
+    out_file_path = file_path.with_suffix(suffix)
+    _write_file(out_file_path, data)
+    name = os.path.relpath(out_file_path, _ROOT_DIR)
+    print(f"{name}: {len(data)} bytes")
+
+
+if __name__ == "__main__":
+    # the same image is referred by the different relative paths
+    atlas_images = set()
+    for file_path in sorted(_TILED_DIR.rglob("*.json")):
+        with open(file_path) as f:
+            is_map = json.load(f).get("type") == "map"
+        if is_map:
+            _bake(file_path, bake_level(file_path))
+            for image_path in _get_level_images(file_path):
+                atlas_images.add(Path(os.path.normpath(image_path)))
+
+    for file_path in sorted(_SPRITE_SHEETS_DIR.glob("*.json")):
+        _bake(file_path, bake_sprite_sheet(file_path))
+        atlas_images.add(Path(os.path.normpath(file_path.with_suffix(".png"))))
+
+    atlas_rows, atlas_data = bake_atlas(sorted(atlas_images))
+    _write_png(_ATLAS_FILE_PATH, _ATLAS_WIDTH, len(atlas_rows), atlas_rows)
+    name = os.path.relpath(_ATLAS_FILE_PATH, _ROOT_DIR)
+    print(f"{name}: {_ATLAS_WIDTH}x{len(atlas_rows)}")
+    _bake(_ATLAS_FILE_PATH, atlas_data)
+    _bake(_ATLAS_FILE_PATH, bake_texture(_ATLAS_WIDTH, atlas_rows), ".tex")
@@ -0,0 +1,190 @@
+"""Generates a synthetic Tiled map for the benchmarks and bakes it.
+
+The level is a row of tile chunks (a wall background and a ground floor)
+with the requested numbers of rigid colliders, mobs, lights and platforms
+scattered over it. The tile sheets are the ones of level_0, so the level
+is drawn from the already baked atlas. Generation is seeded, the same
+arguments always give the same level.
+
+    python3 ./tools/generate_stress_level.py resources/tiled/bench/large.json \
+        --n-chunks 16 --n-colliders 512 --n-mobs 1024 --n-lights 128
+"""
+
+import argparse
+import json
+import os
+import random
+from pathlib import Path
+
+from bake_resources import _TILED_DIR, _bake, bake_level
+
+_CHUNK_SIZE = 16
+_TILE_SIZE = 16
+_CHUNK_WIDTH = _CHUNK_SIZE * _TILE_SIZE
+
+# level_0 tile sheets and the most common tiles of its layers
+_TILESETS = (
+    {"firstgid": 1, "source": "ground.json"},
+    {"firstgid": 267, "source": "walls.json"},
+    {"firstgid": 1291, "source": "wood_env.json"},
+)
+_WALL_TILE_ID = 675
+_GROUND_TILE_ID = 21
+
+_MOB_TYPES = ("bat", "wolf", "golem")
+
+
+def _parse_args():
+    args = argparse.ArgumentParser()
+    args.add_argument("out_file_path", type=str)
+    args.add_argument("--n-chunks", type=int, default=8)
+    args.add_argument("--n-colliders", type=int, default=64)
+    args.add_argument("--n-mobs", type=int, default=64)
+    args.add_argument("--n-lights", type=int, default=16)
+    args.add_argument("--n-platforms", type=int, default=8)
+    args.add_argument("--seed", type=int, default=0)
+
+    return args.parse_args()
+
+
+def _get_chunk(x: int, y: int, tile_id_fn) -> dict:
+    data = [
+        tile_id_fn(row, col) for row in range(_CHUNK_SIZE) for col in range(_CHUNK_SIZE)
+    ]
+    return {
+        "data": data,
+        "height": _CHUNK_SIZE,
+        "width": _CHUNK_SIZE,
+        "x": x,
+        "y": y,
+    }
+
+
+def _get_tile_layer(id_: int, name: str, n_chunks: int, tile_id_fn) -> dict:
+    chunks = [_get_chunk(i * _CHUNK_SIZE, 0, tile_id_fn) for i in range(n_chunks)]
+    return {
+        "chunks": chunks,
+        "height": _CHUNK_SIZE,
+        "id": id_,
+        "name": name,
+        "opacity": 1,
+        "startx": 0,
+        "starty": 0,
+        "type": "tilelayer",
+        "visible": True,
+        "width": n_chunks * _CHUNK_SIZE,
+        "x": 0,
+        "y": 0,
+    }
+
+
+def _get_property_type(name: str) -> str:
+    return "object" if name == "destination" else "string"
+
+
+class _Objects:
+    def __init__(self):
+        self.objects = []
+
+    def add(self, type_: str, x: float, y: float, w=0.0, h=0.0, **properties):
+        id_ = len(self.objects) + 1
+        properties = {"type": type_, **properties} if type_ else properties
+        object_ = {
+            "height": h,
+            "id": id_,
+            "name": "",
+            "properties": [
+                {"name": k, "type": _get_property_type(k), "value": v}
+                for k, v in properties.items()
+            ],
+            "rotation": 0,
+            "type": "",
+            "visible": True,
+            "width": w,
+            "x": x,
+            "y": y,
+        }
+        if w == 0.0 and h == 0.0:
+            object_["point"] = True
+        self.objects.append(object_)
+        return id_
+
+
+def generate_level(args) -> dict:
+    rng = random.Random(args.seed)
+    width = args.n_chunks * _CHUNK_WIDTH
+    floor_y = _CHUNK_WIDTH - _TILE_SIZE
+
+    # object ids are unique over all the layers
+    objects = _Objects()
+    objects.add("rigid_collider", 0, floor_y, width, _TILE_SIZE)
+    objects.add("rigid_collider", 0, 0, _TILE_SIZE, floor_y)
+    objects.add("rigid_collider", width - _TILE_SIZE, 0, _TILE_SIZE, floor_y)
+    for _ in range(args.n_colliders):
+        w = _TILE_SIZE * rng.randint(1, 4)
+        x = rng.uniform(_TILE_SIZE, width - _TILE_SIZE - w)
+        y = rng.uniform(4 * _TILE_SIZE, floor_y - 3 * _TILE_SIZE)
+        objects.add("rigid_collider", x, y, w, _TILE_SIZE)
+
+    n_colliders = len(objects.objects)
+    objects.add("player", width / 2, floor_y - _TILE_SIZE)
+    for _ in range(args.n_mobs):
+        type_ = rng.choice(_MOB_TYPES)
+        x = rng.uniform(2 * _TILE_SIZE, width - 2 * _TILE_SIZE)
+        y = floor_y - (4 * _TILE_SIZE if type_ == "bat" else 1)
+        objects.add(type_, x, y)
+    for _ in range(args.n_lights):
+        x = rng.uniform(2 * _TILE_SIZE, width - 2 * _TILE_SIZE)
+        objects.add("light", x, 2 * _TILE_SIZE, tag="0")
+    for _ in range(args.n_platforms):
+        x = rng.uniform(2 * _TILE_SIZE, width - 2 * _TILE_SIZE)
+        end_id = len(objects.objects) + 2
+        objects.add("platform", x, 6 * _TILE_SIZE, tag="0", destination=end_id)
+        objects.add("", x, floor_y - 2 * _TILE_SIZE)
+
+    def get_ground_tile_id(row, col):
+        return _GROUND_TILE_ID if row == _CHUNK_SIZE - 1 else 0
+
+    level_dir = Path(args.out_file_path).parent
+    tilesets = [
+        {
+            "firstgid": tileset["firstgid"],
+            "source": os.path.relpath(_TILED_DIR / tileset["source"], level_dir),
+        }
+        for tileset in _TILESETS
+    ]
+    return {
+        "height": _CHUNK_SIZE,
+        "infinite": True,
+        "layers": [
+            _get_tile_layer(1, "walls", args.n_chunks, lambda row, col: _WALL_TILE_ID),
+            _get_tile_layer(2, "ground", args.n_chunks, get_ground_tile_id),
+            {
+                "id": 3,
+                "name": "colliders",
+                "objects": objects.objects[:n_colliders],
+                "type": "objectgroup",
+            },
+            {
+                "id": 4,
+                "name": "creatures",
+                "objects": objects.objects[n_colliders:],
+                "type": "objectgroup",
+            },
+        ],
+        "orientation": "orthogonal",
+        "tileheight": _TILE_SIZE,
+        "tilesets": tilesets,
+        "tilewidth": _TILE_SIZE,
+        "type": "map",
+        "width": args.n_chunks * _CHUNK_SIZE,
+    }
+
+
+if __name__ == "__main__":
+    args = _parse_args()
+    file_path = Path(args.out_file_path)
+    file_path.parent.mkdir(parents=True, exist_ok=True)
+    with open(file_path, "w") as f:
+        json.dump(generate_level(args), f)
+    _bake(file_path, bake_level(file_path))